@@ -0,0 +1,192 @@
+#include "block_cache.h"
+#include <unistd.h>
+
+using namespace Trinity;
+
+BlockCache::BlockCache(const size_t capacity)
+    : shardCapacity{std::max<size_t>(capacity / SHARDS_CNT, 1)}
+{
+}
+
+BlockCache::~BlockCache()
+{
+        for (auto &s : shards)
+        {
+                for (auto it : s.map)
+                        release(it.second);
+        }
+}
+
+void BlockCache::lru_unlink(shard &s, block *const b)
+{
+        if (b->prev)
+                b->prev->next = b->next;
+        else
+                s.lruHead = b->next;
+
+        if (b->next)
+                b->next->prev = b->prev;
+        else
+                s.lruTail = b->prev;
+}
+
+void BlockCache::lru_push_front(shard &s, block *const b)
+{
+        b->prev = nullptr;
+        b->next = s.lruHead;
+        if (s.lruHead)
+                s.lruHead->prev = b;
+        else
+                s.lruTail = b;
+        s.lruHead = b;
+}
+
+void BlockCache::evict(shard &s, const size_t required)
+{
+        // Prefer blocks that are not pinned; pinned blocks are only evicted if we have to, and
+        // they will be released when they are unpinned
+        for (auto it = s.lruTail; it && s.used + required > shardCapacity;)
+        {
+                auto prev = it->prev;
+
+                if (it->rc.load(std::memory_order_relaxed) == 1)
+                {
+                        lru_unlink(s, it);
+                        s.map.erase(it->key);
+                        s.used -= it->size;
+                        stats.evicted.fetch_add(1, std::memory_order_relaxed);
+                        release(it);
+                }
+                it = prev;
+        }
+
+        while (s.used + required > shardCapacity && s.lruTail)
+        {
+                auto it = s.lruTail;
+
+                lru_unlink(s, it);
+                s.map.erase(it->key);
+                s.used -= it->size;
+                stats.evicted.fetch_add(1, std::memory_order_relaxed);
+                release(it);
+        }
+}
+
+void BlockCache::acquire(const uint32_t fileID, const int fd, const uint32_t offset, const uint32_t size, pin *const out)
+{
+        const auto key = make_key(fileID, offset);
+        const auto h = std::hash<uint64_t>{}(key);
+        auto &s = shards[h % SHARDS_CNT];
+
+        out->reset();
+
+        {
+                std::lock_guard<std::mutex> g(s.lock);
+                const auto it = s.map.find(key);
+
+                if (it != s.map.end())
+                {
+                        auto b = it->second;
+
+                        // blocks are whole postings chunks, so a (file, offset) always identifies the same block
+                        Dexpect(b->size == size);
+                        b->rc.fetch_add(1, std::memory_order_relaxed);
+                        lru_unlink(s, b);
+                        lru_push_front(s, b);
+                        out->b = b;
+                        stats.hits.fetch_add(1, std::memory_order_relaxed);
+                        return;
+                }
+        }
+
+        // Not holding the lock while we are reading the block
+        auto b = static_cast<block *>(std::malloc(sizeof(block) + size));
+
+        if (unlikely(!b))
+                throw Switch::data_error("Failed to allocate block");
+
+        b->key = key;
+        b->size = size;
+        b->rc.store(1, std::memory_order_relaxed); // the pin
+
+        for (uint32_t n{0}; n != size;)
+        {
+                const auto r = pread64(fd, b->data + n, size - n, offset + n);
+
+                if (r == -1)
+                {
+                        if (errno == EINTR)
+                                continue;
+
+                        std::free(b);
+                        throw Switch::system_error("pread() failed");
+                }
+                else if (unlikely(r == 0))
+                {
+                        std::free(b);
+                        throw Switch::data_error("Unexpected end of file");
+                }
+
+                n += r;
+        }
+
+        stats.misses.fetch_add(1, std::memory_order_relaxed);
+        stats.bytesRead.fetch_add(size, std::memory_order_relaxed);
+        out->b = b;
+
+        if (size > shardCapacity)
+        {
+                stats.rejected.fetch_add(1, std::memory_order_relaxed);
+                return;
+        }
+
+        std::lock_guard<std::mutex> g(s.lock);
+        const auto res = s.map.insert({key, b});
+
+        if (!res.second)
+        {
+                // someone else read it in the meantime; use theirs
+                auto other = res.first->second;
+
+                other->rc.fetch_add(1, std::memory_order_relaxed);
+                lru_unlink(s, other);
+                lru_push_front(s, other);
+                out->b = other;
+                release(b);
+                return;
+        }
+
+        if (s.used + size > shardCapacity)
+        {
+                auto &slot = s.doorkeeper[(h / SHARDS_CNT) % DOORKEEPER_SIZE];
+
+                if (slot != key)
+                {
+                        // first miss; don't admit it yet
+                        slot = key;
+                        s.map.erase(res.first);
+                        stats.rejected.fetch_add(1, std::memory_order_relaxed);
+                        return;
+                }
+
+                evict(s, size);
+        }
+
+        b->rc.fetch_add(1, std::memory_order_relaxed); // the cache's reference
+        lru_push_front(s, b);
+        s.used += size;
+}
+
+size_t BlockCache::size()
+{
+        size_t res{0};
+
+        for (auto &s : shards)
+        {
+                std::lock_guard<std::mutex> g(s.lock);
+
+                res += s.used;
+        }
+
+        return res;
+}
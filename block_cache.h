@@ -0,0 +1,153 @@
+#pragma once
+#include "common.h"
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+
+namespace Trinity
+{
+        // A sharded, size-bounded cache of file data blocks, read via pread()
+        //
+        // Segments are memory mapped by default, which means we have no control over what's evicted when the index is larger than RAM, and
+        // query threads may stall on page faults, unpredictably. If you provide a BlockCache to SegmentIndexSource, decoders will
+        // instead read each term's postings chunk(s) into the cache and pin them for as long as they are accessing them.
+        //
+        // Blocks are keyed by (file, offset), and they are never partially cached; a block is a whole posting list chunk, so that codecs
+        // don't need to deal with block boundaries. Blocks larger than a shard's capacity are never cached.
+        //
+        // Eviction is LRU, per shard. Admission is guarded by a `doorkeeper`: when a shard is full, a block will only
+        // be admitted on its second miss within a short window, so that one-off accesses(e.g a scan over rarely queried terms) won't flush
+        // the cache. Blocks not admitted are still returned, and are released as soon as they are unpinned.
+        class BlockCache final
+        {
+              private:
+                struct block final
+                {
+                        uint64_t key;
+                        uint32_t size;
+                        // one reference is held by the cache itself, if the block is cached, and one for each pin
+                        std::atomic<uint32_t> rc;
+                        block *prev, *next; // LRU list links; only accessed under the shard lock
+                        uint8_t data[0];
+                };
+
+                static constexpr size_t SHARDS_CNT{16};
+                static constexpr size_t DOORKEEPER_SIZE{4096};
+
+                struct alignas(64) shard final
+                {
+                        std::mutex lock;
+                        std::unordered_map<uint64_t, block *> map;
+                        block *lruHead{nullptr}, *lruTail{nullptr}; // head is most recently used
+                        size_t used{0};
+                        uint64_t doorkeeper[DOORKEEPER_SIZE]{0};
+                };
+
+                const size_t shardCapacity;
+                shard shards[SHARDS_CNT];
+                std::atomic<uint32_t> nextFileID{1};
+
+              public:
+                struct cache_stats final
+                {
+                        std::atomic<uint64_t> hits{0};
+                        std::atomic<uint64_t> misses{0};
+                        std::atomic<uint64_t> bytesRead{0};
+                        std::atomic<uint64_t> rejected{0}; // blocks not admitted
+                        std::atomic<uint64_t> evicted{0};
+                } stats;
+
+                // A pinned block; the data are valid until the pin is reset or destroyed
+                class pin final
+                {
+                        friend class BlockCache;
+
+                      private:
+                        block *b{nullptr};
+
+                      public:
+                        pin() = default;
+
+                        pin(const pin &) = delete;
+
+                        pin(pin &&o)
+                            : b{o.b}
+                        {
+                                o.b = nullptr;
+                        }
+
+                        pin &operator=(pin &&o)
+                        {
+                                if (this != &o)
+                                {
+                                        reset();
+                                        b = o.b;
+                                        o.b = nullptr;
+                                }
+                                return *this;
+                        }
+
+                        inline const uint8_t *data() const noexcept
+                        {
+                                return b ? b->data : nullptr;
+                        }
+
+                        inline uint32_t size() const noexcept
+                        {
+                                return b ? b->size : 0;
+                        }
+
+                        void reset()
+                        {
+                                if (b)
+                                {
+                                        BlockCache::release(b);
+                                        b = nullptr;
+                                }
+                        }
+
+                        ~pin()
+                        {
+                                reset();
+                        }
+                };
+
+              private:
+                static void release(block *const b)
+                {
+                        if (b->rc.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                                std::free(b);
+                }
+
+                static inline uint64_t make_key(const uint32_t fileID, const uint32_t offset) noexcept
+                {
+                        return (uint64_t(fileID) << 32) | offset;
+                }
+
+                void lru_unlink(shard &s, block *const b);
+
+                void lru_push_front(shard &s, block *const b);
+
+                void evict(shard &s, const size_t required);
+
+              public:
+                // `capacity` is the total size(in bytes) of all cached blocks(not including blocks that were not admitted and are still pinned)
+                BlockCache(const size_t capacity);
+
+                ~BlockCache();
+
+                // Returns a new ID for a file; blocks are keyed by (fileID, offset)
+                // IDs are never reused, so blocks of files no longer accessed will just eventually get evicted
+                uint32_t register_file()
+                {
+                        return nextFileID.fetch_add(1, std::memory_order_relaxed);
+                }
+
+                // Pins the block of `size` bytes at `offset` of the file `fd`, reading it from the file if it's not cached
+                // Throws Switch::system_error if pread() fails
+                void acquire(const uint32_t fileID, const int fd, const uint32_t offset, const uint32_t size, pin *const out);
+
+                // Total bytes in cached blocks
+                size_t size();
+        };
+}
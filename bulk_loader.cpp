@@ -0,0 +1,141 @@
+#include "bulk_loader.h"
+#include "indexer.h"
+#include "terms.h"
+#include "utils.h"
+#include <fcntl.h>
+#include <switch_bitops.h>
+
+using namespace Trinity;
+
+SegmentBulkLoader::SegmentBulkLoader(Trinity::Codecs::IndexSession *s)
+    : sess{s}, enc(s->new_encoder())
+{
+        indexPath.append(sess->basePath, "/index.t");
+        indexFd = open(indexPath.c_str(), O_WRONLY | O_CREAT | O_LARGEFILE | O_TRUNC, 0775);
+
+        if (indexFd == -1)
+                throw Switch::system_error("Failed to persist index: ", indexPath.AsS32());
+
+        sess->begin();
+}
+
+SegmentBulkLoader::~SegmentBulkLoader()
+{
+        if (indexFd != -1)
+                close(indexFd);
+}
+
+void SegmentBulkLoader::end_term()
+{
+        term_index_ctx tctx;
+
+        enc->end_document();
+        enc->end_term(&tctx);
+        terms.push_back({curTerm, tctx});
+
+        if (flushFreq && sess->indexOut.size() > flushFreq)
+                sess->flush_index(indexFd);
+}
+
+void SegmentBulkLoader::begin_term(const str8_t term)
+{
+        if (unlikely(!term || term.size() > Limits::MaxTermLength))
+                throw Switch::data_error("Unexpected term [", term, "]");
+
+        if (curTerm)
+        {
+                if (unlikely(terms_cmp(term.data(), term.size(), curTerm.data(), curTerm.size()) <= 0))
+                        throw Switch::data_error("Unexpected term [", term, "]: terms must be provided in ascending order");
+                else if (unlikely(!curDocument))
+                        throw Switch::data_error("No documents for term [", curTerm, "]");
+
+                end_term();
+        }
+
+        curTerm.Set(allocator.CopyOf(term.data(), term.size()), term.size());
+        curDocument = 0;
+        enc->begin_term();
+}
+
+void SegmentBulkLoader::begin_document(const docid_t documentID)
+{
+        if (unlikely(!curTerm))
+                throw Switch::data_error("Unexpected document ", documentID, ": no term");
+        else if (unlikely(documentID <= curDocument))
+                throw Switch::data_error("Unexpected document ", documentID, " for term [", curTerm, "]: documents must be provided in ascending order");
+
+        if (curDocument)
+                enc->end_document();
+
+        const auto idx = documentID / 64;
+
+        if (idx >= documents.size())
+                documents.resize(idx + 1, 0);
+        documents[idx] |= uint64_t(1) << (documentID & 63);
+
+        enc->begin_document(documentID);
+        curDocument = documentID;
+        lastPos = 0;
+}
+
+void SegmentBulkLoader::new_hit(const tokenpos_t position, const range_base<const uint8_t *, const uint8_t> payload)
+{
+        if (unlikely(!curDocument))
+                throw Switch::data_error("Unexpected hit: no document");
+        else if (unlikely(position < lastPos))
+                throw Switch::data_error("Unexpected position ", position, " for term [", curTerm, "] in document ", curDocument, ": positions must be provided in ascending order");
+        else if (unlikely(position > Limits::MaxPosition))
+                throw Switch::data_error("Unexpected position ", position, " for term [", curTerm, "] in document ", curDocument, ": exceeds Limits::MaxPosition");
+
+        enc->new_hit(position, payload);
+        lastPos = position;
+        maxPosition = std::max(maxPosition, position);
+}
+
+uint64_t SegmentBulkLoader::total_documents() const noexcept
+{
+        uint64_t n{0};
+
+        for (const auto v : documents)
+                n += SwitchBitOps::PopCnt(v);
+
+        return n;
+}
+
+void SegmentBulkLoader::commit()
+{
+        if (curTerm)
+        {
+                if (unlikely(!curDocument))
+                        throw Switch::data_error("No documents for term [", curTerm, "]");
+
+                end_term();
+                curTerm.reset();
+        }
+
+        const uint64_t indexedDocuments = total_documents();
+
+        // pack_terms() sorts them anyway
+        sess->persist_terms(terms);
+
+        if (Utilities::to_file(reinterpret_cast<const char *>(&indexedDocuments), sizeof(indexedDocuments), Buffer{}.append(sess->basePath, "/documents").c_str()) == -1)
+                throw Switch::system_error("Failed to persist documents count");
+
+        if (maxPosition && Utilities::to_file(reinterpret_cast<const char *>(&maxPosition), sizeof(maxPosition), Buffer{}.append(sess->basePath, "/max_position").c_str()) == -1)
+                throw Switch::system_error("Failed to persist max position");
+
+        persist_segment(sess, updatedDocumentIDs, indexFd);
+
+        if (fsync(indexFd) == -1)
+                throw Switch::data_error("Failed to persist index");
+
+        if (close(indexFd) == -1)
+        {
+                indexFd = -1;
+                throw Switch::data_error("Failed to persist index");
+        }
+
+        indexFd = -1;
+        if (rename(indexPath.c_str(), Buffer{}.append(strwlen32_t(indexPath.data(), indexPath.size() - 2)).c_str()) == -1)
+                throw Switch::system_error("Failed to persist index");
+}
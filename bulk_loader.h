@@ -0,0 +1,71 @@
+#pragma once
+#include "codecs.h"
+#include <switch_mallocators.h>
+
+namespace Trinity
+{
+        // Builds a segment from a stream of postings that is already sorted by (term, document, position), e.g when rebuilding an index
+        // from another system that has the postings in that order.
+        //
+        // SegmentIndexSession needs to buffer all hits per document, and then regroup them per term in commit(), whereas
+        // this class feeds the postings straight to the codec's Encoder, so that the only state retained is the terms dictionary.
+        //
+        // Terms must be provided in ascending order(see terms_cmp()), documents in ascending order for each term, and positions in
+        // ascending order for each document; otherwise Switch::data_error is thrown.
+        // You can use SegmentIndexSource to load the segment once you commit() it.
+        class SegmentBulkLoader final
+        {
+              private:
+                Trinity::Codecs::IndexSession *const sess;
+                std::unique_ptr<Trinity::Codecs::Encoder> enc;
+                Buffer indexPath;
+                int indexFd;
+                simple_allocator allocator;
+                std::vector<std::pair<str8_t, term_index_ctx>> terms;
+                std::vector<docid_t> updatedDocumentIDs;
+                // one bit per document ID; see total_documents()
+                std::vector<uint64_t> documents;
+                str8_t curTerm;
+                docid_t curDocument{0};
+                tokenpos_t lastPos{0};
+                tokenpos_t maxPosition{0}; // see SegmentIndexSource::max_indexed_position()
+                uint32_t flushFreq{0};
+
+              private:
+                void end_term();
+
+              public:
+                // Invokes s->begin(); the segment is persisted in s->basePath
+                SegmentBulkLoader(Trinity::Codecs::IndexSession *s);
+
+                ~SegmentBulkLoader();
+
+                // When != 0, whenever the session's indexOut size exceeds that value, the index will be flushed
+                void set_flush_freq(const uint32_t n)
+                {
+                        flushFreq = n;
+                }
+
+                // Begins the postings of `term`, and ends the postings of the previous term, if any
+                void begin_term(const str8_t term);
+
+                // Begins a document of the current term
+                void begin_document(const docid_t documentID);
+
+                // A hit of the current term in the current document; positions must be ascending and no higher than Limits::MaxPosition
+                void new_hit(const tokenpos_t position, const range_base<const uint8_t *, const uint8_t> payload = {});
+
+                // `documentID` masks any document with the same ID in older segments; see SegmentIndexSession::erase()
+                // You should use this for all documents that update documents indexed in other segments, and for erased documents
+                void mask(const docid_t documentID)
+                {
+                        updatedDocumentIDs.push_back(documentID);
+                }
+
+                // Distinct documents provided so far
+                uint64_t total_documents() const noexcept;
+
+                // Persists the segment: index, terms, masked documents, and codec
+                void commit();
+        };
+}
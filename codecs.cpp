@@ -16,6 +16,33 @@ void Trinity::Codecs::IndexSession::flush_index(int fd)
         }
 }
 
+void Trinity::Codecs::IndexSession::flush_index(int fd, const uint32_t alignment)
+{
+        const auto end = indexOutFlushed + indexOut.size();
+        const auto aligned = end - end % alignment;
+
+        if (aligned > indexOutFlushed)
+        {
+                const auto n = aligned - indexOutFlushed;
+
+                if (Utilities::to_file(indexOut.data(), n, fd) == -1)
+                        throw Switch::data_error("Failed to flush index");
+
+                indexOutFlushed += n;
+                indexOut.erase(0, n);
+        }
+}
+
+void Trinity::Codecs::IndexSession::append_partition(IndexSession *partition, term_index_ctx *tctxs, const size_t cnt)
+{
+        const auto base = indexOut.size() + indexOutFlushed;
+
+        for (size_t i{0}; i != cnt; ++i)
+                tctxs[i].indexChunk.offset += base;
+
+        indexOut.serialize(partition->indexOut.data(), partition->indexOut.size());
+}
+
 void Trinity::Codecs::IndexSession::persist_terms(std::vector<std::pair<str8_t, term_index_ctx>> &v)
 {
         IOBuffer data, index;
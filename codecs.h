@@ -3,6 +3,7 @@
 #include "docidupdates.h"
 #include "docwordspace.h"
 #include "runtime.h"
+#include "block_cache.h"
 
 namespace Trinity
 {
@@ -104,6 +105,16 @@ namespace Trinity
                         // Demonstrates how you should update indexOutFlushed
                         void flush_index(int fd);
 
+                        // Flushes indexOut upto the last multiple of `alignment`(in the index file), and retains the remainder, so that writes
+                        // are large and aligned to the file system blocks. You should only flush in between terms.
+                        void flush_index(int fd, const uint32_t alignment);
+
+                        // Codecs that buffer data for other files besides indexOut(e.g lucene's hits.data) should flush them to those files whenever
+                        // they grow larger than `f` bytes, so that memory use remains bounded; see MergeCandidatesCollection::merge()
+                        virtual void set_flush_freq(const uint32_t f)
+                        {
+                        }
+
                         // Handy utility function
                         // see SegmentIndexSession::commit()
                         void persist_terms(std::vector<std::pair<str8_t, term_index_ctx>> &);
@@ -161,6 +172,21 @@ namespace Trinity
                         };
 
                         virtual void merge(merge_participant *participants, const uint16_t participantsCnt, Encoder *const encoder) = 0;
+
+                        // Parallel encoding support; see SegmentIndexSession::set_encoding_threads()
+                        // Returns a new in-memory session of the same codec, which another thread can use to encode a partition of the terms(via its own encoder).
+                        // You shouldn't begin() or end() it; its output is appended to this session with append_partition()
+                        // Codecs that don't support this should return nullptr, and the terms will be encoded serially.
+                        virtual IndexSession *new_partition()
+                        {
+                                return nullptr;
+                        }
+
+                        // Appends the output of a session created by new_partition() to this session, and relocates the indexChunk of each of the
+                        // `cnt` terms encoded in it(`tctxs`), so that they point to their chunks in this session's index.
+                        // The default implementation is suitable for codecs that don't use offsets relative to the index base in their chunks, or other
+                        // files(e.g lucene's hits.data)
+                        virtual void append_partition(IndexSession *partition, term_index_ctx *tctxs, const size_t cnt);
                 };
 
                 // Encoder interface for encoding a single term's posting list
@@ -217,6 +243,9 @@ namespace Trinity
                                 tokenpos_t freq;
                         } curDocument;
 
+                        // If not set, the decoder accesses the memory mapped index even if the access proxy uses a block cache; see AccessProxy::new_decoder()
+                        bool useBlockCache{true};
+
                         // Before iterating via next(), you need to begin()
                         //
                         // If you do not intend to iterate the documents list, and only wish to seek documents
@@ -285,13 +314,23 @@ namespace Trinity
                         // something other specific to the codec
                         const uint8_t *const indexPtr;
 
+                        // If set, decoders will read postings chunks into this cache via pread(), instead of accessing them via indexPtr
+                        // See use_block_cache() and index_data()
+                        BlockCache *blockCache{nullptr};
+                        int indexFD{-1};
+                        uint32_t indexFileID{0};
+
                         // Utility function: returns an initialised new decoder for a term's posting list
                         // Some codecs(e.g lucene's) may need to access the filesystem and/or other codec specific state
                         // AccessProxy faciliates that (this is effectively a pointer to self)
                         //
                         // XXX: Make sure you Decoder::init() before you return from the method
                         // see e.g Google::AccessProxy::new_decoder()
-                        virtual Decoder *new_decoder(const term_index_ctx &tctx) = 0;
+                        //
+                        // Set `useBlockCache` to false if you are going to iterate the whole postings list(e.g merges), so that the
+                        // decoder will access the memory mapped index instead of reading the postings into the block cache(see use_block_cache())
+                        // That's sequential access, for which mmap is optimal, and it would otherwise evict the blocks queries need.
+                        virtual Decoder *new_decoder(const term_index_ctx &tctx, const bool useBlockCache = true) = 0;
 
                         AccessProxy(const char *bp, const uint8_t *index_ptr)
                             : basePath{bp}, indexPtr{index_ptr}
@@ -302,8 +341,47 @@ namespace Trinity
                         // See IndexSession::codec_identifier()
                         virtual strwlen8_t codec_identifier() = 0;
 
+                        // Decoders will access the index via `cache`; the access proxy owns `fd` (the index file)
+                        // Codecs that access other files should override this, and use the cache for those as well.
+                        //
+                        // indexPtr is still used for merging segments(see new_decoder()); that's sequential access, and mmap is optimal for it
+                        virtual void use_block_cache(BlockCache *const cache, const int fd)
+                        {
+                                blockCache = cache;
+                                indexFD = fd;
+                                indexFileID = cache->register_file();
+                        }
+
+                        // Returns a pointer to `size` bytes of the index at `offset`
+                        // If we are using a block cache, the data are read into the cache and pinned in `pin`, which must be retained
+                        // for as long as you are accessing the data. Otherwise(or if `pin` is nullptr), this is just (indexPtr + offset).
+                        const uint8_t *index_data(const uint32_t offset, const uint32_t size, BlockCache::pin *const pin)
+                        {
+                                if (!blockCache || !size || !pin)
+                                        return indexPtr + offset;
+
+                                blockCache->acquire(indexFileID, indexFD, offset, size, pin);
+                                return pin->data();
+                        }
+
+                        // Appends the memory regions, other than the index, this access proxy provides access to(e.g memory mapped codec specific files)
+                        // This is used for warming up segments and for reporting residency stats (see SegmentIndexSource::warmup())
+                        virtual void data_regions(std::vector<range_base<const uint8_t *, size_t>> *const out)
+                        {
+                        }
+
+                        // Appends the memory regions that hold a term's postings data
+                        // By default, that's just the term's index chunk, but some codecs also store data in other files (e.g lucene's positions)
+                        // see SegmentIndexSource::lock_postings()
+                        virtual void term_data_regions(const term_index_ctx &tctx, std::vector<range_base<const uint8_t *, size_t>> *const out)
+                        {
+                                out->push_back({indexPtr + tctx.indexChunk.offset, tctx.indexChunk.size()});
+                        }
+
                         virtual ~AccessProxy()
                         {
+                                if (indexFD != -1)
+                                        close(indexFD);
                         }
                 };
         }
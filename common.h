@@ -38,14 +38,44 @@ namespace Trinity
 	// A virtual method in IndexSource would be used to translate from session-local to global document IDs, where the default impl. would return the local ID.
 	// Assuming that each segment is a few million documents on average, for 4M documents, we 'd need just 30MBs for that translation file, which is really low anyway.
 	// We 'd need to make sure merge() takes those into account though.
+	//
+	// Segment-local IDs (with 32bit global IDs) are supported; see SegmentIndexSession::set_dense_document_ids() and IndexSource::translate_docid()
 	using docid_t = uint32_t;
 
 	// magic value; signifies end of document
 	static constexpr docid_t MaxDocIDValue{std::numeric_limits<docid_t>::max()};
 
+	// Maps a source-local document ID to a global ID, if globalDocIDs is set; see IndexSource::translate_docid()
+	inline docid_t translate_docid(const docid_t *const globalDocIDs, const docid_t id) noexcept
+	{
+		return globalDocIDs ? globalDocIDs[id - 1] : id;
+	}
+
 
 	// Represents the position of a token(i.e word) in a document
-	using tokenpos_t = uint16_t;
+	// 32-bits so that book-length and log documents can be indexed without truncation; see Limits::MaxPosition
+	using tokenpos_t = uint32_t;
+
+	// Identifies a field of a document(e.g title, body); 0 is the default field. See field_term()
+	using field_id_t = uint8_t;
+
+        // The length(in tokens) of a field of a document, i.e its norm; see IndexSource::field_length()
+        // Norms are persisted and memory mapped as an array of this struct(see persist_norms()), so its layout is explicit; there's no
+        // implicit padding, and the reserved bytes are always 0.
+        struct field_norm final
+        {
+                docid_t documentID; // global
+                uint32_t length;
+                field_id_t field;
+                uint8_t reserved[3]{0, 0, 0};
+
+                bool operator<(const field_norm &o) const noexcept
+                {
+                        return documentID < o.documentID || (documentID == o.documentID && field < o.field);
+                }
+        };
+
+        static_assert(sizeof(field_norm) == 12 && offsetof(field_norm, length) == 4 && offsetof(field_norm, field) == 8);
 
         static inline int32_t terms_cmp(const char_t *a, const uint8_t aLen, const char_t *b, const uint8_t bLen)
         {
@@ -56,9 +86,15 @@ namespace Trinity
                 // - Trinity::IndexSource::resolve_term_ctx()
                 // - query and parser_ctx
                 // - exec.cpp caches etc
+                //
+                // If your impl. doesn't order terms by their bytes(e.g it ignores case), you must also set TermsCmpBytewise to false, because
+                // terms_skiplist::search() otherwise orders terms by their first 8 bytes(see terms_skiplist::key_prefix()), and only invokes terms_cmp() for equal prefixes
                 return Trinity::str32_t(a, aLen).Cmp(b, bLen);
         }
 
+        // true if terms_cmp() orders terms by their bytes, i.e it's consistent with memcmp(); see terms_cmp()
+        static constexpr bool TermsCmpBytewise{true};
+
 	// Returns how many characters(char_t) were parsed from `content`, and how many were stored into `out`
 	//
 	// You may want to translate e.g "spider-man" to "spiderman", which is why this is not simply expected to
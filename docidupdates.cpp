@@ -2,172 +2,354 @@
 #include <ansifmt.h>
 #include <switch_bitops.h>
 
-// packs a list of updated/delete documents into a buffer that also contains
-// a skiplist for random access to the bitmaps
+// packs a list of updated/delete documents into a buffer
+//
+// Format(version 2):
+// 	header: u8 version, padded to 8 bytes
+// 	containers data; each container is padded to 8 bytes
+// 	containers directory (updates_container[]), sorted by base
+// 	u32 containers count, u32 lowest ID, u32 highest ID
+//
+// Document IDs are partitioned by their upper 16 bits, and each partition is packed in the most compact container, like
+// Roaring bitmaps do: an Array container for sparse partitions, a Bitmap container for dense ones, or a Run container
+// for partitions made of long contiguous ranges. With the original(version 1) format, a 4k bitmap bank was used even for a single ID.
+//
+// The trailer layout is compatible with version 1, but the version is determined by the first byte; the
+// first byte of a version 1 representation is always odd(first bit of the first bank is always set)
 void Trinity::pack_updates(std::vector<docid_t> &updatedDocumentIDs, IOBuffer *const buf)
 {
         if (updatedDocumentIDs.size())
         {
-                static constexpr size_t BANK_SIZE{32 * 1024};
-                static_assert((BANK_SIZE & 63) == 0, "Not divisable by 64");
-                IOBuffer skiplist;
+                static constexpr size_t BITMAP_SIZE{65536 / 8};
+                std::vector<updates_container> containers;
 
                 std::sort(updatedDocumentIDs.begin(), updatedDocumentIDs.end());
-
-#if 0 	// We are now throwing an exception if we attempt to erase or update the same document more than once in Trinity::SegmentIndexSession
-		// We could have filtered dupes int he main loop, but keep it simple
 		// We will throw an exception if we attempt to update a document twice, but we can safely erase a document however many times
                 updatedDocumentIDs.resize(std::unique(updatedDocumentIDs.begin(), updatedDocumentIDs.end()) - updatedDocumentIDs.begin());
-#endif
+
+                // buf may not be empty; offsets(and padding) are relative to base, which is where unpack_updates() content begins.
+                // Containers are aligned as long as that content is 8 bytes aligned in memory
+                const auto base = buf->size();
+                const auto align = [buf, base]() {
+                        while ((buf->size() - base) & 7)
+                                buf->pack(uint8_t(0));
+                };
+
+                buf->pack(updated_documents::CURRENT_VERSION);
+                align();
+
+                const auto dataBase = buf->size();
 
                 for (const auto *p = updatedDocumentIDs.data(), *const e = p + updatedDocumentIDs.size(); p != e;)
                 {
-                        // We can create a bitmap
-                        // which will come down to about 4k that can hold 32k documents
-                        // which allows for O(1) access
-                        // For 10million IDs, this comes down to about 2MBs which is not much, considering
-                        // how we are going to be advancing one range/time
-                        const auto id = *p, base = id;
-                        const auto upto = id + BANK_SIZE;
+                        const auto containerBase = *p & ~docid_t(0xffff);
+                        const auto *const first = p;
+                        uint32_t runs{1};
+
+                        for (++p; p != e && (*p & ~docid_t(0xffff)) == containerBase; ++p)
+                                runs += *p != p[-1] + 1;
+
+                        const uint32_t n = p - first;
+                        const size_t arraySize = n * sizeof(uint16_t), runSize = runs * sizeof(uint16_t) * 2;
+                        updates_container c;
+
+                        c.base = containerBase;
+                        c.offset = buf->size() - dataBase;
+
+                        if (runSize <= arraySize && runSize < BITMAP_SIZE)
+                        {
+                                c.type = updates_container::Type::Run;
+                                c.size = runs;
 
-                        buf->reserve(BANK_SIZE / 8);
+                                for (const auto *it = first; it != p;)
+                                {
+                                        const auto start = *it;
 
-                        auto *const bm = (uint64_t *)buf->end();
+                                        while (++it != p && *it == it[-1] + 1)
+                                                continue;
 
-                        memset(bm, 0, BANK_SIZE / 8);
+                                        buf->pack(uint16_t(start - containerBase), uint16_t(it[-1] - start));
+                                }
+                        }
+                        else if (arraySize < BITMAP_SIZE)
+                        {
+                                c.type = updates_container::Type::Array;
+                                c.size = n;
 
-                        skiplist.pack(id);
-                        do
+                                for (const auto *it = first; it != p; ++it)
+                                        buf->pack(uint16_t(*it - containerBase));
+                        }
+                        else
                         {
-                                const auto rel = *p - base;
+                                c.type = updates_container::Type::Bitmap;
+                                c.size = 0;
+
+                                buf->reserve(BITMAP_SIZE);
 
-                                SwitchBitOps::Bitmap<uint64_t>::Set(bm, rel);
-                        } while (++p != e && *p < upto);
+                                auto *const bm = (uint64_t *)buf->end();
 
-                        buf->advance_size(BANK_SIZE / 8);
+                                memset(bm, 0, BITMAP_SIZE);
+                                for (const auto *it = first; it != p; ++it)
+                                        SwitchBitOps::Bitmap<uint64_t>::Set(bm, *it - containerBase);
+
+                                buf->advance_size(BITMAP_SIZE);
+                        }
+
+                        align();
+                        containers.push_back(c);
                 }
 
-                buf->pack(uint8_t(log2(BANK_SIZE)));                              // 1 byte will suffice
-                buf->serialize(skiplist.data(), skiplist.size());                 // skiplist
-                buf->pack(uint32_t(skiplist.size() / sizeof(docid_t)));           // TODO: use varint encoding here
+                require(dataBase - base == 8);
+                buf->serialize(containers.data(), containers.size() * sizeof(updates_container));
+                buf->pack(uint32_t(containers.size()));
                 buf->pack(updatedDocumentIDs.front(), updatedDocumentIDs.back()); //lowest, highest
         }
 }
 
 // see pack_updates()
-// use this function to unpack the represetnation we need to access the packed (into bitmaps)
-// updated documents
+// use this function to unpack the represetnation we need to access the packed updated documents
 Trinity::updated_documents Trinity::unpack_updates(const range_base<const uint8_t *, uint32_t> content)
 {
-        if (content.size() <= sizeof(uint32_t) + sizeof(uint8_t))
+        if (content.size() <= sizeof(uint32_t) * 3 + sizeof(uint8_t))
                 return {};
 
         const auto *const b = content.start();
         const auto *p = b + content.size();
+        updated_documents res{};
 
         p -= sizeof(docid_t);
-        const auto highest = *(docid_t *)p;
+        res.highestID = *(docid_t *)p;
         p -= sizeof(docid_t);
-        const auto lowest = *(docid_t *)p;
+        res.lowestID = *(docid_t *)p;
 
         p -= sizeof(uint32_t);
-        const auto skiplistSize = *(uint32_t *)p;
-        p -= skiplistSize * sizeof(uint32_t);
+        res.containersCnt = *(uint32_t *)p;
+
+        if (*b & 1)
+        {
+                // version 1
+                p -= res.containersCnt * sizeof(uint32_t);
+
+                res.version = 1;
+                res.skiplist = reinterpret_cast<const docid_t *>(p);
+                res.bankSize = 1 << (*(--p));
+                res.banks = b;
+
+                require(p - content.start() == res.bankSize / 8 * res.containersCnt);
+        }
+        else if (*b == 2)
+        {
+                p -= res.containersCnt * sizeof(updates_container);
+
+                res.version = 2;
+                res.containers = reinterpret_cast<const updates_container *>(p);
+                res.containersData = b + 8;
 
-        const auto skiplist = reinterpret_cast<const docid_t *>(p);
-        const uint32_t bankSize = 1 << (*(--p));
+                require(p >= res.containersData);
+        }
+        else
+                throw Switch::data_error("Unsupported updated documents format version ", *b);
 
-        require(p - content.start() == bankSize / 8 * skiplistSize);
-        return {skiplist, skiplistSize, bankSize, b, lowest, highest};
+        return res;
 }
 
-bool Trinity::updated_documents_scanner::test(const docid_t id) noexcept
+void Trinity::collect_updated_documents(const updated_documents &ud, std::vector<docid_t> *const out)
 {
-        static constexpr bool trace{false};
-
-        if (trace)
-                SLog(ansifmt::bold, "Check for ", id, ", curBankRange = ", curBankRange, ", contains ", curBankRange.Contains(id), ansifmt::reset, "\n");
+        updated_documents_scanner it(ud);
 
-        if (id >= curBankRange.start())
+        for (uint32_t i{0}; i != ud.containersCnt; ++i)
         {
-                if (id < curBankRange.stop())
-                {
-                        if (trace)
-                                SLog("In bank range ", id - curBankRange.offset, "\n");
+                const auto base = ud.container_base(i);
 
-                        return SwitchBitOps::Bitmap<uint64_t>::IsSet((uint64_t *)curBank, id - curBankRange.offset);
-                }
-                else if (id > maxDocID)
-                {
-                        reset();
-                        return false;
-                }
-                else
+                it.set_container(i);
+                switch (it.curType)
                 {
-                        // skip ahead using binary search
-                        // Look for the first element in the skiplist that is <= `id`
-                        int32_t top{int32_t(end - skiplistBase) - 1};
-
-                        for (int32_t btm{0}; btm <= top;)
+                        case updates_container::Type::Bitmap:
                         {
-                                const auto mid = (btm + top) / 2;
-                                const auto v = skiplistBase[mid];
+                                const auto *const bm = reinterpret_cast<const uint64_t *>(it.curData);
 
-                                if (id < v)
-                                        top = mid - 1;
-                                else if (id == v)
+                                for (uint32_t w{0}, n = (it.curLast - base + 1) / 64; w != n; ++w)
                                 {
-                                        top = mid;
-                                        break;
+                                        for (auto v = bm[w]; v; v &= v - 1)
+                                                out->push_back(base + w * 64 + __builtin_ctzll(v));
                                 }
-                                else
-                                        btm = mid + 1;
                         }
+                        break;
 
-                        if (unlikely(top == -1))
+                        case updates_container::Type::Array:
                         {
-                                if (trace)
-                                        SLog("Definitely not here because top = -1\n");
+                                const auto *const values = reinterpret_cast<const uint16_t *>(it.curData);
 
-                                reset();
-                                return false;
+                                for (uint32_t j{0}; j != it.curSize; ++j)
+                                        out->push_back(base + values[j]);
                         }
-                        else
-                        {
-                                skiplistBase += top;
-                                curBankRange.Set(*skiplistBase, bankSize);
-                                curBank = udBanks + ((skiplistBase - udSkipList) * (bankSize / 8));
+                        break;
 
-                                if (trace)
-                                        SLog("Now at ", skiplistBase - udSkipList, " => ", curBankRange, "\n");
+                        case updates_container::Type::Run:
+                        {
+                                const auto *const runs = reinterpret_cast<const uint16_t *>(it.curData);
 
-                                if (curBankRange.Contains(id))
+                                for (uint32_t j{0}; j != it.curSize; ++j)
                                 {
-                                        // this is is important
-                                        // imagine if cur bank range is [1, 65) and second bank is [150, 215)
-                                        // and id is 68
-                                        // then we 'd skip to [150, 215) bank but
-                                        // that's ahead of our target(68)
-                                        if (trace)
-                                                SLog("REL = ", id - curBankRange.offset, "\n");
-
-                                        return SwitchBitOps::Bitmap<uint64_t>::IsSet((uint64_t *)curBank, id - curBankRange.offset);
+                                        for (uint32_t k{0}; k <= runs[j * 2 + 1]; ++k)
+                                                out->push_back(base + runs[j * 2] + k);
                                 }
-                                else
-                                {
-                                        if (trace)
-                                                SLog("id ", id, " out of range of ", curBankRange, "\n");
+                        }
+                        break;
+                }
+        }
+}
 
-                                        return false;
-                                }
+bool Trinity::updated_documents::test(const docid_t id) const noexcept
+{
+        if (!containersCnt || id < lowestID || id > highestID)
+                return false;
+
+        // the last container whose base is lower or equal to id
+        uint32_t btm{0}, top{containersCnt};
+
+        while (btm < top)
+        {
+                const auto mid = (btm + top) / 2;
+
+                if (container_base(mid) <= id)
+                        btm = mid + 1;
+                else
+                        top = mid;
+        }
+
+        if (!btm || id > container_last(btm - 1))
+                return false;
+
+        const auto i = btm - 1;
+        const auto rel = id - container_base(i);
+
+        if (version == 1)
+                return SwitchBitOps::Bitmap<uint64_t>::IsSet((uint64_t *)(banks + i * (bankSize / 8)), rel);
+
+        const auto &c = containers[i];
+        const auto data = containersData + c.offset;
+
+        switch (c.type)
+        {
+                case updates_container::Type::Bitmap:
+                        return SwitchBitOps::Bitmap<uint64_t>::IsSet((uint64_t *)data, rel);
+
+                case updates_container::Type::Array:
+                {
+                        const auto *const values = reinterpret_cast<const uint16_t *>(data);
+
+                        return std::binary_search(values, values + c.size, uint16_t(rel));
+                }
+
+                case updates_container::Type::Run:
+                {
+                        const auto *const runs = reinterpret_cast<const uint16_t *>(data);
+                        uint32_t lo{0}, hi{c.size};
+
+                        // the last run that starts at or before rel
+                        while (lo < hi)
+                        {
+                                const auto mid = (lo + hi) / 2;
+
+                                if (runs[mid * 2] <= rel)
+                                        lo = mid + 1;
+                                else
+                                        hi = mid;
                         }
+
+                        return lo && rel <= uint32_t(runs[(lo - 1) * 2]) + runs[(lo - 1) * 2 + 1];
                 }
         }
-        else
+
+        return false;
+}
+
+bool Trinity::updated_documents_scanner::test(const docid_t id) noexcept
+{
+        static constexpr bool trace{false};
+
+        if (trace)
+                SLog(ansifmt::bold, "Check for ", id, ", current container = [", curStart, ", ", curLast, "]", ansifmt::reset, "\n");
+
+        if (id < curStart)
         {
                 if (trace)
                         SLog("Not Even\n");
 
                 return false;
         }
+        else if (id > curLast)
+        {
+                if (id > ud.highestID)
+                {
+                        reset();
+                        return false;
+                }
+
+                // skip ahead using binary search
+                // Look for the first container that may hold `id`; there is one, because id <= highestID
+                uint32_t btm{cur + 1}, top{ud.containersCnt};
+
+                while (btm < top)
+                {
+                        const auto mid = (btm + top) / 2;
+
+                        if (ud.container_last(mid) < id)
+                                btm = mid + 1;
+                        else
+                                top = mid;
+                }
+
+                if (unlikely(btm == ud.containersCnt))
+                {
+                        reset();
+                        return false;
+                }
+
+                set_container(btm);
+
+                if (trace)
+                        SLog("Now at ", cur, " => [", curStart, ", ", curLast, "]\n");
+
+                if (id < curStart)
+                {
+                        // this is is important
+                        // imagine if cur container is [1, 65) and the next one is [150, 215)
+                        // and id is 68
+                        // then we 'd skip to [150, 215) container but
+                        // that's ahead of our target(68)
+                        return false;
+                }
+        }
+
+        const auto rel = id - curStart;
+
+        switch (curType)
+        {
+                case updates_container::Type::Bitmap:
+                        return SwitchBitOps::Bitmap<uint64_t>::IsSet((uint64_t *)curData, rel);
+
+                case updates_container::Type::Array:
+                {
+                        const auto *const values = reinterpret_cast<const uint16_t *>(curData);
+
+                        while (cursor != curSize && values[cursor] < rel)
+                                ++cursor;
+
+                        return cursor != curSize && values[cursor] == rel;
+                }
+
+                case updates_container::Type::Run:
+                {
+                        const auto *const runs = reinterpret_cast<const uint16_t *>(curData);
+
+                        while (cursor != curSize && uint32_t(runs[cursor * 2]) + runs[cursor * 2 + 1] < rel)
+                                ++cursor;
+
+                        return cursor != curSize && runs[cursor * 2] <= rel;
+                }
+        }
+
+        return false;
 }
@@ -3,94 +3,153 @@
 #include <memory>
 #include "common.h"
 
-// Efficient, lean, fixed-size bitmaps based document IDs tracking
+// Efficient, lean, compressed document IDs sets
 // You are expected to test for document IDs in ascending order, but if you need a different behavior, it should be easy to modify
 // the implementation to accomplish it.
 namespace Trinity
 {
+	// A container of the document IDs in [base, base + 64k); see pack_updates()
+	struct updates_container final
+	{
+		enum class Type : uint32_t
+		{
+			Bitmap = 0, // 64k bits
+			Array,      // sorted (id - base) uint16_t values
+			Run         // sorted (start - base, length - 1) uint16_t pairs
+		};
+
+		docid_t base;
+		uint32_t offset; // relative to updated_documents::containersData
+		uint32_t size;   // number of values(Array) or runs(Run)
+		Type type;
+	};
+
         struct updated_documents final
         {
-		// Each bitmaps bank can be accessed by a skiplist via binary search
-                const docid_t *skiplist;
-                const uint32_t skiplistSize;
+		// The format is selected by the first byte of the packed representation
+		// 1: fixed size bitmap banks, accessed via a skiplist. This is the original format, and it's still supported
+		// 2: roaring-style containers (see pack_updates())
+		static constexpr uint8_t CURRENT_VERSION{2};
 
-		// Fixed size bitmap banks
-                const uint32_t bankSize;
+		uint8_t version;
+		uint32_t containersCnt;
+
+		// version 1: each bitmaps bank can be accessed by a skiplist via binary search
+                const docid_t *skiplist;
+		uint32_t bankSize;
                 const uint8_t *banks;
 
+		// version 2
+		const updates_container *containers;
+		const uint8_t *containersData;
+
 		docid_t lowestID;
 		docid_t highestID;
 		
 		inline operator bool() const
 		{
-			return banks;
+			return containersCnt;
 		}
-        };
-
-        // Facilitates fast set test operations for updated/deleted documents packed
-        // as bitmaps using pack_updates()
-        struct updated_documents_scanner final
-        {
-                const docid_t *const end;
-                const uint32_t bankSize;
 
-                range_base<docid_t, docid_t> curBankRange;
-                const docid_t *skiplistBase;
-                const uint8_t *curBank;
-		docid_t maxDocID;
-                const docid_t *const udSkipList;
-                const uint8_t *const udBanks;
+		inline docid_t container_base(const uint32_t i) const noexcept
+		{
+			return version == 1 ? skiplist[i] : containers[i].base;
+		}
 
+		// the last document ID container i may hold
+		inline docid_t container_last(const uint32_t i) const noexcept
+		{
+			return container_base(i) + (version == 1 ? bankSize : 65536) - 1;
+		}
 
-                void reset()
-                {
-                        curBankRange.Set(MaxDocIDValue, 0);
-			maxDocID = MaxDocIDValue;
-                }
+		// Random access test; binary searches for the container that may hold `id`, and then within it
+		// Use updated_documents_scanner if you are testing monotonically increasing document IDs
+		bool test(const docid_t id) const noexcept;
+        };
 
-                updated_documents_scanner(const updated_documents &ud)
-                    : end{ud.skiplist + ud.skiplistSize}, bankSize{ud.bankSize}, skiplistBase{ud.skiplist}, udSkipList{ud.skiplist}, udBanks{ud.banks}, maxDocID{ud.highestID}
-                {
-                        if (skiplistBase != end)
-                        {
-                                curBankRange.Set(*skiplistBase, ud.bankSize);
-                                curBank = udBanks;
-                        }
-                }
+        // Facilitates fast set test operations for updated/deleted documents packed using pack_updates()
+	// Testing monotonically increasing document IDs is O(1) amortized; the scanner only moves forward through
+	// containers(binary search), and through the values or runs of the current container(linear)
+        struct updated_documents_scanner final
+        {
+		updated_documents ud;
+		uint32_t cur;         // current container
+		docid_t curStart;     // first document ID of the current container, or MaxDocIDValue if drained
+		docid_t curLast;      // last document ID the current container may hold
+		updates_container::Type curType;
+		const uint8_t *curData;
+		uint32_t curSize;
+		uint32_t cursor; // index of the current value or run, for Array and Run containers
+
+		void reset()
+		{
+			curStart = MaxDocIDValue;
+			curLast = 0;
+		}
 
-		updated_documents_scanner(const updated_documents_scanner &o)
-			: end{o.end}, bankSize{o.bankSize}, skiplistBase{o.skiplistBase}, udSkipList{o.udSkipList}, udBanks{o.udBanks}
+		void set_container(const uint32_t i) noexcept
 		{
-			curBankRange = o.curBankRange;
-			curBank = o.curBank;
+			cur = i;
+			curStart = ud.container_base(i);
+			curLast = ud.container_last(i);
+			cursor = 0;
+
+			if (ud.version == 1)
+			{
+				curType = updates_container::Type::Bitmap;
+				curData = ud.banks + i * (ud.bankSize / 8);
+				curSize = 0;
+			}
+			else
+			{
+				const auto &c = ud.containers[i];
+
+				curType = c.type;
+				curData = ud.containersData + c.offset;
+				curSize = c.size;
+			}
 		}
 
+                updated_documents_scanner(const updated_documents &u)
+                    : ud(u)
+                {
+			if (ud.containersCnt)
+				set_container(0);
+			else
+				reset();
+                }
 
                 constexpr bool drained() const noexcept
                 {
-                        return curBankRange.offset == UINT32_MAX;
+                        return curStart == MaxDocIDValue;
                 }
 
-
                 // You are expected to test monotonically increasing document IDs
                 bool test(const docid_t id) noexcept;
 
 		inline bool operator==(const updated_documents_scanner &o) const noexcept
                 {
-                        return end == o.end && bankSize == o.bankSize && curBankRange == o.curBankRange && skiplistBase == o.skiplistBase && curBank == o.curBank && udSkipList == o.udSkipList && udBanks == o.udBanks;
+                        return ud.containersCnt == o.ud.containersCnt && ud.skiplist == o.ud.skiplist && ud.containers == o.ud.containers && cur == o.cur && curStart == o.curStart && cursor == o.cursor;
                 }
         };
 
+	// The representation is appended to `buf`
 	void pack_updates(std::vector<docid_t> &updatedDocumentIDs, IOBuffer *const buf);
 
 	updated_documents unpack_updates(const range_base<const uint8_t *, docid_t> content);
 
+	// Appends all document IDs in `ud` to `out`, in ascending order
+	void collect_updated_documents(const updated_documents &ud, std::vector<docid_t> *const out);
+
 
 	// manages multiple scanners and tests among all of them, and if any of them is exchausted, it is removed from the collection
 	struct masked_documents_registry final
 	{
 		bool test(const docid_t id)
                 {
+			if (unlikely(randomAccess))
+				return test_random(id);
+
                         for (uint8_t i{0}; i < rem;)
                         {
 				auto it = scanners + i;
@@ -106,7 +165,23 @@ namespace Trinity
                         return false;
                 }
 
+		// Scanners only move forward, so by default you are expected to test monotonically increasing document IDs.
+		// If an index source's global document IDs are not in ascending order(see IndexSource::global_docids_ascending()), set
+		// randomAccess; the scanners are bypassed and each set is tested with random access(see updated_documents::test()), and they are not
+		// dropped when drained
+		bool test_random(const docid_t id) const noexcept
+		{
+			for (uint8_t i{0}; i != rem; ++i)
+			{
+				if (scanners[i].ud.test(id))
+					return true;
+			}
+
+			return false;
+		}
+
                 uint8_t rem;
+		bool randomAccess{false};
 		updated_documents_scanner scanners[0];		
 
 		masked_documents_registry()
@@ -140,5 +215,16 @@ namespace Trinity
 
                         return std::unique_ptr<Trinity::masked_documents_registry>(ptr);
                 }
+
+		// Returns a new registry in the same state as this one
+		// That's just a memcpy(), so it's much cheaper than make(); see IndexSourcesSnapshot
+		std::unique_ptr<Trinity::masked_documents_registry> clone() const
+		{
+			const auto size = sizeof(masked_documents_registry) + sizeof(updated_documents_scanner) * rem;
+			auto ptr = static_cast<masked_documents_registry *>(malloc(size));
+
+			memcpy(static_cast<void *>(ptr), this, size);
+			return std::unique_ptr<Trinity::masked_documents_registry>(ptr);
+		}
         };
 }
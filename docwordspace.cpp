@@ -1,4 +1,7 @@
 #include "docwordspace.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 bool Trinity::DocWordsSpace::test_phrase(const std::vector<exec_term_id_t> &phraseTerms, const tokenpos_t *phraseFirstTokenPositions, const tokenpos_t phraseFirstTokenPositionsCnt) const
 {
@@ -16,3 +19,130 @@ bool Trinity::DocWordsSpace::test_phrase(const std::vector<exec_term_id_t> &phra
 	}
 	return false;
 }
+
+void Trinity::DocWordsSpace::reserve_sparse(const uint32_t n)
+{
+        uint32_t capacity{64};
+
+        while (capacity < n * 2)
+                capacity <<= 1;
+
+        if (capacity <= sparseMask + 1)
+                return;
+
+        auto *const prev = sparse;
+        const auto prevCapacity = sparse ? sparseMask + 1 : 0;
+
+        sparse = (sparse_position *)calloc(sizeof(sparse_position), capacity);
+        sparseMask = capacity - 1;
+        sparseCnt = 0;
+
+        // only the positions of the current document need to be carried over
+        for (uint32_t i{0}; i != prevCapacity; ++i)
+        {
+                if (const auto &it = prev[i]; it.docSeq == curSeq)
+                        set_sparse(it.termID, it.pos);
+        }
+
+        free(prev);
+}
+
+#ifdef __SSE2__
+// Compares all 4 positions of `va` against all 4 positions of `vb` (vb, and vb rotated by 1..3 lanes), so that
+// the positions of a block of `a` that are also in a block of `b` are identified with 4 comparisons instead of upto 16.
+// See Schlegel et al. "Fast Sorted-Set Intersection using SIMD Instructions" and D. Lemire's SIMDCompressionAndIntersection
+[[gnu::always_inline]] static inline uint32_t block_matches(const __m128i va, const __m128i vb) noexcept
+{
+        auto cmp = _mm_cmpeq_epi32(va, vb);
+
+        cmp = _mm_or_si128(cmp, _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1))));
+        cmp = _mm_or_si128(cmp, _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(1, 0, 3, 2))));
+        cmp = _mm_or_si128(cmp, _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(2, 1, 0, 3))));
+
+        // one bit for each lane
+        return _mm_movemask_ps(_mm_castsi128_ps(cmp));
+}
+#endif
+
+uint32_t Trinity::intersect_positions(const tokenpos_t *a, const uint32_t aCnt, const tokenpos_t *b, const uint32_t bCnt, tokenpos_t *out) noexcept
+{
+        const auto *const aEnd = a + aCnt, *const bEnd = b + bCnt;
+        const auto *const outBase = out;
+
+#ifdef __SSE2__
+        static_assert(sizeof(tokenpos_t) == sizeof(uint32_t));
+
+        if (aCnt >= 4 && bCnt >= 4)
+        {
+                const auto *const aBlocksEnd = a + (aCnt & ~3u), *const bBlocksEnd = b + (bCnt & ~3u);
+
+                while (a != aBlocksEnd && b != bBlocksEnd)
+                {
+                        const auto va = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a));
+                        const auto vb = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b));
+                        const auto aMax = a[3], bMax = b[3];
+
+                        for (auto mask = block_matches(va, vb); mask; mask &= mask - 1)
+                                *out++ = a[__builtin_ctz(mask)];
+
+                        if (aMax <= bMax)
+                                a += 4;
+                        if (bMax <= aMax)
+                                b += 4;
+                }
+        }
+#endif
+
+        while (a != aEnd && b != bEnd)
+        {
+                if (*a < *b)
+                        ++a;
+                else if (*b < *a)
+                        ++b;
+                else
+                {
+                        *out++ = *a;
+                        ++a;
+                        ++b;
+                }
+        }
+
+        return out - outBase;
+}
+
+bool Trinity::positions_intersect(const tokenpos_t *a, const uint32_t aCnt, const tokenpos_t *b, const uint32_t bCnt) noexcept
+{
+        const auto *const aEnd = a + aCnt, *const bEnd = b + bCnt;
+
+#ifdef __SSE2__
+        if (aCnt >= 4 && bCnt >= 4)
+        {
+                const auto *const aBlocksEnd = a + (aCnt & ~3u), *const bBlocksEnd = b + (bCnt & ~3u);
+
+                while (a != aBlocksEnd && b != bBlocksEnd)
+                {
+                        const auto aMax = a[3], bMax = b[3];
+
+                        if (block_matches(_mm_loadu_si128(reinterpret_cast<const __m128i *>(a)), _mm_loadu_si128(reinterpret_cast<const __m128i *>(b))))
+                                return true;
+
+                        if (aMax <= bMax)
+                                a += 4;
+                        if (bMax <= aMax)
+                                b += 4;
+                }
+        }
+#endif
+
+        while (a != aEnd && b != bEnd)
+        {
+                if (*a < *b)
+                        ++a;
+                else if (*b < *a)
+                        ++b;
+                else
+                        return true;
+        }
+
+        return false;
+}
@@ -17,30 +17,140 @@ namespace Trinity
                         exec_term_id_t termID;  // See IMPL.md
                 };
 
-                position *const positions;
+                // Sparse mode: an open-addressed(linear probing) table keyed by position, sized by the number of materialized hits
+                // of the current document. Slots with docSeq != curSeq are empty, so just like positions[] it doesn't need to be cleared for every document.
+                struct sparse_position
+                {
+                        tokenpos_t pos;
+                        uint16_t docSeq;
+                        exec_term_id_t termID; // 0 if unset()
+                };
+
+                position *positions; // nullptr in sparse mode
                 const uint32_t maxPos;
                 uint16_t curSeq;
+                sparse_position *sparse{nullptr};
+                uint32_t sparseMask{0};
+                uint32_t sparseCnt{0}; // positions set for the current document
+
+		// A positions space of upto that many positions(i.e 4KB) is small enough to always use the dense array
+		static constexpr uint32_t DenseOnlyMaxPos{1024};
+
+		void init_dense()
+		{
+			positions = (position *)calloc(sizeof(position), maxPos + 1 + Trinity::Limits::MaxPhraseSize);
+		}
+
+		// Grows the sparse table so that it can hold `n` positions at a load factor of upto 0.5
+		void reserve_sparse(const uint32_t n);
+
+		// Beyond that many positions(i.e 4MB), we never switch to the dense array
+		static constexpr uint32_t DenseMaxPos{1 << 20};
+
+		// Once a document sets that many positions, the dense array is as compact as the sparse table, and faster
+		[[gnu::always_inline]] bool prefer_dense() const noexcept
+		{
+			return sparseCnt > maxPos / 8 && maxPos <= DenseMaxPos;
+		}
+
+		[[gnu::always_inline]] void set_sparse(const exec_term_id_t termID, const tokenpos_t pos)
+		{
+			if (unlikely((sparseCnt + 1) * 2 > sparseMask + 1))
+				reserve_sparse(sparseCnt + 1);
+
+			// Positions are mostly distinct and spread across the document, so we use them as their own hash.
+			// This also means that phrase terms at adjacent positions are likely found in adjacent slots
+			for (uint32_t i = pos & sparseMask;; i = (i + 1) & sparseMask)
+			{
+				auto &it = sparse[i];
+
+				if (it.docSeq != curSeq)
+				{
+					it = {pos, curSeq, termID};
+					++sparseCnt;
+					return;
+				}
+				else if (it.pos == pos)
+				{
+					it.termID = termID;
+					return;
+				}
+			}
+		}
 
+		[[gnu::always_inline]] sparse_position *find_sparse(const tokenpos_t pos) const noexcept
+		{
+			for (uint32_t i = pos & sparseMask;; i = (i + 1) & sparseMask)
+			{
+				auto &it = sparse[i];
+
+				if (it.docSeq != curSeq)
+					return nullptr;
+				else if (it.pos == pos)
+					return &it;
+			}
+		}
 
               public:
 		// Allocating max + Trinity::Limits::MaxPhraseSize, because that is the theoritical maximum phrase size
 		// and if we are going to test starting from maxPos extending to 10 positions ahead, we want to
 		// make sure we won't read outside positions. 
 		// The extra positions will be always initialized to 0 and we won't need to reset those in reset()
+		//
+		// For large `max`, most documents only set a small fraction of the positions, so the dense array is mostly cold memory and its accesses
+		// are cache misses. Unless `max` is small(see DenseOnlyMaxPos), we start in sparse mode instead, and switch to the dense array once
+		// a document sets enough positions(see prefer_dense()), so that the mode is chosen per query based on the hits of its terms.
                 DocWordsSpace(const uint32_t max = Trinity::Limits::MaxPosition)
-			: positions((position *)calloc(sizeof(position), max + 1 + Trinity::Limits::MaxPhraseSize)), maxPos{max} 
+			: positions{nullptr}, maxPos{max} 
 		{
 			curSeq = 1; // IMPORTANT, start from (1)
 			require(max && max <= Trinity::Limits::MaxPosition);
+
+			if (max <= DenseOnlyMaxPos)
+				init_dense();
+			else
+				reserve_sparse(64);
 		}
 
 		~DocWordsSpace()
 		{
                         free(positions);
+                        free(sparse);
+		}
+
+		// Positions in (0, max_position()] can be set()
+		auto max_position() const noexcept
+		{
+			return maxPos;
+		}
+
+		bool is_sparse() const noexcept
+		{
+			return positions == nullptr;
+		}
+
+		// The execution engine calls this before it materializes `n` hits of a term for the current document, so that
+		// the sparse table is resized at most once for them
+		void reserve(const uint32_t n)
+		{
+			if (sparse && (sparseCnt + n) * 2 > sparseMask + 1)
+				reserve_sparse(sparseCnt + n);
 		}
 
 		void reset()
 		{
+			if (sparse)
+			{
+				if (unlikely(prefer_dense()))
+				{
+					// Documents of this query set too many positions for the sparse table to pay off
+					free(sparse);
+					sparse = nullptr;
+					init_dense();
+				}
+				sparseCnt = 0;
+			}
+
 			// In order to avoid resetting/clearing positions[] for every other document
 			// we track a document-specific identifier in positions[] so if positions[idx].docSeq != curDocSeq
 			// then whatever is in positions[] is stale and should be considered unset.
@@ -52,7 +162,10 @@ namespace Trinity
 				// we reset every 65k documents
 				// this is preferrable to using uint32_t to encode the actual document in position{}
 				// no need to memset() for (maxPos + 1 + Trinity::Limits::MaxPhraseSize), just upto (maxPos + 1)
-                                memset(positions, 0, sizeof(position) * (maxPos + 1));
+				if (sparse)
+					memset(sparse, 0, sizeof(sparse_position) * (sparseMask + 1));
+				else
+					memset(positions, 0, sizeof(position) * (maxPos + 1));
                                 curSeq = 1; 	// important; set to 1 not 0
                         }
                         else
@@ -62,7 +175,10 @@ namespace Trinity
 		// XXX: pos must be > 0
 		[[gnu::always_inline]] void set(const exec_term_id_t termID, const tokenpos_t pos) noexcept
 		{
-                        positions[pos] = {curSeq, termID};
+			if (sparse)
+				set_sparse(termID, pos);
+			else
+                        	positions[pos] = {curSeq, termID};
 		}
 
 #if 1
@@ -87,6 +203,13 @@ namespace Trinity
 		// XXX: pos must be > 0
 		inline bool test(const exec_term_id_t termID, const tokenpos_t pos) const noexcept
 		{
+			if (sparse)
+			{
+				const auto it = find_sparse(pos);
+
+				return it && it->termID == termID;
+			}
+
 			return positions[pos].docSeq == curSeq && positions[pos].termID == termID;
 		}
 
@@ -126,7 +249,14 @@ namespace Trinity
 		// This can facilitate tracking sequences(e.g 2+ qeury terms matches in a document) of a MatchedIndexDocumentsFilter::consider()  impl.
 		inline void unset(const tokenpos_t pos) noexcept
                 {
-                        positions[pos].docSeq = 0;
+			if (sparse)
+			{
+				// we can't empty the slot, because that would break the probe sequence of positions stored after it
+				if (auto it = find_sparse(pos))
+					it->termID = 0;
+			}
+			else
+                        	positions[pos].docSeq = 0;
                 }
 
 		// We can probably just sort all phrase terms by freq asc
@@ -136,4 +266,16 @@ namespace Trinity
 		// This is an example/reference implementation
 		bool test_phrase(const std::vector<exec_term_id_t> &phraseTerms, const tokenpos_t *phraseFirstTokenPositions, const tokenpos_t phraseFirstTokenPositionsCnt) const;
         };
+
+	// An alternative to DocWordsSpace::test() for phrase matching(see ExecFlags::IntersectPhrasesPositions)
+	// Instead of testing, for each position of the first phrase term, if the next phrase terms are set in the following positions(a random access
+	// into a large array for each test), the positions of each phrase term, shifted by the term's index in the phrase, are intersected; a phrase
+	// matches if the intersection is not empty.
+	//
+	// Intersects the positions a[0, aCnt) and b[0, bCnt), both in ascending order and without duplicates, and stores the positions found in both in `out`, which must not overlap them.
+	// Returns the number of positions stored in `out`.
+	uint32_t intersect_positions(const tokenpos_t *a, const uint32_t aCnt, const tokenpos_t *b, const uint32_t bCnt, tokenpos_t *out) noexcept;
+
+	// Like intersect_positions(), except it only determines if there is any position in both a and b, which is all we need for the last phrase term
+	bool positions_intersect(const tokenpos_t *a, const uint32_t aCnt, const tokenpos_t *b, const uint32_t bCnt) noexcept;
 }
@@ -1,6 +1,7 @@
 #include "exec.h"
 #include "docwordspace.h"
 #include "matches.h"
+#include "terms.h"
 
 using namespace Trinity;
 
@@ -231,12 +232,207 @@ namespace // static/local this module
                         phrase *phrases[0];
                 };
 
+                // A proximity phrase; see Trinity::phrase::window
+                struct proximity final
+                {
+                        uint16_t window;
+                        bool ordered;
+                        uint8_t size;
+                        exec_term_id_t termIDs[0];
+                };
+
+                // A phrase matched using bigram terms postings; see register_bigrams_phrase()
+                struct bigrams_phrase final
+                {
+                        phrase *unigrams; // the phrase terms, captured on match
+                        phrase *rewritten;
+                };
+
 #pragma eval and runtime specific
                 runtime_ctx(IndexSource *src)
                     : idxsrc{src}, docWordsSpace{src->max_indexed_position()}
                 {
                 }
 
+                // Returns true if the positions of the terms of phrase `p` match the phrase in the current document; see ExecFlags::IntersectPhrasesPositions
+                // All phrase terms hits must have been materialized
+                bool match_phrase_positions(const phrase *const p)
+                {
+                        const auto n = p->size;
+                        uint8_t first{0};
+
+                        // start from the least frequent term, so that the intersection is as small as possible from the start
+                        for (uint8_t k{1}; k != n; ++k)
+                        {
+                                if (decode_ctx.termHits[p->termIDs[k]]->freq < decode_ctx.termHits[p->termIDs[first]]->freq)
+                                        first = k;
+                        }
+
+                        auto cnt = phrase_positions(first, decode_ctx.termHits[p->termIDs[first]], &phrasePositions[0]);
+
+                        if (n == 1)
+                                return cnt;
+
+                        const uint8_t last = first == n - 1 ? n - 2 : n - 1;
+
+                        for (uint8_t k{0}; cnt; ++k)
+                        {
+                                if (k == first)
+                                        continue;
+
+                                const auto other = phrase_positions(k, decode_ctx.termHits[p->termIDs[k]], &phrasePositions[1]);
+
+                                if (k == last)
+                                {
+                                        // no need to compute the intersection
+                                        return positions_intersect(phrasePositions[0].data(), cnt, phrasePositions[1].data(), other);
+                                }
+
+                                if (phrasePositions[2].size() < cnt)
+                                        phrasePositions[2].resize(cnt + 64);
+
+                                cnt = intersect_positions(phrasePositions[0].data(), cnt, phrasePositions[1].data(), other, phrasePositions[2].data());
+                                std::swap(phrasePositions[0], phrasePositions[2]);
+                        }
+
+                        return false;
+                }
+
+                // Returns true if the terms of `p` are found within its window in the current document
+                // All its terms hits must have been materialized
+                bool match_proximity(const proximity *const p)
+                {
+                        const auto n = p->size;
+                        const uint32_t span = p->window + n - 2; // max. distance between the first and the last position
+                        const term_hits *th[Limits::MaxPhraseSize];
+                        uint32_t idx[Limits::MaxPhraseSize]{0};
+
+                        for (uint32_t i{0}; i != n; ++i)
+                                th[i] = decode_ctx.termHits[p->termIDs[i]];
+
+                        if (p->ordered)
+                        {
+                                // For each position of the first term, pick the earliest position of each other term past the
+                                // position picked for the previous term. Those only move forward with the first term's position, so we never rewind
+                                const auto first = th[0];
+
+                                for (uint32_t i{0}; i != first->freq; ++i)
+                                {
+                                        const uint32_t start = first->all[i].pos;
+                                        auto prev{start};
+                                        uint8_t k;
+
+                                        if (!start)
+                                                continue;
+
+                                        for (k = 1; k != n; ++k)
+                                        {
+                                                const auto t = th[k];
+                                                auto &j = idx[k];
+
+                                                while (j != t->freq && t->all[j].pos <= prev)
+                                                        ++j;
+
+                                                if (j == t->freq)
+                                                        return false;
+                                                else if ((prev = t->all[j].pos) - start > span)
+                                                        break;
+                                        }
+
+                                        if (k == n)
+                                                return true;
+                                }
+
+                                return false;
+                        }
+
+                        // Merge the positions of the distinct terms, and slide a window over them, looking for one that includes
+                        // enough positions of each term(a term may be repeated in the phrase) and spans no more than `span`
+                        const term_hits *distinct[Limits::MaxPhraseSize];
+                        uint8_t need[Limits::MaxPhraseSize]{0}, have[Limits::MaxPhraseSize]{0}, distinctCnt{0};
+                        tokenpos_t last[Limits::MaxPhraseSize]{0};
+                        uint32_t l{0}, missing{n};
+
+                        for (uint32_t i{0}; i != n; ++i)
+                        {
+                                uint8_t d{0};
+
+                                while (d != distinctCnt && distinct[d] != th[i])
+                                        ++d;
+
+                                if (d == distinctCnt)
+                                        distinct[distinctCnt++] = th[i];
+                                ++need[d];
+                        }
+
+                        proximityHits.clear();
+                        for (;;)
+                        {
+                                uint32_t pos{UINT32_MAX};
+                                uint8_t d;
+
+                                for (uint8_t k{0}; k != distinctCnt; ++k)
+                                {
+                                        if (const auto t = distinct[k]; idx[k] != t->freq && t->all[idx[k]].pos < pos)
+                                        {
+                                                pos = t->all[idx[k]].pos;
+                                                d = k;
+                                        }
+                                }
+
+                                if (pos == UINT32_MAX)
+                                        return false;
+
+                                ++idx[d];
+                                if (pos == last[d])
+                                {
+                                        // position 0(not a position), or repeated(e.g different payloads)
+                                        continue;
+                                }
+
+                                last[d] = pos;
+                                proximityHits.push_back({pos, d});
+                                if (have[d]++ < need[d])
+                                        --missing;
+
+                                while (!missing)
+                                {
+                                        const auto &it = proximityHits[l++];
+
+                                        if (pos - it.first <= span)
+                                                return true;
+                                        else if (--have[it.second] < need[it.second])
+                                                ++missing;
+                                }
+                        }
+                }
+
+                // Collects the positions of a phrase term, shifted by its index `k` in the phrase, so that they are the positions of the phrase
+                // if the term matches. Positions are sorted but may repeat(e.g different payloads), and position 0 is not a position.
+                static uint32_t phrase_positions(const uint8_t k, const term_hits *const th, std::vector<tokenpos_t> *const out)
+                {
+                        const auto freq = th->freq;
+                        const auto hits = th->all;
+                        uint32_t cnt{0};
+                        tokenpos_t last{0};
+
+                        if (out->size() < freq)
+                                out->resize(freq + 64);
+
+                        auto *const positions = out->data();
+
+                        for (uint32_t i{0}; i != freq; ++i)
+                        {
+                                if (const auto pos = hits[i].pos; pos > k && pos - k != last)
+                                {
+                                        last = pos - k;
+                                        positions[cnt++] = last;
+                                }
+                        }
+
+                        return cnt;
+                }
+
                 [[gnu::hot]] void materialize_term_hits_impl(const exec_term_id_t termID)
                 {
                         auto *const __restrict__ th = decode_ctx.termHits[termID];
@@ -245,6 +441,7 @@ namespace // static/local this module
 
                         th->docSeq = curDocSeq;
                         th->set_freq(docHits);
+                        docWordsSpace.reserve(docHits);
                         dec->materialize_hits(termID, &docWordsSpace, th->all);
                 }
 
@@ -424,6 +621,75 @@ namespace // static/local this module
                         return ptr;
                 }
 
+                // Returns true if the bigram of any adjacent terms of `p` is indexed in the source; see IndexSource::indexes_bigram()
+                bool indexes_bigrams(const Trinity::phrase *p) const
+                {
+                        for (uint32_t i{1}; i < p->size; ++i)
+                        {
+                                if (idxsrc->indexes_bigram(p->terms[i - 1].token, p->terms[i].token))
+                                        return true;
+                        }
+                        return false;
+                }
+
+                // The phrase is rewritten so that each term is replaced by the bigram of itself and the next term, if that's indexed. The last term
+                // is dropped if the one before it was replaced, because the bigram implies it.
+                // All positions of the rewritten phrase are still adjacent, and because the bigram of (a, b) is indexed at the position of `a` iff
+                // `b` is found at the next position, it matches the same documents as the original phrase. e.g [world of warcraft] becomes
+                // ["world of" "of warcraft"] if both bigrams are indexed, or ["world of" of warcraft] if only the first is.
+                bigrams_phrase *register_bigrams_phrase(const Trinity::phrase *p)
+                {
+                        auto ptr = ctxAllocator.New<bigrams_phrase>();
+                        char_t buf[Limits::MaxTermLength];
+                        bool prevBigram{false};
+
+                        if (!(ptr->unigrams = register_phrase(p)))
+                                return nullptr;
+
+                        ptr->rewritten = (phrase *)allocator.Alloc(sizeof(phrase) + sizeof(exec_term_id_t) * p->size);
+                        ptr->rewritten->size = 0;
+                        for (uint32_t i{0}; i != p->size; ++i)
+                        {
+                                if (i + 1 != p->size && idxsrc->indexes_bigram(p->terms[i].token, p->terms[i + 1].token))
+                                {
+                                        const auto bigram = bigram_term(p->terms[i].token, p->terms[i + 1].token, buf);
+                                        // resolve_term() doesn't copy the term
+                                        const auto id = resolve_term({allocator.CopyOf(bigram.data(), bigram.size()), bigram.size()});
+
+                                        if (!id)
+                                                return nullptr;
+
+                                        ptr->rewritten->termIDs[ptr->rewritten->size++] = id;
+                                        prevBigram = true;
+                                }
+                                else if (!prevBigram || i + 1 != p->size)
+                                {
+                                        ptr->rewritten->termIDs[ptr->rewritten->size++] = ptr->unigrams->termIDs[i];
+                                        prevBigram = false;
+                                }
+                        }
+
+                        return ptr;
+                }
+
+                proximity *register_proximity(const Trinity::phrase *p)
+                {
+                        auto ptr = (proximity *)allocator.Alloc(sizeof(proximity) + sizeof(exec_term_id_t) * p->size);
+
+                        ptr->window = p->window;
+                        ptr->ordered = p->ordered;
+                        ptr->size = p->size;
+                        for (uint32_t i{0}; i != p->size; ++i)
+                        {
+                                if (const auto id = resolve_term(p->terms[i].token))
+                                        ptr->termIDs[i] = id;
+                                else
+                                        return nullptr;
+                        }
+
+                        return ptr;
+                }
+
 #pragma mark members
                 // This is from the lead tokens
                 // We expect all token and phrases opcodes to check against this document
@@ -474,6 +740,10 @@ namespace // static/local this module
                 } decode_ctx;
 
                 DocWordsSpace docWordsSpace;
+                bool intersectPhrasesPositions{false}; // see ExecFlags::IntersectPhrasesPositions
+                bool documentsOnly{false};             // see ExecFlags::DocumentsOnly
+                std::vector<tokenpos_t> phrasePositions[3]; // see match_phrase_positions()
+                std::vector<std::pair<tokenpos_t, uint8_t>> proximityHits; // see match_proximity()
                 Switch::unordered_map<str8_t, exec_term_id_t> termsDict;
                 uint16_t *curDocQueryTokensCaptured;
                 matched_document matchedDocument;
@@ -732,6 +1002,18 @@ static bool matchanyphrases_impl(const exec_node &self, runtime_ctx &rctx)
                                 const auto firstTermHits = th->all;
                                 auto &dws = rctx.docWordsSpace;
 
+                                if (rctx.intersectPhrasesPositions)
+                                {
+                                        if (rctx.match_phrase_positions(p))
+                                        {
+                                                for (uint16_t i{0}; i != n; ++i)
+                                                        rctx.capture_matched_term(p->termIDs[i]);
+
+                                                res = true;
+                                        }
+                                        goto nextPhrase;
+                                }
+
                                 for (uint32_t i{0}; i != firstTermFreq; ++i)
                                 {
                                         if (const auto pos = firstTermHits[i].pos)
@@ -799,6 +1081,13 @@ static bool matchanyphrases_fordocs_impl(const exec_node &self, runtime_ctx &rct
                                 const auto firstTermHits = th->all;
                                 auto &dws = rctx.docWordsSpace;
 
+                                if (rctx.intersectPhrasesPositions)
+                                {
+                                        if (rctx.match_phrase_positions(p))
+                                                return true;
+                                        goto nextPhrase;
+                                }
+
                                 for (uint32_t i{0}; i != firstTermFreq; ++i)
                                 {
                                         if (const auto pos = firstTermHits[i].pos)
@@ -857,6 +1146,16 @@ static bool matchallphrases_impl(const exec_node &self, runtime_ctx &rctx)
                 const auto firstTermFreq = th->freq;
                 const auto firstTermHits = th->all;
 
+                if (rctx.intersectPhrasesPositions)
+                {
+                        if (!rctx.match_phrase_positions(p))
+                                return false;
+
+                        for (uint16_t i{0}; i != n; ++i)
+                                rctx.capture_matched_term(p->termIDs[i]);
+                        continue;
+                }
+
                 for (uint32_t i{0}; i != firstTermFreq; ++i)
                 {
                         if (const auto pos = firstTermHits[i].pos)
@@ -887,11 +1186,11 @@ static bool matchallphrases_impl(const exec_node &self, runtime_ctx &rctx)
         return true;
 }
 
-static bool matchphrase_impl(const exec_node &self, runtime_ctx &rctx)
+// Returns true if the phrase `p` matches the current document; doesn't capture its terms
+static bool match_phrase(const runtime_ctx::phrase *const p, runtime_ctx &rctx)
 {
         static constexpr bool trace{false};
         //const bool trace = rctx.curDocID == 2151228176 || rctx.curDocID == 2152925656 || rctx.curDocID ==  2154895013;
-        const auto p = (runtime_ctx::phrase *)self.ptr;
         const auto firstTermID = p->termIDs[0];
         auto decoder = rctx.decode_ctx.decoders[firstTermID];
         const auto did = rctx.curDocID;
@@ -934,6 +1233,9 @@ static bool matchphrase_impl(const exec_node &self, runtime_ctx &rctx)
         if (trace)
                 SLog("first term freq = ", firstTermFreq, ", id = ", firstTermID, "\n");
 
+        if (rctx.intersectPhrasesPositions)
+                return rctx.match_phrase_positions(p);
+
         for (uint32_t i{0}; i != firstTermFreq; ++i)
         {
                 if (const auto pos = firstTermHits[i].pos)
@@ -952,8 +1254,6 @@ static bool matchphrase_impl(const exec_node &self, runtime_ctx &rctx)
                                         if (trace)
                                                 SLog("Matched Seq\n");
 
-                                        for (uint16_t i{0}; i != n; ++i)
-                                                rctx.capture_matched_term(p->termIDs[i]);
                                         return true;
                                 }
 
@@ -971,6 +1271,72 @@ static bool matchphrase_impl(const exec_node &self, runtime_ctx &rctx)
         return false;
 }
 
+static bool matchphrase_impl(const exec_node &self, runtime_ctx &rctx)
+{
+        const auto p = (runtime_ctx::phrase *)self.ptr;
+
+        if (!match_phrase(p, rctx))
+                return false;
+
+        for (uint16_t i{0}, n = p->size; i != n; ++i)
+                rctx.capture_matched_term(p->termIDs[i]);
+        return true;
+}
+
+static bool matchbigramsphrase_impl(const exec_node &self, runtime_ctx &rctx)
+{
+        const auto bp = (runtime_ctx::bigrams_phrase *)self.ptr;
+        const auto r = bp->rewritten;
+        const auto did = rctx.curDocID;
+
+        if (r->size == 1)
+        {
+                if (!rctx.decode_ctx.decoders[r->termIDs[0]]->seek(did))
+                        return false;
+        }
+        else if (!match_phrase(r, rctx))
+                return false;
+
+        if (!rctx.documentsOnly)
+        {
+                // The bigram terms are not query terms; capture the phrase terms instead.
+                // Their hits are materialized once the document is matched, so we only need to seek their decoders to it
+                const auto p = bp->unigrams;
+
+                for (uint16_t i{0}, n = p->size; i != n; ++i)
+                {
+                        const auto termID = p->termIDs[i];
+
+                        rctx.decode_ctx.decoders[termID]->seek(did);
+                        rctx.capture_matched_term(termID);
+                }
+        }
+        return true;
+}
+
+static bool matchproximity_impl(const exec_node &self, runtime_ctx &rctx)
+{
+        const auto p = (runtime_ctx::proximity *)self.ptr;
+        const auto did = rctx.curDocID;
+        const auto n = p->size;
+
+        for (uint32_t i{0}; i != n; ++i)
+        {
+                if (!rctx.decode_ctx.decoders[p->termIDs[i]]->seek(did))
+                        return false;
+        }
+
+        for (uint32_t i{0}; i != n; ++i)
+                rctx.materialize_term_hits(p->termIDs[i]);
+
+        if (!rctx.match_proximity(p))
+                return false;
+
+        for (uint16_t i{0}; i != n; ++i)
+                rctx.capture_matched_term(p->termIDs[i]);
+        return true;
+}
+
 static inline bool consttrueexpr_impl(const exec_node &self, runtime_ctx &rctx)
 {
         const auto op = (const runtime_ctx::unaryop_ctx *)self.ptr;
@@ -1021,6 +1387,21 @@ static inline bool logicalor_fordocs_impl(const exec_node &self, runtime_ctx &rc
 #define SPECIALIMPL_COLLECTION_LOGICALOR ((void *)uintptr_t(UINTPTR_MAX - 1))
 #define SPECIALIMPL_COLLECTION_LOGICALAND ((void *)uintptr_t(UINTPTR_MAX - 2))
 
+// A document matched by a proximity phrase, or by the rewritten phrase of a bigrams phrase, must contain all its terms, so we can use any of them for costs and leaders
+template <typename T>
+static exec_term_id_t least_frequent_term(const T *const p, runtime_ctx &rctx)
+{
+        auto res = p->termIDs[0];
+
+        for (uint32_t i{1}; i != p->size; ++i)
+        {
+                if (rctx.term_ctx(p->termIDs[i]).documents < rctx.term_ctx(res).documents)
+                        res = p->termIDs[i];
+        }
+
+        return res;
+}
+
 static uint64_t reorder_execnode(exec_node &n, bool &updates, runtime_ctx &rctx)
 {
         if (n.fp == matchterm_impl)
@@ -1031,6 +1412,18 @@ static uint64_t reorder_execnode(exec_node &n, bool &updates, runtime_ctx &rctx)
 
                 return rctx.term_ctx(p->termIDs[0]).documents;
         }
+        else if (n.fp == matchproximity_impl)
+        {
+                const auto p = static_cast<const runtime_ctx::proximity *>(n.ptr);
+
+                return rctx.term_ctx(least_frequent_term(p, rctx)).documents;
+        }
+        else if (n.fp == matchbigramsphrase_impl)
+        {
+                const auto bp = static_cast<const runtime_ctx::bigrams_phrase *>(n.ptr);
+
+                return rctx.term_ctx(least_frequent_term(bp->rewritten, rctx)).documents;
+        }
         else if (n.fp == logicaland_impl)
         {
                 auto ctx = static_cast<runtime_ctx::binop_ctx *>(n.ptr);
@@ -1295,6 +1688,10 @@ static auto impl_repr(const T *func)
                 return "term"_s8;
         else if (fp == matchphrase_impl)
                 return "phrase"_s8;
+        else if (fp == matchproximity_impl)
+                return "proximity"_s8;
+        else if (fp == matchbigramsphrase_impl)
+                return "bigrams phrase"_s8;
         else if (fp == SPECIALIMPL_COLLECTION_LOGICALAND)
                 return "(AND collection)"_s8;
         else if (fp == SPECIALIMPL_COLLECTION_LOGICALOR)
@@ -1391,6 +1788,22 @@ static exec_node compile_node(const ast_node *const n, runtime_ctx &rctx, simple
                                 else
                                         res.fp = constfalse_impl;
                         }
+                        else if (n->p->window)
+                        {
+                                res.ptr = rctx.register_proximity(n->p);
+                                if (res.ptr)
+                                        res.fp = matchproximity_impl;
+                                else
+                                        res.fp = constfalse_impl;
+                        }
+                        else if (rctx.indexes_bigrams(n->p))
+                        {
+                                res.ptr = rctx.register_bigrams_phrase(n->p);
+                                if (res.ptr)
+                                        res.fp = matchbigramsphrase_impl;
+                                else
+                                        res.fp = constfalse_impl;
+                        }
                         else
                         {
                                 res.ptr = rctx.register_phrase(n->p);
@@ -2413,6 +2826,26 @@ static void PrintImpl(Buffer &b, const exec_node &n)
                 b.shrink_by(1);
                 b.append(']');
         }
+        else if (n.fp == matchproximity_impl)
+        {
+                const auto p = (runtime_ctx::proximity *)n.ptr;
+
+                b.append(p->ordered ? "ONEAR/"_s8 : "NEAR/"_s8, p->window, '[');
+                for (uint32_t i{0}; i != p->size; ++i)
+                        b.append(p->termIDs[i], ',');
+                b.shrink_by(1);
+                b.append(']');
+        }
+        else if (n.fp == matchbigramsphrase_impl)
+        {
+                const auto p = ((runtime_ctx::bigrams_phrase *)n.ptr)->rewritten;
+
+                b.append("BIGRAMS[");
+                for (uint32_t i{0}; i != p->size; ++i)
+                        b.append(p->termIDs[i], ',');
+                b.shrink_by(1);
+                b.append(']');
+        }
         else if (n.fp == constfalse_impl)
                 b.append(false);
         else if (n.fp == dummyop_impl)
@@ -2476,6 +2909,18 @@ static constexpr std::size_t node_tokens_count(const exec_node n) noexcept
 
                 return p->size;
         }
+        else if (n.fp == matchproximity_impl)
+        {
+                const auto p = (runtime_ctx::proximity *)n.ptr;
+
+                return p->size;
+        }
+        else if (n.fp == matchbigramsphrase_impl)
+        {
+                const auto bp = (runtime_ctx::bigrams_phrase *)n.ptr;
+
+                return bp->unigrams->size;
+        }
         else if (n.fp == matchanyterms_impl || n.fp == matchanyterms_fordocs_impl)
         {
                 const auto *const __restrict__ run = static_cast<const runtime_ctx::termsrun *>(n.ptr);
@@ -2533,7 +2978,7 @@ static void capture_leader(const exec_node n, std::vector<exec_node> *const out,
         if (traceCompile)
                 SLog(ansifmt::color_brown, "Consider for leader(", threshold, ") ", n, ansifmt::reset, "\n");
 
-        if (n.fp == matchterm_impl || n.fp == matchphrase_impl)
+        if (n.fp == matchterm_impl || n.fp == matchphrase_impl || n.fp == matchproximity_impl || n.fp == matchbigramsphrase_impl)
         {
                 if (traceCompile)
                         SLog(ansifmt::color_brown, "CAPTURING", ansifmt::reset, "\n");
@@ -2801,6 +3246,10 @@ static exec_node compile(const ast_node *const n, runtime_ctx &rctx, simple_allo
 
                         leaderTermIDs->push_back(p->termIDs[0]);
                 }
+                else if (n.fp == matchproximity_impl)
+                        leaderTermIDs->push_back(least_frequent_term(static_cast<const runtime_ctx::proximity *>(n.ptr), rctx));
+                else if (n.fp == matchbigramsphrase_impl)
+                        leaderTermIDs->push_back(least_frequent_term(static_cast<const runtime_ctx::bigrams_phrase *>(n.ptr)->rewritten, rctx));
                 else if (n.fp == matchanyterms_impl || n.fp == matchanyterms_fordocs_impl)
                 {
                         const auto *__restrict__ run = static_cast<const runtime_ctx::termsrun *>(n.ptr);
@@ -3071,6 +3520,12 @@ void Trinity::exec_query(const query &in, IndexSource *const __restrict__ idxsrc
                 return;
         }
 
+        if (!idxsrc->global_docids_ascending())
+        {
+                // matched documents will be tested in local document IDs order
+                maskedDocumentsRegistry->randomAccess = true;
+        }
+
         // We need a copy of that query here
         // for we we will need to modify it
         const auto _start = Timings::Microseconds::Tick();
@@ -3159,6 +3614,9 @@ void Trinity::exec_query(const query &in, IndexSource *const __restrict__ idxsrc
                 SLog("Compiling:", q, "\n");
 
         runtime_ctx rctx(idxsrc);
+
+        rctx.intersectPhrasesPositions = execFlags & uint32_t(ExecFlags::IntersectPhrasesPositions);
+        rctx.documentsOnly = execFlags & uint32_t(ExecFlags::DocumentsOnly);
         std::vector<exec_term_id_t> leaderTermIDs;
         const auto before = Timings::Microseconds::Tick();
         const auto rootExecNode = compile_query(q.root, rctx, &leaderTermIDs, execFlags);
@@ -3419,19 +3877,22 @@ void Trinity::exec_query(const query &in, IndexSource *const __restrict__ idxsrc
                         p->queryCtx = rctx.originalQueryTermCtx[termID];
                         p->hits = th;
 
+                        // Decoders operate on source-local document IDs; the masked documents registry, the filters and consider()
+                        // on global IDs(see IndexSource::translate_docid())
                         if (documentsFilter)
                         {
                                 do
                                 {
                                         const auto docID = decoder->curDocument.id;
+                                        const auto globalDocID = idxsrc->translate_docid(docID);
 
-                                        if (!documentsFilter->filter(docID) && !maskedDocumentsRegistry->test(docID))
+                                        if (!documentsFilter->filter(globalDocID) && !maskedDocumentsRegistry->test(globalDocID))
                                         {
                                                 // see runtime_ctx::capture_matched_term()
                                                 // we won't use runtime_ctx::reset() because it will
                                                 // 	docWordsSpace.reset()
                                                 rctx.materialize_term_hits_impl(termID);
-                                                rctx.matchedDocument.id = docID;
+                                                rctx.matchedDocument.id = globalDocID;
 
                                                 if (unlikely(matchesFilter->consider(rctx.matchedDocument) == MatchedIndexDocumentsFilter::ConsiderResponse::Abort))
                                                         break;
@@ -3445,11 +3906,12 @@ void Trinity::exec_query(const query &in, IndexSource *const __restrict__ idxsrc
                                 do
                                 {
                                         const auto docID = decoder->curDocument.id;
+                                        const auto globalDocID = idxsrc->translate_docid(docID);
 
-                                        if (!maskedDocumentsRegistry->test(docID))
+                                        if (!maskedDocumentsRegistry->test(globalDocID))
                                         {
                                                 rctx.materialize_term_hits_impl(termID);
-                                                rctx.matchedDocument.id = docID;
+                                                rctx.matchedDocument.id = globalDocID;
 
                                                 if (unlikely(matchesFilter->consider(rctx.matchedDocument) == MatchedIndexDocumentsFilter::ConsiderResponse::Abort))
                                                         break;
@@ -3485,7 +3947,9 @@ void Trinity::exec_query(const query &in, IndexSource *const __restrict__ idxsrc
                                                         toAdvance[toAdvanceCnt++] = i;
                                         }
 
-                                        if (!documentsFilter->filter(docID) && !maskedDocumentsRegistry->test(docID))
+                                        const auto globalDocID = idxsrc->translate_docid(docID);
+
+                                        if (!documentsFilter->filter(globalDocID) && !maskedDocumentsRegistry->test(globalDocID))
                                         {
                                                 // now execute rootExecNode
                                                 // and it it returns true, compute the document's score
@@ -3496,7 +3960,7 @@ void Trinity::exec_query(const query &in, IndexSource *const __restrict__ idxsrc
                                                         const auto n = rctx.matchedDocument.matchedTermsCnt;
                                                         auto *const __restrict__ allMatchedTerms = rctx.matchedDocument.matchedTerms;
 
-                                                        rctx.matchedDocument.id = docID;
+                                                        rctx.matchedDocument.id = globalDocID;
 
                                                         for (uint16_t i{0}; i != n; ++i)
                                                         {
@@ -3559,7 +4023,9 @@ void Trinity::exec_query(const query &in, IndexSource *const __restrict__ idxsrc
                                                         toAdvance[toAdvanceCnt++] = i;
                                         }
 
-                                        if (!maskedDocumentsRegistry->test(docID))
+                                        const auto globalDocID = idxsrc->translate_docid(docID);
+
+                                        if (!maskedDocumentsRegistry->test(globalDocID))
                                         {
                                                 rctx.reset(docID);
 
@@ -3568,7 +4034,7 @@ void Trinity::exec_query(const query &in, IndexSource *const __restrict__ idxsrc
                                                         const auto n = rctx.matchedDocument.matchedTermsCnt;
                                                         auto *const __restrict__ allMatchedTerms = rctx.matchedDocument.matchedTerms;
 
-                                                        rctx.matchedDocument.id = docID;
+                                                        rctx.matchedDocument.id = globalDocID;
 
                                                         for (uint16_t i{0}; i != n; ++i)
                                                         {
@@ -3621,10 +4087,11 @@ void Trinity::exec_query(const query &in, IndexSource *const __restrict__ idxsrc
                                 do
                                 {
                                         const auto docID = decoder->curDocument.id;
+                                        const auto globalDocID = idxsrc->translate_docid(docID);
 
-                                        if (!documentsFilter->filter(docID) && !maskedDocumentsRegistry->test(docID))
+                                        if (!documentsFilter->filter(globalDocID) && !maskedDocumentsRegistry->test(globalDocID))
                                         {
-                                                rctx.matchedDocument.id = docID;
+                                                rctx.matchedDocument.id = globalDocID;
                                                 if (unlikely(matchesFilter->consider(rctx.matchedDocument) == MatchedIndexDocumentsFilter::ConsiderResponse::Abort))
                                                         break;
                                         }
@@ -3637,10 +4104,11 @@ void Trinity::exec_query(const query &in, IndexSource *const __restrict__ idxsrc
                                 do
                                 {
                                         const auto docID = decoder->curDocument.id;
+                                        const auto globalDocID = idxsrc->translate_docid(docID);
 
-                                        if (!maskedDocumentsRegistry->test(docID))
+                                        if (!maskedDocumentsRegistry->test(globalDocID))
                                         {
-                                                rctx.matchedDocument.id = docID;
+                                                rctx.matchedDocument.id = globalDocID;
                                                 if (unlikely(matchesFilter->consider(rctx.matchedDocument) == MatchedIndexDocumentsFilter::ConsiderResponse::Abort))
                                                         break;
                                         }
@@ -3675,13 +4143,15 @@ void Trinity::exec_query(const query &in, IndexSource *const __restrict__ idxsrc
                                                         toAdvance[toAdvanceCnt++] = i;
                                         }
 
-                                        if (!documentsFilter->filter(docID) && !maskedDocumentsRegistry->test(docID))
+                                        const auto globalDocID = idxsrc->translate_docid(docID);
+
+                                        if (!documentsFilter->filter(globalDocID) && !maskedDocumentsRegistry->test(globalDocID))
                                         {
                                                 rctx.reset(docID);
 
                                                 if (eval(rootExecNode, rctx))
                                                 {
-                                                        rctx.matchedDocument.id = docID;
+                                                        rctx.matchedDocument.id = globalDocID;
 
                                                         if (unlikely(matchesFilter->consider(rctx.matchedDocument) == MatchedIndexDocumentsFilter::ConsiderResponse::Abort))
                                                                 goto l1;
@@ -3730,13 +4200,15 @@ void Trinity::exec_query(const query &in, IndexSource *const __restrict__ idxsrc
                                                         toAdvance[toAdvanceCnt++] = i;
                                         }
 
-                                        if (!maskedDocumentsRegistry->test(docID))
+                                        const auto globalDocID = idxsrc->translate_docid(docID);
+
+                                        if (!maskedDocumentsRegistry->test(globalDocID))
                                         {
                                                 rctx.reset(docID);
 
                                                 if (eval(rootExecNode, rctx))
                                                 {
-                                                        rctx.matchedDocument.id = docID;
+                                                        rctx.matchedDocument.id = globalDocID;
 
                                                         if (unlikely(matchesFilter->consider(rctx.matchedDocument) == MatchedIndexDocumentsFilter::ConsiderResponse::Abort))
                                                                 goto l1;
@@ -24,7 +24,13 @@ namespace Trinity
 		// instead it tracks unique (termID, toNextSpan) -- that is, respects the older semantics.
 		// If you are not interested for that unique tripplet, but instead of the unique (termID, toNextSpan), you should use
 		// this flag. If set, query_index_term::flags will be set to 0
-		DisregardTokenFlagsForQueryIndicesTerms = 2
+		DisregardTokenFlagsForQueryIndicesTerms = 2,
+
+		// If set, phrases are matched by intersecting the positions of their terms(see Trinity::intersect_positions()), instead
+		// of testing DocWordsSpace for each position of the phrase's first term.
+		// This is faster for phrases of frequent terms in long documents that rarely match, where the DocWordsSpace path tests every position of
+		// the first term(random accesses), and slower when the phrase matches early in the document, where the DocWordsSpace path stops at the first match.
+		IntersectPhrasesPositions = 4
         };
 
         void exec_query(const query &in, IndexSource *, masked_documents_registry *const maskedDocumentsRegistry, MatchedIndexDocumentsFilter *, IndexDocumentsFilter *const f = nullptr, const uint32_t flags = 0);
@@ -38,8 +44,10 @@ namespace Trinity
         //
         // Note that execution of sources does not depend on state of other sources - they are isolated so parallel processing them requires
         // no coordination.
-        template <typename T, typename... Arg>
-        std::vector<std::unique_ptr<T>> exec_query(const query &in, IndexSourcesCollection *collection, IndexDocumentsFilter *f, const uint32_t flags, Arg &&... args)
+        //
+        // `C` is either an IndexSourcesCollection or an IndexSourcesSnapshot
+        template <typename T, typename C, typename... Arg>
+        std::vector<std::unique_ptr<T>> exec_query_impl(const query &in, C *collection, IndexDocumentsFilter *f, const uint32_t flags, Arg &&... args)
         {
                 static_assert(std::is_base_of<MatchedIndexDocumentsFilter, T>::value, "Expected a MatchedIndexDocumentsFilter subclass");
                 const auto n = collection->sources.size();
@@ -59,8 +67,8 @@ namespace Trinity
         }
 
         // Parallel queries execution, using std::async()
-        template <typename T, typename... Arg>
-        std::vector<std::unique_ptr<T>> exec_query_par(const query &in, IndexSourcesCollection *collection, IndexDocumentsFilter *f, const uint32_t flags, Arg &&... args)
+        template <typename T, typename C, typename... Arg>
+        std::vector<std::unique_ptr<T>> exec_query_par_impl(const query &in, C *collection, IndexDocumentsFilter *f, const uint32_t flags, Arg &&... args)
         {
                 static_assert(std::is_base_of<MatchedIndexDocumentsFilter, T>::value, "Expected a MatchedIndexDocumentsFilter subclass");
                 const auto n = collection->sources.size();
@@ -123,4 +131,30 @@ namespace Trinity
 
                 return out;
         }
+
+        template <typename T, typename... Arg>
+        inline std::vector<std::unique_ptr<T>> exec_query(const query &in, IndexSourcesCollection *collection, IndexDocumentsFilter *f, const uint32_t flags, Arg &&... args)
+        {
+                return exec_query_impl<T>(in, collection, f, flags, std::forward<Arg>(args)...);
+        }
+
+        // Executes the query on all sources of a snapshot; see IndexSourcesPublisher
+        // You are expected to hold a reference to the snapshot(i.e the std::shared_ptr<> returned by IndexSourcesPublisher::snapshot()) until this returns
+        template <typename T, typename... Arg>
+        inline std::vector<std::unique_ptr<T>> exec_query(const query &in, const IndexSourcesSnapshot *snapshot, IndexDocumentsFilter *f, const uint32_t flags, Arg &&... args)
+        {
+                return exec_query_impl<T>(in, snapshot, f, flags, std::forward<Arg>(args)...);
+        }
+
+        template <typename T, typename... Arg>
+        inline std::vector<std::unique_ptr<T>> exec_query_par(const query &in, IndexSourcesCollection *collection, IndexDocumentsFilter *f, const uint32_t flags, Arg &&... args)
+        {
+                return exec_query_par_impl<T>(in, collection, f, flags, std::forward<Arg>(args)...);
+        }
+
+        template <typename T, typename... Arg>
+        inline std::vector<std::unique_ptr<T>> exec_query_par(const query &in, const IndexSourcesSnapshot *snapshot, IndexDocumentsFilter *f, const uint32_t flags, Arg &&... args)
+        {
+                return exec_query_par_impl<T>(in, snapshot, f, flags, std::forward<Arg>(args)...);
+        }
 };
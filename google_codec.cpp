@@ -15,6 +15,8 @@ void Trinity::Codecs::Google::Encoder::begin_term()
 	prevBlockLastDocumentID = 0;
 	hitsData.clear();
 	termDocuments = 0;
+	// skiplist entries are placed relative to the term's first block, so that a term's chunk doesn't depend on the terms encoded before it
+	skiplistEntryCountdown = SKIPLIST_STEP;
 	curTermOffset = out->size() + sess->indexOutFlushed;
 
 	if (CONSTRUCT_SKIPLIST)
@@ -171,7 +173,7 @@ void Trinity::Codecs::Google::Encoder::commit_block()
                 {
                         // we can only support upto 65k skiplist entries so that
                         // we will only need a u16 to store that number in the index chunk header for the term
-                        skipListData.pack(prevBlockLastDocumentID, uint32_t(out->size() - curTermOffset));
+                        skipListData.pack(prevBlockLastDocumentID, uint32_t((out->size() + sess->indexOutFlushed) - curTermOffset));
 
                         if (trace)
                                 SLog("NOW skipListData.size = ", skipListData.size(), "\n");
@@ -572,6 +574,7 @@ void Trinity::Codecs::Google::Decoder::materialize_hits(const exec_term_id_t ter
         uint8_t curPayloadSize{0};
         uint64_t payload{0};
         auto *const bytes = (uint8_t *)&payload;
+        const auto maxPos = dwspace->max_position();
         uint32_t step;
 
 	if (trace)
@@ -610,12 +613,14 @@ void Trinity::Codecs::Google::Decoder::materialize_hits(const exec_term_id_t ter
 		if (trace)
 			SLog("Pos = ", pos, "\n");
 
-		if (pos)
+		if (pos && pos <= maxPos)
 		{
 	 		// pos == 0  if this not e.g a title or body match but e.g a special token
 			// set during indexing e.g site:www.google.com
 			// you could of course use a different position for that purprose (i.e a very large position, that is guaranteed
 			// to not match any terms in the document), but 0 makes sense
+			//
+			// Positions past dwspace->max_position() are not set; the index source may under-report its max_indexed_position()
                 	dwspace->set(termID, pos);
 		}
 
@@ -979,9 +984,8 @@ void Trinity::Codecs::Google::Decoder::init(const term_index_ctx &tctx, Trinity:
 {
         static constexpr bool trace{false};
         [[maybe_unused]] auto access = static_cast<Trinity::Codecs::Google::AccessProxy *>(proxy);
-        auto indexPtr = access->indexPtr;
-        auto ptr = indexPtr + tctx.indexChunk.offset;
         const auto chunkSize = tctx.indexChunk.size();
+        auto ptr = access->index_data(tctx.indexChunk.offset, chunkSize, useBlockCache ? &chunkPin : nullptr);
 
         chunkEnd = ptr + chunkSize;
 	p = base = ptr;
@@ -1040,10 +1044,11 @@ void Trinity::Codecs::Google::Decoder::init(const term_index_ctx &tctx, Trinity:
         }
 }
 
-Trinity::Codecs::Decoder *Trinity::Codecs::Google::AccessProxy::new_decoder(const term_index_ctx &tctx)
+Trinity::Codecs::Decoder *Trinity::Codecs::Google::AccessProxy::new_decoder(const term_index_ctx &tctx, const bool useBlockCache)
 {
         auto d = std::make_unique<Trinity::Codecs::Google::Decoder>();
 
+        d->useBlockCache = useBlockCache;
         d->init(tctx, this);
         return d.release();
 }
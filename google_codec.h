@@ -38,6 +38,12 @@ namespace Trinity
                                 range32_t append_index_chunk(const Trinity::Codecs::AccessProxy *, const term_index_ctx srcTCTX) override final;
 
                                 void merge(merge_participant *, const uint16_t, Trinity::Codecs::Encoder *) override final;
+
+                                // Chunks only use offsets relative to the chunk, so the default append_partition() will do
+                                Trinity::Codecs::IndexSession *new_partition() override final
+                                {
+                                        return new IndexSession(basePath);
+                                }
                         };
 
                         class Encoder final
@@ -98,7 +104,7 @@ namespace Trinity
                                         return "GOOGLE"_s8;
                                 }
 
-                                Trinity::Codecs::Decoder *new_decoder(const term_index_ctx &tctx) override final;
+                                Trinity::Codecs::Decoder *new_decoder(const term_index_ctx &tctx, const bool useBlockCache = true) override final;
                         };
 
                         // We used to keep track of remDocsInBlocks
@@ -124,6 +130,7 @@ namespace Trinity
                                 uint32_t skipListIdx;
                                 const uint8_t *base;
                                 std::vector<std::pair<docid_t, uint32_t>> skiplist;
+                                BlockCache::pin chunkPin; // see AccessProxy::index_data()
 
                               private:
                                 uint32_t skiplist_search(const docid_t target) const noexcept;
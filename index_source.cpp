@@ -1,21 +1,169 @@
 #include "index_source.h"
 
-void Trinity::IndexSourcesCollection::commit()
+void Trinity::IndexSourcesCollection::commit(const bool unionMasks)
 {
         std::sort(sources.begin(), sources.end(), [](const auto a, const auto b) {
                 return b->generation() < a->generation();
         });
 
+        // registries reference the masked documents storage
+        registries.clear();
         map.clear();
         all.clear();
+        maskedDocumentsStorage.clear();
+        totalDocuments = 0;
         for (auto s : sources)
         {
-                auto ud = s->masked_documents();
+                auto [ud, storage] = s->masked_documents_snapshot();
 
                 map.push_back({s, all.size()});
                 if (ud)
+                {
                         all.push_back(ud);
+                        if (storage)
+                                maskedDocumentsStorage.push_back(std::move(storage));
+                }
+
+                totalDocuments += s->total_documents();
+        }
+
+        unionMasksBufs.clear();
+
+        if (unionMasks)
+        {
+                // all[] is ordered by generation(descending), so we just need to extend the union with
+                // the next source's masked documents
+                std::vector<docid_t> u, ids, merged;
+                uint16_t n{0};
+
+                for (const auto &it : map)
+                {
+                        for (; n != it.second; ++n)
+                        {
+                                ids.clear();
+                                collect_updated_documents(all[n], &ids);
+
+                                merged.clear();
+                                std::set_union(u.begin(), u.end(), ids.begin(), ids.end(), std::back_inserter(merged));
+                                std::swap(u, merged);
+                        }
+
+                        if (it.second < 2)
+                        {
+                                // nothing to gain
+                                registries.push_back(masked_documents_registry::make(all.data(), it.second));
+                                continue;
+                        }
+
+                        auto b = std::make_unique<IOBuffer>();
+                        auto copy = u;
+
+                        pack_updates(copy, b.get());
+
+                        const auto ud = unpack_updates({reinterpret_cast<const uint8_t *>(b->data()), uint32_t(b->size())});
+
+                        unionMasksBufs.push_back(std::move(b));
+                        registries.push_back(masked_documents_registry::make(&ud, 1));
+                }
+        }
+        else
+        {
+                for (const auto &it : map)
+                        registries.push_back(masked_documents_registry::make(all.data(), it.second));
+        }
+
+        // statistics are specific to the committed sources
+        std::lock_guard<std::mutex> g(statsLock);
+
+        statsCache.clear();
+        statsKeysAllocator.reuse();
+        ++statsGeneration;
+}
+
+uint64_t Trinity::IndexSourcesCollection::live_term_documents(const str8_t term)
+{
+        uint64_t res{0};
+
+        for (uint32_t i{0}; i != sources.size(); ++i)
+        {
+                auto s = sources[i];
+                const auto tctx = s->term_ctx(term);
+
+                if (!tctx.documents)
+                        continue;
+
+                auto maskedDocsReg = scanner_registry_for(i);
+
+                if (maskedDocsReg->empty())
+                {
+                        res += tctx.documents;
+                        continue;
+                }
+
+                std::unique_ptr<Trinity::Codecs::Decoder> dec(s->new_postings_decoder(term, tctx));
+
+                if (!dec)
+                        continue;
+
+                for (auto id = dec->begin(); id != MaxDocIDValue; id = dec->curDocument.id)
+                {
+                        if (!maskedDocsReg->test(s->translate_docid(id)))
+                                ++res;
+
+                        if (!dec->next())
+                                break;
+                }
+        }
+
+        return res;
+}
+
+// statsLock is only held while accessing statsCache; the statistics are computed outside of it, so that
+// concurrent requests for different terms don't serialize on decoding postings lists.
+// Two threads may compute the same statistics concurrently; that's fine, they will produce the same values.
+uint64_t Trinity::IndexSourcesCollection::term_documents(const str8_t term, const bool excludeMasked)
+{
+        term_stats stats{UINT64_MAX, UINT64_MAX};
+        uint64_t generation;
+
+        {
+                std::lock_guard<std::mutex> g(statsLock);
+                const auto it = statsCache.find(term);
+
+                generation = statsGeneration;
+
+                if (it != statsCache.end())
+                        stats = it->second;
+        }
+
+        if (stats.documents != UINT64_MAX && (!excludeMasked || stats.liveDocuments != UINT64_MAX))
+                return excludeMasked ? stats.liveDocuments : stats.documents;
+
+        if (stats.documents == UINT64_MAX)
+        {
+                stats.documents = 0;
+                for (auto s : sources)
+                        stats.documents += s->term_ctx(term).documents;
+        }
+
+        if (excludeMasked && stats.liveDocuments == UINT64_MAX)
+                stats.liveDocuments = live_term_documents(term);
+
+        {
+                std::lock_guard<std::mutex> g(statsLock);
+                auto it = statsCache.find(term);
+
+                if (generation != statsGeneration)
+                {
+                        // commit()ed meanwhile
+                }
+                else if (it == statsCache.end())
+                        statsCache.insert({{statsKeysAllocator.CopyOf(term.data(), term.size()), term.size()}, stats});
+                else if (it->second.liveDocuments == UINT64_MAX)
+                        it->second.liveDocuments = stats.liveDocuments;
         }
+
+        return excludeMasked ? stats.liveDocuments : stats.documents;
 }
 
 Trinity::IndexSourcesCollection::~IndexSourcesCollection()
@@ -29,7 +177,74 @@ Trinity::IndexSourcesCollection::~IndexSourcesCollection()
 
 std::unique_ptr<Trinity::masked_documents_registry> Trinity::IndexSourcesCollection::scanner_registry_for(const uint16_t idx) 
 {
-	const auto n = map[idx].second;
+	auto r = registries[idx]->clone();
+
+	r->randomAccess = !sources[idx]->global_docids_ascending();
+	return r;
+}
+
+Trinity::IndexSourcesSnapshot::IndexSourcesSnapshot(const std::vector<IndexSource *> &in, const uint64_t version)
+    : ver{version}, sources(in)
+{
+        std::vector<uint16_t> map;
+
+        std::sort(sources.begin(), sources.end(), [](const auto a, const auto b) {
+                return b->generation() < a->generation();
+        });
+
+        // see IndexSourcesCollection::commit()
+        for (auto s : sources)
+        {
+                auto [ud, storage] = s->masked_documents_snapshot();
+
+                s->Retain();
+                map.push_back(all.size());
+                if (ud)
+                {
+                        all.push_back(ud);
+                        if (storage)
+                                maskedDocumentsStorage.push_back(std::move(storage));
+                }
+
+                totalDocuments += s->total_documents();
+        }
+
+        registries.reserve(sources.size());
+        for (const auto n : map)
+                registries.push_back(masked_documents_registry::make(all.data(), n));
+}
+
+Trinity::IndexSourcesSnapshot::~IndexSourcesSnapshot()
+{
+        for (auto s : sources)
+                s->Release();
+}
+
+std::shared_ptr<const Trinity::IndexSourcesSnapshot> Trinity::IndexSourcesPublisher::publish(const std::vector<IndexSource *> &sources)
+{
+        std::lock_guard<std::mutex> g(writerLock);
+        // building the snapshot may be expensive(masked_documents()), but readers are not affected
+        auto s = std::make_shared<const IndexSourcesSnapshot>(sources, nextVersion++);
+
+        std::atomic_store_explicit(&current, s, std::memory_order_release);
+        return s;
+}
+
+std::shared_ptr<const Trinity::IndexSourcesSnapshot> Trinity::IndexSourcesPublisher::update(const std::vector<IndexSource *> &added, const std::vector<IndexSource *> &retired)
+{
+        std::lock_guard<std::mutex> g(writerLock);
+        const auto cur = std::atomic_load_explicit(&current, std::memory_order_acquire);
+        std::vector<IndexSource *> sources;
+
+        for (auto s : cur->sources)
+        {
+                if (std::find(retired.begin(), retired.end(), s) == retired.end())
+                        sources.push_back(s);
+        }
+        sources.insert(sources.end(), added.begin(), added.end());
+
+        auto s = std::make_shared<const IndexSourcesSnapshot>(sources, nextVersion++);
 
-	return masked_documents_registry::make(all.data(), n);
+        std::atomic_store_explicit(&current, s, std::memory_order_release);
+        return s;
 }
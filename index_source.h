@@ -6,6 +6,8 @@
 #include <unordered_map>
 #include <switch_mallocators.h>
 #include <mutex>
+#include <memory>
+#include <algorithm>
 
 namespace Trinity
 {
@@ -25,6 +27,8 @@ namespace Trinity
 		simple_allocator keysAllocator{512};
 		std::unordered_map<str8_t, term_index_ctx> cache;
                 uint64_t gen{0}; // See IndexSourcesCollection
+		const docid_t *globalDocIDs{nullptr}; // See translate_docid()
+		bool globalDocIDsAscending{true};     // See global_docids_ascending()
 
               public:
                 inline auto generation() const noexcept
@@ -32,7 +36,9 @@ namespace Trinity
                         return gen;
                 }
 
-                term_index_ctx term_ctx(const str8_t term)
+                // Resolves the term via resolve_term_ctx() and caches the result
+                // Sources where a term's postings may change(e.g MemoryIndexSource) need to override this
+                virtual term_index_ctx term_ctx(const str8_t term)
                 {
 			[[maybe_unused]] static constexpr bool trace{false};
 			std::lock_guard<std::mutex> g(cacheLock);
@@ -60,29 +66,32 @@ namespace Trinity
                         return p.first->second;
                 }
 
-#if 0 		// This would probably be a good idea, but we don't need this, and it would make some optimisations in updated_documents_scanner::test() possible because
-		// of document IDs(global space) are always expected to be considered in ascending order would not work, and it would also require some effort to
-		// get this right everywhere we deal with document IDs (e.g merging documents).
+		// Two document IDs spaces: global, and local to each index source.
+		// A source may index dense, source-local document IDs (e.g see SegmentIndexSession::set_dense_document_ids()), which result
+		// in smaller deltas and better compression, and will translate them to global IDs here; globalDocIDs[localID - 1] is the global ID of localID.
 		//
-		// It may be a good idea to support this in the future though, with the added benefit that returning 0 would
-		// save the execution engine from eval()uating the query for the document, and that we could use e.g 32bit integers for index source-local IDs mapped to e.g 64bit integers
-		// and that could have some impact in the index size (and it would allow for e.g LUCENE_ENCODE_FREQ1_DOCDELTA).
-		// Consider it for later.
-		//
-		//
-		// Theory: two docIDs spaces. One is global, and another local to each index source/segment and irrelevant outside that context.
-		// By using 2 different document IDs spaces, we could use an e.g u32 integer for the document IDs of documents indexed in a segment, and translate them
-		// to e.g u64 global IDs during execution, prior to evaluating the query on the document. (e.g while indexing store in a file the global ID for each segment-local logical id
-		// and then mmap that file in your IndexSource and directly dereference it to get the global ID from the local ID).
+		// Decoders operate on local IDs, and the execution engine translates them to global IDs before it tests them against the masked documents registry,
+		// the IndexDocumentsFilter, and passes them to MatchedIndexDocumentsFilter::consider().
+		// Local IDs are usually assigned in ascending global ID order, so that translated IDs are also considered in ascending order(updated_documents_scanner depends on it).
+		// They are not if the source was sorted by e.g a static rank(see MergeCandidatesCollection::docIDsOrder); see global_docids_ascending()
 		//
 		// By default, it's an identity method -- no translation between index source and global space
-		// You can override it to return 0, if you want to ommit the document ID completely for whatever reason
-		// or otherwise translate it to global space here
-		virtual docid_t translate_docid(const docid_t indexSourceSpaceDocumentID)
+		inline docid_t translate_docid(const docid_t indexSourceSpaceDocumentID) const noexcept
 		{
-			return indexSourceSpaceDocumentID;
+			return Trinity::translate_docid(globalDocIDs, indexSourceSpaceDocumentID);
+		}
+
+		inline auto global_docids() const noexcept
+		{
+			return globalDocIDs;
+		}
+
+		// If false, translated document IDs are not in ascending order, so the masked documents registry needs
+		// to be accessed in random order(see masked_documents_registry::randomAccess), and merges need to sort postings by document ID
+		inline bool global_docids_ascending() const noexcept
+		{
+			return globalDocIDsAscending;
 		}
-#endif
 
 
 
@@ -99,6 +108,15 @@ namespace Trinity
                         return {};
                 }
 
+                // Override if the storage masked_documents() are packed in may be superseded while the source is in use(e.g because more
+                // documents were masked since), so that it can be released once no longer used. The returned storage backs the returned
+                // updated_documents; IndexSourcesCollection and IndexSourcesSnapshot hold on to it for as long as they use them.
+                // By default, the storage of masked_documents() is expected to live as long as the source.
+                virtual std::pair<updated_documents, std::shared_ptr<const void>> masked_documents_snapshot()
+                {
+                        return {masked_documents(), nullptr};
+                }
+
 		// Returns the maximum position expected
 		// you may want to override to provide a more accurate value
 		// This is used by the execution engine when creating a new DocWordsSpace
@@ -107,6 +125,7 @@ namespace Trinity
 		// For example, if you are only indexing titles, you should probably override this method
 		// in your IndexSource variant to return a low max indexed position (e.g 100) because you likely don't
 		// have any title term indexed at a higher position.
+		// SegmentIndexSource returns the highest position indexed in the segment.
 		virtual tokenpos_t max_indexed_position() const
 		{
 			return 8192;
@@ -123,6 +142,28 @@ namespace Trinity
 			return true;
 		}
 
+		// Returns true if the postings of the bigram term of (first, second)(see bigram_term()) are indexed for all documents of
+		// this source, so that phrases where those terms are adjacent can use them; see SegmentIndexSession::set_common_grams()
+		virtual bool indexes_bigram(const str8_t first, const str8_t second) const
+		{
+			return false;
+		}
+
+		// Returns the number of documents indexed in this source, or 0 if that's not known
+		// This is used by IndexSourcesCollection to provide collection-wide statistics (see IndexSourcesCollection::total_documents())
+		virtual uint64_t total_documents() const
+		{
+			return 0;
+		}
+
+		// Returns the length(in tokens) of the field of the document(global ID), or 0 if that's not known, so that
+		// MatchedIndexDocumentsFilter::consider() implementations can normalize scores by field length
+		// See SegmentIndexSession::document_proxy::insert()
+		virtual uint32_t field_length(const docid_t documentID, const field_id_t field) const
+		{
+			return 0;
+		}
+
                 virtual ~IndexSource()
                 {
                 }
@@ -194,6 +235,10 @@ namespace Trinity
 	// a new IndexSourcesCollection for them and atomically exchange pointers (old, new IndexSourcesCollection)
 	//
 	// It is very important you don't forget to invoke commit() otherwise updated/masked documents state will not be built
+	//
+	// It also provides collection-wide statistics (total documents, documents matching a term across all sources), which
+	// you need in order to score consistently across sources (e.g IDF). Those are cached until the next commit(), so you can
+	// pass the collection to your MatchedIndexDocumentsFilter subclass and use them in consider() without having to resolve terms on every source yourself.
         class IndexSourcesCollection final
         {
               private:
@@ -201,6 +246,28 @@ namespace Trinity
                 // for each source, we track how many of the first update_documents in all[]
                 // we should consider for masking documents
                 std::vector<std::pair<IndexSource *, uint16_t>> map;
+                // precomputed for each source in commit(); see scanner_registry_for()
+                std::vector<std::unique_ptr<masked_documents_registry>> registries;
+                // packed union masks, if commit() was asked to build them; registries reference them
+                std::vector<std::unique_ptr<IOBuffer>> unionMasksBufs;
+                // see IndexSource::masked_documents_snapshot(); all[] and registries reference them
+                std::vector<std::shared_ptr<const void>> maskedDocumentsStorage;
+
+                struct term_stats final
+                {
+                        uint64_t documents;
+                        uint64_t liveDocuments; // UINT64_MAX if not computed yet
+                };
+
+                std::mutex statsLock;
+                simple_allocator statsKeysAllocator{512};
+                std::unordered_map<str8_t, term_stats> statsCache;
+                // bumped whenever statsCache is reset, so that statistics computed before that are not cached
+                uint64_t statsGeneration{0};
+                uint64_t totalDocuments{0};
+
+              private:
+                uint64_t live_term_documents(const str8_t term);
 
               public:
                 std::vector<IndexSource *> sources;
@@ -214,8 +281,103 @@ namespace Trinity
 
                 ~IndexSourcesCollection();
 
-                void commit();
+                // If unionMasks is set, for each source, the masked documents of all more recent sources are merged into a single
+                // mask, so that the source's masked_documents_registry only has one scanner to test(instead of one for each more recent source).
+                // This costs more memory and time here(upto one packed mask per source, whose size depends on the number of updated documents
+                // in more recent sources), but testing a document is no longer proportional to the number of sources, which
+                // matters if you have many small sources(e.g many incremental segments, not merged yet).
+                void commit(const bool unionMasks = false);
 
                 std::unique_ptr<Trinity::masked_documents_registry> scanner_registry_for(const uint16_t idx) ;
+
+                // Sum of IndexSource::total_documents() of all sources
+                // Documents updated in more recent sources are accounted for in every source they are indexed in, so this is an upper bound
+                inline auto total_documents() const noexcept
+                {
+                        return totalDocuments;
+                }
+
+                // Returns the number of documents that match `term` across all sources (i.e sum of term_index_ctx::documents)
+                //
+                // If excludeMasked is true, documents masked by a more recent source are not accounted for. This requires
+                // decoding the term's postings in all sources the first time it is requested after a commit(), so it's more expensive, but exact.
+                uint64_t term_documents(const str8_t term, const bool excludeMasked = false);
+        };
+
+        // An immutable snapshot of a set of index sources, as published by an IndexSourcesPublisher
+        //
+        // Sources are ordered by generation(descending), same as IndexSourcesCollection::sources after commit(), and the
+        // masked documents registry of each source is precomputed, so scanner_registry_for() is just a memcpy()
+        class IndexSourcesSnapshot final
+        {
+              private:
+                std::vector<updated_documents> all;
+                std::vector<std::unique_ptr<masked_documents_registry>> registries;
+                // see IndexSourcesCollection::maskedDocumentsStorage
+                std::vector<std::shared_ptr<const void>> maskedDocumentsStorage;
+                uint64_t totalDocuments{0};
+                const uint64_t ver;
+
+              public:
+                std::vector<IndexSource *> sources;
+
+              public:
+                IndexSourcesSnapshot(const std::vector<IndexSource *> &sources, const uint64_t version);
+
+                ~IndexSourcesSnapshot();
+
+                std::unique_ptr<Trinity::masked_documents_registry> scanner_registry_for(const uint16_t idx) const
+                {
+                        auto r = registries[idx]->clone();
+
+                        r->randomAccess = !sources[idx]->global_docids_ascending();
+                        return r;
+                }
+
+                inline auto version() const noexcept
+                {
+                        return ver;
+                }
+
+                // See IndexSourcesCollection::total_documents()
+                inline auto total_documents() const noexcept
+                {
+                        return totalDocuments;
+                }
+        };
+
+        // RCU-style publication of index sources snapshots
+        //
+        // Rebuilding an IndexSourcesCollection whenever a segment is added or retired, and swapping it with the one
+        // used by queries under a lock, means that queries may block on the writer. Instead, writers publish() a new IndexSourcesSnapshot, and
+        // queries just grab the current snapshot() and use it for as long as they need to; they never block on each other or on writers.
+        //
+        // A snapshot holds a reference to each of its sources, so sources retired in a newer snapshot are released once no query
+        // holds any older snapshot that includes them.
+        class IndexSourcesPublisher final
+        {
+              private:
+                std::shared_ptr<const IndexSourcesSnapshot> current;
+                std::mutex writerLock; // serializes writers; readers never acquire it
+                uint64_t nextVersion{1};
+
+              public:
+                IndexSourcesPublisher()
+                    : current{std::make_shared<const IndexSourcesSnapshot>(std::vector<IndexSource *>{}, 0)}
+                {
+                }
+
+                // Returns the current snapshot; safe to use from any thread
+                std::shared_ptr<const IndexSourcesSnapshot> snapshot() const
+                {
+                        return std::atomic_load_explicit(&current, std::memory_order_acquire);
+                }
+
+                // Publishes a new snapshot of `sources`, and returns it
+                std::shared_ptr<const IndexSourcesSnapshot> publish(const std::vector<IndexSource *> &sources);
+
+                // Publishes a new snapshot which includes the sources of the current snapshot, and `added`, but not any of `retired`
+                // e.g after a merge, you 'd add the merged segment and retire the segments merged into it
+                std::shared_ptr<const IndexSourcesSnapshot> update(const std::vector<IndexSource *> &added, const std::vector<IndexSource *> &retired);
         };
 }
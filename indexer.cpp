@@ -6,6 +6,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <text.h>
+#include <thread>
 
 using namespace Trinity;
 
@@ -26,14 +27,104 @@ void SegmentIndexSession::document_proxy::insert(const uint32_t termID, const to
                 hits.push_back({termID, {position, {0, 0}}});
 }
 
-void SegmentIndexSession::commit_document_impl(const document_proxy &proxy, const bool isUpdate)
+void SegmentIndexSession::document_proxy::insert(const field_id_t field, const str8_t term, const tokenpos_t position, range_base<const uint8_t *, const uint8_t> payload)
+{
+        char_t buf[Limits::MaxTermLength];
+
+        require(field <= Limits::MaxFields);
+        Dexpect(term.size() <= Limits::MaxTermLength);
+
+        ++fieldLengths[field];
+        fieldsMask |= 1u << field;
+
+        if (const auto t = field_term(field, term, buf))
+                insert(term_id(t), position, payload);
+}
+
+void SegmentIndexSession::set_common_grams(const std::vector<std::pair<str8_t, str8_t>> &grams)
+{
+        char_t buf[Limits::MaxTermLength];
+
+        {
+                std::lock_guard<std::mutex> g(commitedDocumentsLock);
+
+                // documents committed so far wouldn't have hits for the bigram terms, and the segment would claim to index them for all documents
+                if (unlikely(!commitedDocuments.empty()))
+                        throw Switch::data_error("Unable to set common grams: documents already committed");
+        }
+
+        for (const auto &it : grams)
+        {
+                const auto bigram = bigram_term(it.first, it.second, buf);
+
+                if (!bigram)
+                        continue;
+
+                const auto key = (uint64_t(term_id(it.first)) << 32) | term_id(it.second);
+                const auto id = term_id(bigram);
+
+                if (commonGrams.insert({key, id}).second)
+                        commonGramsTerms.push_back({dictionaryAllocator.CopyOf(bigram.data(), bigram.size()), bigram.size()});
+        }
+}
+
+// For every (first, second) pair of terms in set_common_grams() found at adjacent positions, index a hit for the pair's bigram term at the first term's position
+void SegmentIndexSession::index_common_grams(ingestion_state &state, hits_vector &hits)
+{
+        auto &positions = state.positions;
+
+        positions.clear();
+        for (const auto &it : hits)
+        {
+                if (const auto pos = it.second.first)
+                        positions.push_back({pos, it.first});
+        }
+
+        std::sort(positions.begin(), positions.end());
+        positions.erase(std::unique(positions.begin(), positions.end()), positions.end());
+
+        for (const auto *p = positions.data(), *const e = p + positions.size(); p != e;)
+        {
+                const auto pos = p->first;
+                const auto *const base = p;
+
+                while (++p != e && p->first == pos)
+                        continue;
+
+                const auto *const next = p;
+                const auto *nextEnd = p;
+
+                while (nextEnd != e && nextEnd->first == pos + 1)
+                        ++nextEnd;
+
+                for (const auto *it = base; it != next; ++it)
+                {
+                        for (const auto *n = next; n != nextEnd; ++n)
+                        {
+                                if (const auto res = commonGrams.find((uint64_t(it->second) << 32) | n->second); res != commonGrams.end())
+                                        hits.push_back({res->second, {pos, {0, 0}}});
+                        }
+                }
+        }
+}
+
+void SegmentIndexSession::commit_document_impl(ingestion_state &state, const document_proxy &proxy, const bool isUpdate)
 {
         uint32_t terms{0};
-        const auto all_hits = reinterpret_cast<const uint8_t *>(hitsBuf.data());
+        const auto all_hits = reinterpret_cast<const uint8_t *>(proxy.hitsBuf.data());
+        auto &b = state.b;
+        auto &hits = proxy.hits;
 
-	// we can't update the same document more than once in the same session
-	if (unlikely(!commitedDocuments.insert(proxy.did).second))
-		throw Switch::data_error("Already committed document ", proxy.did);
+        {
+                std::lock_guard<std::mutex> g(commitedDocumentsLock);
+
+                // we can't update the same document more than once in the same session
+                if (unlikely(!commitedDocuments.insert(proxy.did).second))
+                        throw Switch::data_error("Already committed document ", proxy.did);
+        }
+
+        if (!commonGrams.empty())
+                index_common_grams(state, hits);
 
         std::sort(hits.begin(), hits.end(), [](const auto &a, const auto &b) {
                 return a.first < b.first || (a.first == b.first && a.second.first < b.second.first);
@@ -43,12 +134,13 @@ void SegmentIndexSession::commit_document_impl(const document_proxy &proxy, cons
 
         if (isUpdate)
         {
-                updatedDocumentIDs.push_back(proxy.did);
+                state.updatedDocumentIDs.push_back(proxy.did);
         }
 
         const auto offset = b.size();
 
-        b.pack(uint16_t(0));	 // XXX: should be u32 if possible, or use varint
+        // total distinct terms for (document); u32 because documents are no longer bound to 64k positions(see Limits::MaxPosition)
+        b.pack(uint32_t(0));
 
         for (const auto *p = hits.data(), *const e = p + hits.size(); p != e;)
         {
@@ -62,7 +154,7 @@ void SegmentIndexSession::commit_document_impl(const document_proxy &proxy, cons
 
                 const auto o = b.size();
 
-                b.pack(uint16_t(0)); // XXX: should be u32 or use varint
+                b.pack(uint32_t(0)); // total hits for (document, term)
 
                 do
                 {
@@ -89,31 +181,43 @@ void SegmentIndexSession::commit_document_impl(const document_proxy &proxy, cons
                         ++termHits;
                 } while (++p != e && p->first == term);
 
-                require(termHits <= UINT16_MAX);
-                *(uint16_t *)(b.data() + o) = termHits; // total hits for (document, term): TODO use varint?
+                *(uint32_t *)(b.data() + o) = termHits;
+
+                // hits are sorted by position, so the last is the highest
+                state.maxPosition = std::max<tokenpos_t>(state.maxPosition, prev);
 
                 ++terms;
         }
 
-        *(uint16_t *)(b.data() + offset) = terms; // total distinct terms for (document) XXX: see earlier comments
+        *(uint32_t *)(b.data() + offset) = terms;
+
+        if (terms)
+                ++state.indexedDocuments;
+
+        for (auto mask = proxy.fieldsMask; mask; mask &= mask - 1)
+        {
+                const field_id_t field = SwitchBitOps::TrailingZeros(mask);
+
+                state.norms.push_back({proxy.did, proxy.fieldLengths[field], field});
+        }
 
         if (intermediateStateFlushFreq && b.size() > intermediateStateFlushFreq)
         {
-                if (backingFileFD == -1)
+                if (state.backingFileFD == -1)
                 {
                         Buffer path;
 
-                        path.append("/tmp/trinity-index-intermediate.", Timings::Microseconds::SysTime(), ".", uint32_t(getpid()), ".tmp");
-                        backingFileFD = open(path.c_str(), O_RDWR | O_CREAT | O_LARGEFILE | O_TRUNC | O_EXCL, 0755);
+                        path.append("/tmp/trinity-index-intermediate.", Timings::Microseconds::SysTime(), ".", uint32_t(getpid()), ".", uint64_t(uintptr_t(&state)), ".tmp");
+                        state.backingFileFD = open(path.c_str(), O_RDWR | O_CREAT | O_LARGEFILE | O_TRUNC | O_EXCL, 0755);
 
-                        if (backingFileFD == -1)
+                        if (state.backingFileFD == -1)
                                 throw Switch::data_error("Failed to persist state");
 
                         // Unlink it here; won't need it
                         unlink(path.c_str());
                 }
 
-                if (write(backingFileFD, b.data(), b.size()) != b.size())
+                if (write(state.backingFileFD, b.data(), b.size()) != b.size())
                         throw Switch::data_error("Failed to persist state");
 
                 b.clear();
@@ -125,7 +229,7 @@ str8_t SegmentIndexSession::term(const uint32_t id)
 	return invDict[id];
 }
 
-uint32_t SegmentIndexSession::term_id(const str8_t term)
+uint32_t SegmentIndexSession::single_thread_term_id(const str8_t term)
 {
 	// Indexer words space
 	// Each segment has its own terms and there is no need to maintain a global(index) or local(segment) (term=>id) dictionary
@@ -141,6 +245,8 @@ uint32_t SegmentIndexSession::term_id(const str8_t term)
 	const auto p = dictionary.insert({term, 0});
 	
 	idp = &p.first->second;
+	// we are only going to point the key to a copy of the same term, so its hash and equality are unaffected
+	keyptr = const_cast<str8_t *>(&p.first->first);
 	if (p.second)
 #endif
         {
@@ -151,19 +257,103 @@ uint32_t SegmentIndexSession::term_id(const str8_t term)
         return *idp;
 }
 
-void SegmentIndexSession::erase(const docid_t documentID)
+// Terms are assigned to shards by hash; most terms are already registered, so we only need a shared lock for them
+uint32_t SegmentIndexSession::concurrent_term_id(const str8_t term)
+{
+        auto &shard = shards[std::hash<str8_t>{}(term) & (DICTIONARY_SHARDS - 1)];
+
+        {
+                std::shared_lock<std::shared_mutex> g(shard.lock);
+                const auto it = shard.map.find(term);
+
+                if (it != shard.map.end())
+                        return it->second;
+        }
+
+        std::unique_lock<std::shared_mutex> g(shard.lock);
+        const auto res = shard.map.insert({term, 0});
+
+        if (res.second)
+        {
+                const str8_t key(shard.allocator.CopyOf(term.data(), term.size()), term.size());
+
+                // we are only going to point the key to a copy of the same term, so its hash and equality are unaffected
+                const_cast<str8_t *>(&res.first->first)->Set(key.data(), key.size());
+                res.first->second = lastTermID.fetch_add(1, std::memory_order_relaxed) + 1;
+                shard.added.push_back({res.first->second, key});
+        }
+
+        return res.first->second;
+}
+
+void SegmentIndexSession::reconcile_terms()
+{
+        if (!shards)
+                return;
+
+        for (size_t i{0}; i != DICTIONARY_SHARDS; ++i)
+        {
+                auto &shard = shards[i];
+
+                for (const auto &it : shard.added)
+                        invDict.insert({it.first, it.second});
+
+                shard.added.clear();
+        }
+}
+
+SegmentIndexSession::ingestion_worker *SegmentIndexSession::new_worker()
 {
-	if (unlikely(!commitedDocuments.insert(documentID).second))
-		throw Switch::data_error("Already committed document ", documentID);
+        if (!shards)
+        {
+                // Terms registered so far are migrated to the shards, so that they retain their IDs
+                shards.reset(new dictionary_shard[DICTIONARY_SHARDS]);
 
-        updatedDocumentIDs.push_back(documentID);
+                for (const auto &it : invDict)
+                {
+#ifdef LEAN_SWITCH
+                        const auto id = it.first;
+                        const auto term = it.second;
+#else
+                        const auto id = it.key();
+                        const auto term = it.value();
+#endif
+
+                        shards[std::hash<str8_t>{}(term) & (DICTIONARY_SHARDS - 1)].map.insert({term, id});
+                }
+
+                lastTermID.store(dictionary.size(), std::memory_order_relaxed);
+        }
+
+        workersStates.emplace_back(new ingestion_state());
+        workers.emplace_back(new ingestion_worker(*this, *workersStates.back()));
+        return workers.back().get();
+}
+
+void SegmentIndexSession::erase_impl(ingestion_state &state, const docid_t documentID)
+{
+        {
+                std::lock_guard<std::mutex> g(commitedDocumentsLock);
+
+                if (unlikely(!commitedDocuments.insert(documentID).second))
+                        throw Switch::data_error("Already committed document ", documentID);
+        }
+
+        state.updatedDocumentIDs.push_back(documentID);
 }
 
 Trinity::SegmentIndexSession::document_proxy SegmentIndexSession::begin(const docid_t documentID)
 {
-        hits.clear();
-        hitsBuf.clear();
-        return {*this, documentID, hits, hitsBuf};
+        main.hits.clear();
+        main.hitsBuf.clear();
+        return {*this, documentID, main.hits, main.hitsBuf};
+}
+
+Trinity::SegmentIndexSession::document_proxy SegmentIndexSession::ingestion_worker::begin(const docid_t documentID)
+{
+        state.hits.clear();
+        state.hitsBuf.clear();
+        return {sess, documentID, state.hits, state.hitsBuf};
 }
 
 // You are expected to have invoked sess->begin() and built the index in sess->indexOut
@@ -212,6 +402,33 @@ void Trinity::persist_segment(Trinity::Codecs::IndexSession *const sess, std::ve
         sess->end();
 }
 
+void Trinity::persist_norms(const char *basePath, std::vector<field_norm> &norms)
+{
+        std::sort(norms.begin(), norms.end());
+
+        if (Utilities::to_file(reinterpret_cast<const char *>(norms.data()), norms.size() * sizeof(field_norm), Buffer{}.append(basePath, "/norms").c_str()) == -1)
+                throw Switch::system_error("Failed to persist norms");
+}
+
+void Trinity::persist_common_grams(const char *basePath, std::vector<str8_t> &bigrams)
+{
+        IOBuffer b;
+
+        std::sort(bigrams.begin(), bigrams.end(), [](const auto &a, const auto &b) noexcept {
+                return terms_cmp(a.data(), a.size(), b.data(), b.size()) < 0;
+        });
+        bigrams.erase(std::unique(bigrams.begin(), bigrams.end()), bigrams.end());
+
+        for (const auto it : bigrams)
+        {
+                b.pack(it.size());
+                b.serialize(it.data(), it.size());
+        }
+
+        if (Utilities::to_file(b.data(), b.size(), Buffer{}.append(basePath, "/commongrams").c_str()) == -1)
+                throw Switch::system_error("Failed to persist common grams");
+}
+
 void Trinity::persist_segment(Trinity::Codecs::IndexSession *const sess, std::vector<docid_t> &updatedDocumentIDs)
 {
         auto path = Buffer{}.append(sess->basePath, "/index.t");
@@ -232,17 +449,17 @@ void Trinity::persist_segment(Trinity::Codecs::IndexSession *const sess, std::ve
 
 void SegmentIndexSession::commit(Trinity::Codecs::IndexSession *const sess)
 {
+        // 16 bytes; this is what bounds the memory required to sort all postings, see set_commit_memory_budget()
         struct segment_data
         {
                 uint32_t termID;
                 docid_t documentID;
-                uint32_t hitsOffset;
-                uint16_t hitsCnt; // XXX: see comments earlier
-		uint8_t rangeIdx;
+                uint64_t hitsOffset : 56; // of the (document, term) hits count; backing files can be larger than 4GB
+                uint64_t rangeIdx : 8;
         };
 
-        std::vector<uint32_t> allOffsets;
-        Switch::unordered_map<uint32_t, term_index_ctx> map;
+        std::vector<docid_t> globalIDs; // see set_dense_document_ids()
+        std::vector<std::pair<str8_t, term_index_ctx>> v; // all encoded terms, in the order they were encoded
         std::unique_ptr<Trinity::Codecs::Encoder> enc_(sess->new_encoder());
         auto path = Buffer{}.append(sess->basePath, "/index.t");
         int indexFd = open(path.c_str(), O_WRONLY | O_CREAT | O_LARGEFILE | O_TRUNC, 0775);
@@ -255,14 +472,101 @@ void SegmentIndexSession::commit(Trinity::Codecs::IndexSession *const sess)
                         close(indexFd);
         });
 
-        const auto scan = [ flushFreq = this->flushFreq, indexFd, enc = enc_.get(), &map, sess ](const auto &ranges)
+        // Terms are encoded in lexicographic order, not in term IDs order, so that the segment doesn't depend on the order terms were
+        // registered in, which is not deterministic with concurrent ingestion(see new_worker())
+        std::vector<uint32_t> termsRanks;
+
+        reconcile_terms();
+        {
+                std::vector<std::pair<uint32_t, str8_t>> terms;
+
+                terms.reserve(invDict.size());
+                for (const auto &it : invDict)
+                {
+#ifdef LEAN_SWITCH
+                        terms.push_back({it.first, it.second});
+#else
+                        terms.push_back({it.key(), it.value()});
+#endif
+                }
+
+                std::sort(terms.begin(), terms.end(), [](const auto &a, const auto &b) noexcept {
+                        return terms_cmp(a.second.data(), a.second.size(), b.second.data(), b.second.size()) < 0;
+                });
+
+                termsRanks.resize(terms.size() + 1);
+                for (uint32_t i{0}; i != terms.size(); ++i)
+                {
+                        require(terms[i].first < termsRanks.size());
+                        termsRanks[terms[i].first] = i;
+                }
+        }
+
+        const auto scan = [ flushFreq = this->flushFreq, encodingThreads = this->encodingThreads, budget = this->commitMemoryBudget, dense = this->denseDocumentIDs, &globalIDs, &termsRanks, indexFd, enc = enc_.get(), &v, this, sess ](const auto &ranges)
         {
                 uint8_t payloadSize;
                 std::vector<segment_data> all;
-                term_index_ctx tctx;
 		const auto R = ranges.data();
-	
-		require(ranges.size() < sizeof(uint8_t) << 3);
+                const auto ranks = termsRanks.data();
+                const auto cmp = [ranks](const segment_data &a, const segment_data &b) noexcept {
+                        return ranks[a.termID] < ranks[b.termID] || (a.termID == b.termID && a.documentID < b.documentID);
+                };
+                // External sort; see set_commit_memory_budget()
+                // Runs of sorted postings are spilled to a temporary file, and then merged.
+                const size_t runCapacity = budget ? std::max<size_t>(budget / sizeof(segment_data), 1024) : std::numeric_limits<size_t>::max();
+                std::vector<std::pair<uint64_t, uint64_t>> runs; // (offset in runsFD, postings)
+                uint64_t runsSize{0};
+                int runsFD{-1};
+
+                Defer({
+                        if (runsFD != -1)
+                                close(runsFD);
+                });
+
+                const auto spill = [&]() {
+                        const auto size = all.size() * sizeof(segment_data);
+
+                        std::sort(all.begin(), all.end(), cmp);
+
+                        if (runsFD == -1)
+                        {
+                                Buffer path;
+
+                                path.append("/tmp/trinity-index-runs.", Timings::Microseconds::SysTime(), ".", uint32_t(getpid()), ".", uint64_t(uintptr_t(&all)), ".tmp");
+                                runsFD = open(path.c_str(), O_RDWR | O_CREAT | O_LARGEFILE | O_TRUNC | O_EXCL, 0755);
+
+                                if (runsFD == -1)
+                                        throw Switch::system_error("Failed to persist sorted run");
+
+                                // Unlink it here; won't need it
+                                unlink(path.c_str());
+                        }
+
+                        // write() may write fewer bytes than requested(and no more than ~2GB at once), so we loop
+                        for (const auto *p = reinterpret_cast<const char *>(all.data()), *const e = p + size; p != e;)
+                        {
+                                const auto r = write(runsFD, p, std::min<size_t>(e - p, 1u << 30));
+
+                                if (r == -1)
+                                {
+                                        if (errno == EINTR)
+                                                continue;
+
+                                        throw Switch::system_error("Failed to persist sorted run");
+                                }
+
+                                p += r;
+                        }
+
+                        runs.push_back({runsSize, all.size()});
+                        runsSize += size;
+                        all.clear();
+                };
+
+                if (budget)
+                        all.reserve(runCapacity);
+
+		require(ranges.size() <= std::numeric_limits<uint8_t>::max());
 		for (uint8_t i{0}; i != ranges.size(); ++i)
 		{
 			const auto range = R[i];
@@ -273,8 +577,8 @@ void SegmentIndexSession::commit(Trinity::Codecs::IndexSession *const sess)
                         {
                                 const auto documentID = *(docid_t *)p;
                                 p += sizeof(docid_t);
-                                auto termsCnt = *(uint16_t *)p; // XXX: see earlier comments
-                                p += sizeof(uint16_t);
+                                auto termsCnt = *(uint32_t *)p;
+                                p += sizeof(uint32_t);
 
                                 if (!termsCnt)
                                 {
@@ -282,16 +586,17 @@ void SegmentIndexSession::commit(Trinity::Codecs::IndexSession *const sess)
                                         continue;
                                 }
 
+                                if (dense)
+                                        globalIDs.push_back(documentID);
+
                                 do
                                 {
                                         const auto term = *(uint32_t *)p;
                                         p += sizeof(uint32_t);
-                                        auto hitsCnt = *(uint16_t *)p; // XXX: see earlier comments
-                                        const auto saved{hitsCnt};
+                                        const auto base{p};
+                                        auto hitsCnt = *(uint32_t *)p;
 
                                         p += sizeof(hitsCnt);
-
-                                        const auto base{p};
                                         do
                                         {
                                                 const auto deltaMask = Compression::decode_varuint32(p);
@@ -302,52 +607,266 @@ void SegmentIndexSession::commit(Trinity::Codecs::IndexSession *const sess)
                                                 p += payloadSize;
                                         } while (--hitsCnt);
 
-                                        all.push_back({term, documentID, uint32_t(base - data), saved, i});
+                                        all.push_back({term, documentID, uint64_t(base - data), i});
+                                        if (unlikely(all.size() == runCapacity))
+                                                spill();
                                 } while (--termsCnt);
                         }
                 }
 
-                std::sort(all.begin(), all.end(), [](const auto &a, const auto &b) noexcept {
-                        return a.termID < b.termID || (a.termID == b.termID && a.documentID < b.documentID);
-                });
+                if (dense)
+                {
+                        // local ID of a document is its (1-based) index in globalIDs, so that translation is monotonic
+                        // and postings sorted by global IDs are also sorted by local IDs
+                        std::sort(globalIDs.begin(), globalIDs.end());
+                        globalIDs.erase(std::unique(globalIDs.begin(), globalIDs.end()), globalIDs.end());
+                }
 
-                for (const auto *it = all.data(), *const e = it + all.size(); it != e;)
+                const auto local_docid = [dense, &globalIDs](const docid_t id) noexcept -> docid_t {
+                        return dense ? std::lower_bound(globalIDs.begin(), globalIDs.end(), id) - globalIDs.begin() + 1 : id;
+                };
+
+                // Encodes the postings of all terms provided by next(), until it returns nullptr, and invokes on_term() for each of them
+                const auto encode = [R](Trinity::Codecs::Encoder *const enc, auto &&next, auto &&on_term) {
+                        uint8_t payloadSize;
+                        term_index_ctx tctx;
+                        const segment_data *it = next();
+
+                        while (it)
+                        {
+                                const auto term = it->termID;
+                                docid_t prevDID{0};
+
+                                enc->begin_term();
+
+                                do
+                                {
+                                        const auto documentID = it->documentID;
+                                        const auto *p = R[it->rangeIdx].offset + it->hitsOffset;
+                                        const auto hitsCnt = *(uint32_t *)p;
+                                        uint32_t pos{0};
+
+                                        p += sizeof(uint32_t);
+
+                                        require(documentID > prevDID);
+
+                                        enc->begin_document(documentID);
+                                        for (uint32_t i{0}; i != hitsCnt; ++i)
+                                        {
+                                                const auto deltaMask = Compression::decode_varuint32(p);
+
+                                                if (0 == (deltaMask & 1))
+                                                        payloadSize = Compression::decode_varuint32(p);
+
+                                                pos += deltaMask >> 1;
+
+                                                enc->new_hit(pos, {p, payloadSize});
+
+                                                p += payloadSize;
+                                        }
+                                        enc->end_document();
+
+                                        prevDID = documentID;
+                                } while ((it = next()) && it->termID == term);
+
+                                enc->end_term(&tctx);
+                                on_term(term, tctx);
+                        }
+                };
+                const auto persist_term = [&](const uint32_t term, const term_index_ctx &tctx) {
+                        v.push_back({this->term(term), tctx});
+
+                        if (flushFreq && sess->indexOut.size() > flushFreq)
+                                sess->flush_index(indexFd);
+                };
+
+                if (runs.size())
                 {
-                        const auto term = it->termID;
-                        docid_t prevDID{0};
+                        // k-way merge of the sorted runs into the encoder
+                        // each run gets an equal share of the budget for buffering its postings
+                        struct run_cursor final
+                        {
+                                uint64_t offset;
+                                uint64_t remaining;
+                                segment_data *data;
+                                uint32_t idx, cnt;
+                        };
+
+                        if (all.size())
+                                spill();
+
+                        std::vector<segment_data>().swap(all);
+
+                        const auto runsCnt = runs.size();
+                        const size_t bufCapacity = std::max<size_t>(runCapacity / runsCnt, 64);
+                        std::unique_ptr<segment_data[]> bufs(new segment_data[bufCapacity * runsCnt]);
+                        std::vector<run_cursor> cursors;
+                        std::vector<run_cursor *> heap;
+                        segment_data cur;
+                        const auto refill = [&](run_cursor *const c) {
+                                const auto n = std::min<uint64_t>(c->remaining, bufCapacity);
+                                const auto size = n * sizeof(segment_data);
+
+                                // like spill(), we loop because pread64() may read fewer bytes than requested(and no more than ~2GB at once)
+                                auto *const base = reinterpret_cast<char *>(c->data);
+
+                                for (uint64_t done{0}; done != size;)
+                                {
+                                        const auto r = pread64(runsFD, base + done, std::min<uint64_t>(size - done, 1u << 30), c->offset + done);
 
-                        enc->begin_term();
+                                        if (r == -1)
+                                        {
+                                                if (errno == EINTR)
+                                                        continue;
 
-                        do
+                                                throw Switch::system_error("Failed to read sorted run");
+                                        }
+                                        else if (r == 0)
+                                                throw Switch::data_error("Unexpected end of sorted run");
+
+                                        done += r;
+                                }
+
+                                c->offset += size;
+                                c->remaining -= n;
+                                c->idx = 0;
+                                c->cnt = n;
+                        };
+                        // std::push_heap() builds a max-heap
+                        const auto heap_cmp = [&cmp](const run_cursor *a, const run_cursor *b) noexcept {
+                                return cmp(b->data[b->idx], a->data[a->idx]);
+                        };
+
+                        cursors.reserve(runsCnt);
+                        for (size_t i{0}; i != runsCnt; ++i)
                         {
-                                const auto documentID = it->documentID;
-                                const auto hitsCnt = it->hitsCnt;
-                                const auto *p = R[it->rangeIdx].offset + it->hitsOffset;
-                                uint32_t pos{0};
+                                cursors.push_back({runs[i].first, runs[i].second, bufs.get() + i * bufCapacity, 0, 0});
+                                refill(&cursors.back());
+                                heap.push_back(&cursors.back());
+                        }
+                        std::make_heap(heap.begin(), heap.end(), heap_cmp);
+
+                        encode(enc, [&]() -> const segment_data * {
+                                if (heap.empty())
+                                        return nullptr;
+
+                                std::pop_heap(heap.begin(), heap.end(), heap_cmp);
+
+                                auto c = heap.back();
 
-                                require(documentID > prevDID);
+                                cur = c->data[c->idx];
+                                cur.documentID = local_docid(cur.documentID);
 
-                                enc->begin_document(documentID);
-                                for (uint32_t i{0}; i != hitsCnt; ++i)
+                                if (++c->idx != c->cnt || (c->remaining && (refill(c), true)))
+                                        std::push_heap(heap.begin(), heap.end(), heap_cmp);
+                                else
+                                        heap.pop_back();
+
+                                return &cur;
+                        },
+                               persist_term);
+                        return;
+                }
+
+                if (dense)
+                {
+                        for (auto &it : all)
+                                it.documentID = local_docid(it.documentID);
+                }
+
+                std::sort(all.begin(), all.end(), cmp);
+
+                const auto *const end = all.data() + all.size();
+                const auto range_cursor = [](const segment_data *it, const segment_data *const e) {
+                        return [it, e]() mutable -> const segment_data * {
+                                return it != e ? it++ : nullptr;
+                        };
+                };
+                std::vector<std::unique_ptr<Trinity::Codecs::IndexSession>> partitions;
+
+                // not worth it for small sessions
+                if (encodingThreads > 1 && all.size() >= encodingThreads * 4096)
+                {
+                        for (uint32_t i{0}; i != encodingThreads; ++i)
+                        {
+                                auto p = sess->new_partition();
+
+                                if (!p)
                                 {
-                                        const auto deltaMask = Compression::decode_varuint32(p);
+                                        // not supported by this codec
+                                        partitions.clear();
+                                        break;
+                                }
+
+                                partitions.emplace_back(p);
+                        }
+                }
 
-                                        if (0 == (deltaMask & 1))
-                                                payloadSize = Compression::decode_varuint32(p);
+                if (partitions.empty())
+                {
+                        encode(enc, range_cursor(all.data(), end), persist_term);
+                        return;
+                }
+
+                // Partitions are contiguous ranges of terms, and are appended in order, so that
+                // the index is identical to the one we would have built serially
+                const auto K = partitions.size();
+                std::vector<const segment_data *> bounds{all.data()};
+                std::vector<std::vector<uint32_t>> partitionsTerms(K);
+                std::vector<std::vector<term_index_ctx>> partitionsTCTXs(K);
+                std::vector<std::thread> threads;
+                std::exception_ptr failure;
+                std::mutex failureLock;
+
+                for (size_t i{1}; i != K; ++i)
+                {
+                        const segment_data *b = std::max<const segment_data *>(bounds.back(), all.data() + all.size() * i / K);
 
-                                        pos += deltaMask >> 1;
+                        while (b != end && b->termID == b[-1].termID)
+                                ++b;
 
-                                        enc->new_hit(pos, {p, payloadSize});
+                        bounds.push_back(b);
+                }
+                bounds.push_back(end);
+
+                for (size_t i{0}; i != K; ++i)
+                {
+                        threads.emplace_back([&, i]() {
+                                try
+                                {
+                                        std::unique_ptr<Trinity::Codecs::Encoder> penc(partitions[i]->new_encoder());
 
-                                        p += payloadSize;
+                                        encode(penc.get(), range_cursor(bounds[i], bounds[i + 1]), [&](const uint32_t term, const term_index_ctx &tctx) {
+                                                partitionsTerms[i].push_back(term);
+                                                partitionsTCTXs[i].push_back(tctx);
+                                        });
                                 }
-                                enc->end_document();
+                                catch (...)
+                                {
+                                        std::lock_guard<std::mutex> g(failureLock);
+
+                                        if (!failure)
+                                                failure = std::current_exception();
+                                }
+                        });
+                }
+
+                for (auto &t : threads)
+                        t.join();
+
+                if (failure)
+                        std::rethrow_exception(failure);
+
+                for (size_t i{0}; i != K; ++i)
+                {
+                        auto &tctxs = partitionsTCTXs[i];
+                        const auto &terms = partitionsTerms[i];
 
-                                prevDID = documentID;
-                        } while (++it != e && it->termID == term);
+                        sess->append_partition(partitions[i].get(), tctxs.data(), tctxs.size());
+                        partitions[i].reset();
 
-                        enc->end_term(&tctx);
-                        map.insert({term, tctx});
+                        for (size_t j{0}; j != terms.size(); ++j)
+                                v.push_back({this->term(terms[j]), tctxs[j]});
 
                         if (flushFreq && sess->indexOut.size() > flushFreq)
                                 sess->flush_index(indexFd);
@@ -359,60 +878,68 @@ void SegmentIndexSession::commit(Trinity::Codecs::IndexSession *const sess)
         sess->begin();
 
 	std::vector<range_base<const uint8_t *, size_t>> ranges;
+	std::vector<range_base<void *, size_t>> mapped;
+	std::vector<ingestion_state *> states{&main};
+	uint64_t indexedDocuments{0};
+	tokenpos_t maxPosition{0};
+	std::vector<docid_t> updatedDocumentIDs;
+	std::vector<field_norm> norms;
+
+	Defer({
+		for (const auto &it : mapped)
+			munmap(it.offset, it.size());
+	});
+
+	for (auto &it : workersStates)
+		states.push_back(it.get());
+
+	for (auto state : states)
+	{
+		auto &b = state->b;
 
-	if (b.size())
-		ranges.push_back({reinterpret_cast<const uint8_t *>(b.data()), b.size()});
-
-	if (backingFileFD != -1)
-        {
-                const auto fileSize = lseek64(backingFileFD, 0, SEEK_END);
+		indexedDocuments += state->indexedDocuments;
+		maxPosition = std::max(maxPosition, state->maxPosition);
+		norms.insert(norms.end(), state->norms.begin(), state->norms.end());
+		updatedDocumentIDs.insert(updatedDocumentIDs.end(), state->updatedDocumentIDs.begin(), state->updatedDocumentIDs.end());
 
-                if (fileSize == off64_t(-1))
-                        throw Switch::data_error("Failed to access backing file");
+		if (b.size())
+			ranges.push_back({reinterpret_cast<const uint8_t *>(b.data()), b.size()});
 
-                auto fileData = mmap(nullptr, fileSize, PROT_READ, MAP_SHARED, backingFileFD, 0);
+		if (state->backingFileFD != -1)
+		{
+			const auto fileSize = lseek64(state->backingFileFD, 0, SEEK_END);
 
-                if (fileData == MAP_FAILED)
-                        throw Switch::data_error("Failed to access backing file");
+			if (fileSize == off64_t(-1))
+				throw Switch::data_error("Failed to access backing file");
 
-                Defer({
-                        munmap(fileData, fileSize);
-                });
+			auto fileData = mmap(nullptr, fileSize, PROT_READ, MAP_SHARED, state->backingFileFD, 0);
 
-		madvise(fileData, fileSize, MADV_SEQUENTIAL);
-                ranges.push_back({reinterpret_cast<const uint8_t *>(fileData), size_t(fileSize)});
+			if (fileData == MAP_FAILED)
+				throw Switch::data_error("Failed to access backing file");
 
-		scan(ranges);
+			mapped.push_back({fileData, size_t(fileSize)});
+			madvise(fileData, fileSize, MADV_SEQUENTIAL);
+			ranges.push_back({reinterpret_cast<const uint8_t *>(fileData), size_t(fileSize)});
+		}
+	}
 
-		close(backingFileFD);
-		backingFileFD = -1;
-        }
-	else if (ranges.size())
+	if (ranges.size())
 		scan(ranges);
 
-
-
+	for (auto state : states)
+	{
+		if (state->backingFileFD != -1)
+		{
+			close(state->backingFileFD);
+			state->backingFileFD = -1;
+		}
+	}
 
         // Persist terms dictionary
-        std::vector<std::pair<str8_t, term_index_ctx>> v;
 	size_t sum{0};
 
-        for (const auto &it : map)
-        {
-#ifdef LEAN_SWITCH
-                const auto termID = it.first;
-                const auto term = invDict[termID]; // actual term
-
+        for (const auto &it : v)
 		sum += it.second.indexChunk.size();
-                v.push_back({term, it.second});
-#else
-                const auto termID = it.key();
-                const auto term = invDict[termID]; // actual term
-
-		sum += it.value().indexChunk.size();
-                v.push_back({term, it.value()});
-#endif
-        }
 
 	// TODO: move this out to another method (persist), so that
 	// if we want to keep those resident in-memory
@@ -420,6 +947,25 @@ void SegmentIndexSession::commit(Trinity::Codecs::IndexSession *const sess)
 	// use this handy class to build a memory resident index, without
 	// having to directly use the various codec classes.
         sess->persist_terms(v);
+
+        if (Utilities::to_file(reinterpret_cast<const char *>(&indexedDocuments), sizeof(indexedDocuments), Buffer{}.append(sess->basePath, "/documents").c_str()) == -1)
+                throw Switch::system_error("Failed to persist documents count");
+
+        if (maxPosition && Utilities::to_file(reinterpret_cast<const char *>(&maxPosition), sizeof(maxPosition), Buffer{}.append(sess->basePath, "/max_position").c_str()) == -1)
+                throw Switch::system_error("Failed to persist max position");
+
+        if (globalIDs.size())
+        {
+                if (Utilities::to_file(reinterpret_cast<const char *>(globalIDs.data()), globalIDs.size() * sizeof(docid_t), Buffer{}.append(sess->basePath, "/globalids").c_str()) == -1)
+                        throw Switch::system_error("Failed to persist global document IDs");
+        }
+
+        if (commonGramsTerms.size())
+                persist_common_grams(sess->basePath, commonGramsTerms);
+
+        if (norms.size())
+                persist_norms(sess->basePath, norms);
+
         persist_segment(sess, updatedDocumentIDs, indexFd);
 
 	if (fsync(indexFd) == -1)
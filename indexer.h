@@ -4,7 +4,10 @@
 #include <switch_dictionary.h>
 #include <switch_mallocators.h>
 #include <switch_bitops.h>
+#include <atomic>
+#include <mutex>
 #include <set>
+#include <shared_mutex>
 
 namespace Trinity
 {
@@ -15,38 +18,93 @@ namespace Trinity
 	// Wrapper for persist_segment(); opens the index file and passes it to persist_segment()
         void persist_segment(Trinity::Codecs::IndexSession *const sess, std::vector<uint32_t> &updatedDocumentIDs);
 
+        // Persists the field norms of the segment's documents in `basePath`, sorted by (document, field), into its `norms` file; see IndexSource::field_length()
+        void persist_norms(const char *basePath, std::vector<field_norm> &norms);
+
+        // Persists the bigram terms indexed in the segment in `basePath`(see SegmentIndexSession::set_common_grams()), sorted, into its `commongrams` file
+        void persist_common_grams(const char *basePath, std::vector<str8_t> &bigrams);
+
         // A utility class suitable for indexing document terms and persisting the index and other codec specifc data into a directory
         // It offers a simple API for adding, updating and erasing documents
         // You can use SegmentIndexSource to load the segment(and use it for search)
         class SegmentIndexSession final
         {
+              public:
+                using hits_vector = std::vector<std::pair<uint32_t, std::pair<uint32_t, range_base<uint32_t, uint8_t>>>>;
+
               private:
-                IOBuffer b;
-                IOBuffer hitsBuf;
-		int backingFileFD{-1};
-                std::vector<std::pair<uint32_t, std::pair<uint32_t, range_base<uint32_t, uint8_t>>>> hits;
-                std::vector<docid_t> updatedDocumentIDs;
+                // Documents are serialized into `b`(see commit_document_impl()); each ingestion thread has its own
+                struct ingestion_state final
+                {
+                        IOBuffer b;
+                        IOBuffer hitsBuf;
+                        int backingFileFD{-1};
+                        hits_vector hits;
+                        std::vector<std::pair<tokenpos_t, uint32_t>> positions; // see index_common_grams()
+                        std::vector<docid_t> updatedDocumentIDs;
+                        uint64_t indexedDocuments{0}; // persisted in commit(); see SegmentIndexSource::total_documents()
+                        tokenpos_t maxPosition{0};    // persisted in commit(); see SegmentIndexSource::max_indexed_position()
+                        std::vector<field_norm> norms; // persisted in commit(); see IndexSource::field_length()
+
+                        auto any_indexed() const noexcept
+                        {
+                                return backingFileFD != -1 || hitsBuf.size() || b.size() || updatedDocumentIDs.size();
+                        }
+
+                        ~ingestion_state()
+                        {
+                                if (backingFileFD != -1)
+                                        close(backingFileFD);
+                        }
+                };
+
+                // See new_worker()
+                struct alignas(64) dictionary_shard final
+                {
+                        std::shared_mutex lock;
+                        std::unordered_map<str8_t, uint32_t> map;
+                        simple_allocator allocator;
+                        std::vector<std::pair<uint32_t, str8_t>> added; // reconciled into invDict in reconcile_terms()
+                };
+
+                static constexpr size_t DICTIONARY_SHARDS{64};
+
+                ingestion_state main;
+                std::vector<std::unique_ptr<ingestion_state>> workersStates;
+                std::mutex commitedDocumentsLock;
 		std::set<docid_t> commitedDocuments;
+		bool denseDocumentIDs{false};
                 simple_allocator dictionaryAllocator;
                 Switch::unordered_map<str8_t, uint32_t> dictionary;
                 Switch::unordered_map<uint32_t, str8_t> invDict;
+                // concurrent ingestion; see new_worker()
+                std::unique_ptr<dictionary_shard[]> shards;
+                std::atomic<uint32_t> lastTermID{0};
 		// See IndexSession::indexOutFlushed comments
 		uint32_t flushFreq{0}, intermediateStateFlushFreq{0};
+		uint32_t encodingThreads{1}; // see set_encoding_threads()
+		size_t commitMemoryBudget{0}; // see set_commit_memory_budget()
+		// (first term ID, second term ID) => bigram term ID; see set_common_grams()
+		std::unordered_map<uint64_t, uint32_t> commonGrams;
+		std::vector<str8_t> commonGramsTerms;
 
               public:
                 struct document_proxy final
                 {
                         SegmentIndexSession &sess;
                         const docid_t did;
-                        std::vector<std::pair<uint32_t, std::pair<uint32_t, range_base<uint32_t, uint8_t>>>> &hits;
+                        hits_vector &hits;
                         IOBuffer &hitsBuf;
+                        // number of hits of each field inserted via the field-scoped insert() methods; see IndexSource::field_length()
+                        uint32_t fieldLengths[Limits::MaxFields + 1]{0};
+                        uint32_t fieldsMask{0};
 
                         uint32_t term_id(const str8_t term)
                         {
                                 return sess.term_id(term);
                         }
 
-                        document_proxy(SegmentIndexSession &s, docid_t documentID, std::vector<std::pair<uint32_t, std::pair<uint32_t, range_base<uint32_t, uint8_t>>>> &h, IOBuffer &hb)
+                        document_proxy(SegmentIndexSession &s, docid_t documentID, hits_vector &h, IOBuffer &hb)
                             : sess{s}, did{documentID}, hits{h}, hitsBuf{hb}
                         {
                         }
@@ -85,6 +143,18 @@ namespace Trinity
                                 insert(term_id(term), position, {static_cast<const uint8_t *>(&v), uint32_t(sizeof(T))});
                         }
 
+                        // new `term` hit for `field` at `position` with `payload`
+                        // The hit is indexed for (field, term)(see field_term()), so that it is only matched by queries for that field, e.g [title:apple] or
+                        // [title:"apple iphone"] for field title(see query::parse()), while phrases only match terms of the same field. The length of each field
+                        // is also tracked and persisted as a norm(see IndexSource::field_length()). Field 0 is the default field, matched by queries not restricted
+                        // to a field; terms of other fields can be at most (Limits::MaxTermLength - 1) characters long, longer terms are only accounted for in the field's length.
+                        void insert(const field_id_t field, const str8_t term, const tokenpos_t position, range_base<const uint8_t *, const uint8_t> payload);
+
+                        void insert(const field_id_t field, const str8_t term, const tokenpos_t position)
+                        {
+                                insert(field, term, position, {});
+                        }
+
 			void insert_var_payload(const uint32_t termID, const tokenpos_t pos, const uint64_t payload)
 			{
 				const uint8_t requiredBytes = ((64 - SwitchBitOps::LeadingZeros(payload)) + 7) >> 3;
@@ -93,19 +163,84 @@ namespace Trinity
 			}
                 };
 
+                // An ingestion thread's handle; see SegmentIndexSession::new_worker()
+                class ingestion_worker final
+                {
+                        friend class SegmentIndexSession;
+
+                      private:
+                        SegmentIndexSession &sess;
+                        ingestion_state &state;
+
+                        ingestion_worker(SegmentIndexSession &s, ingestion_state &st)
+                            : sess{s}, state{st}
+                        {
+                        }
+
+                      public:
+                        // See SegmentIndexSession::begin()
+                        document_proxy begin(const docid_t documentID);
+
+                        // See SegmentIndexSession::insert()
+                        void insert(const document_proxy &proxy)
+                        {
+                                sess.commit_document_impl(state, proxy, false);
+                        }
+
+                        // See SegmentIndexSession::update()
+                        void update(const document_proxy &proxy)
+                        {
+                                sess.commit_document_impl(state, proxy, true);
+                        }
+
+                        // See SegmentIndexSession::erase()
+                        void erase(const docid_t documentID)
+                        {
+                                sess.erase_impl(state, documentID);
+                        }
+                };
+
+              private:
+                std::vector<std::unique_ptr<ingestion_worker>> workers;
+
               private:
-                void commit_document_impl(const document_proxy &proxy, const bool isUpdate);
+                void commit_document_impl(ingestion_state &state, const document_proxy &proxy, const bool isUpdate);
+
+                void erase_impl(ingestion_state &state, const docid_t documentID);
+
+                void index_common_grams(ingestion_state &state, hits_vector &hits);
+
+                uint32_t concurrent_term_id(const str8_t term);
+
+                void reconcile_terms();
 
               public:
-                uint32_t term_id(const str8_t term);
+                uint32_t term_id(const str8_t term)
+                {
+                        return unlikely(shards) ? concurrent_term_id(term) : single_thread_term_id(term);
+                }
+
+                uint32_t single_thread_term_id(const str8_t term);
 
+		// In concurrent ingestion mode, terms are only available after commit()
 		str8_t term(const uint32_t id);
 
                 void clear()
                 {
-                        b.clear();
+                        main.b.clear();
                 }
 
+                // Enables concurrent ingestion, and returns a new worker for an ingestion thread, which
+                // has its own state(documents buffer, hits, etc), so that threads don't need to coordinate, except when registering new terms
+                // in the term dictionary, which is sharded, and when checking for documents indexed more than once.
+                //
+                // All workers are owned by the session. You should create all of them before you start using any of them, and you shouldn't use the session's
+                // own begin()/insert()/update()/erase() concurrently with them.
+                //
+                // commit() reconciles all workers state; the segment is identical to a segment built by a single thread that indexed the
+                // same documents, in any order, because commit() encodes terms in lexicographic order, and documents in ascending ID order.
+                ingestion_worker *new_worker();
+
 		// When != 0, whenever the session's indexOut size exceeds that value, the index
 		// will be flushed.
 		void set_flush_freq(const size_t n)
@@ -118,7 +253,48 @@ namespace Trinity
 			intermediateStateFlushFreq = n;
 		}
 
-                void erase(const docid_t documentID);
+		// If > 1, commit() will partition the terms into that many ranges and encode them in parallel, one thread per range, if
+		// the codec supports it(see IndexSession::new_partition()). The index is identical to the one encoded by a single thread.
+		// Each partition's encoded postings are held in memory until they are appended to the session's index.
+		void set_encoding_threads(const uint32_t n)
+		{
+			encodingThreads = n;
+		}
+
+		// By default, commit() sorts all (term, document) postings of the session in memory, which requires 16 bytes/posting.
+		// If set(in bytes), commit() will instead sort runs of postings that fit in that budget, spill them to a temporary file, and then merge them
+		// into the codec's encoder, so that the memory required is bounded regardless of the number of indexed documents.
+		// Postings are still encoded in the same order, so the segment is identical to a segment built without a budget.
+		//
+		// Note that this doesn't account for the terms dictionary, the documents buffered before they are flushed(see set_intermediate_state_flush_freq()), which you
+		// should also set for large sessions, or the encoded index(see set_flush_freq()). Parallel encoding(see set_encoding_threads()) is not used when runs are spilled.
+		void set_commit_memory_budget(const size_t n)
+		{
+			commitMemoryBudget = n;
+		}
+
+		// If set, commit() will index dense segment-local document IDs(1, 2, 3, ..) instead of the document IDs you indexed, assigned
+		// in ascending document ID order, and will persist their global IDs in the segment's `globalids` file.
+		// Local IDs result in smaller deltas, so the index will compress better.
+		// See IndexSource::translate_docid()
+		void set_dense_document_ids(const bool v)
+		{
+			denseDocumentIDs = v;
+		}
+
+		// Phrases of common terms(e.g [of the], [world of warcraft]) are expensive to match, because the posting lists of those terms are long, and
+		// their hits need to be materialized for every candidate document.
+		// For each of `grams`, whenever its two terms are found at adjacent positions in a document, the session will also index a hit of
+		// their bigram term(see bigram_term()) at the position of the first term. The bigram terms are persisted in the segment(see persist_common_grams()),
+		// and the execution engine will match phrases that include those pairs using their bigram terms(see IndexSource::indexes_bigram())
+		//
+		// You must set this before you index any documents; throws Switch::data_error otherwise. Pairs with a bigram term longer than Limits::MaxTermLength are ignored.
+		void set_common_grams(const std::vector<std::pair<str8_t, str8_t>> &grams);
+
+                void erase(const docid_t documentID)
+                {
+                        erase_impl(main, documentID);
+                }
 
                 // After you have obtained a document_proxy, you can use its insert methods to register term hits
                 // and when you are done indexing a document, use insert() or update() to insert as a NEW document or UPDATE an existing
@@ -131,14 +307,14 @@ namespace Trinity
                 // It should be easy to implement that again later
                 void insert(const document_proxy &proxy)
                 {
-                        commit_document_impl(proxy, false);
+                        commit_document_impl(main, proxy, false);
                 }
 
 		// Use this method instead of insert() when you are updating a document.
 		// If you are not, you should (but are not required to) use insert()
                 void update(const document_proxy &proxy)
                 {
-                        commit_document_impl(proxy, true);
+                        commit_document_impl(main, proxy, true);
                 }
 
                 // Persist index and masked products into the directory s->basePath
@@ -147,13 +323,16 @@ namespace Trinity
 
 		auto any_indexed() const noexcept
 		{
-			return backingFileFD != -1 || hitsBuf.size() || b.size() || updatedDocumentIDs.size();
-		}
+			if (main.any_indexed())
+				return true;
 
-		~SegmentIndexSession()
-		{
-			if (backingFileFD != -1)
-				close(backingFileFD);
+			for (const auto &it : workersStates)
+			{
+				if (it->any_indexed())
+					return true;
+			}
+
+			return false;
 		}
         };
 }
@@ -17,6 +17,9 @@ void Trinity::intersect_impl(const uint64_t stopwordsMask,
         Dexpect(tokens.size() <= sizeof(uint64_t) << 3);
         Dexpect(out);
 
+        if (!src->global_docids_ascending())
+                maskedDocumentsRegistry->randomAccess = true;
+
         uint64_t origMask{0}; // we don't want to match the original query
         uint16_t rem{0};
 	bool anyUnknown{false};
@@ -171,7 +174,7 @@ void Trinity::intersect_impl(const uint64_t stopwordsMask,
                 {
                         if (0 == (stopwordsMask & ((uint64_t(1) << first) | (uint64_t(1) << last))))
                         {
-                                if (!maskedDocumentsRegistry->test(lowest))
+                                if (!maskedDocumentsRegistry->test(src->translate_docid(lowest)))
                                         c.consider(mask);
                         }
                 }
@@ -188,6 +188,24 @@ void Trinity::Codecs::Lucene::IndexSession::end()
         }
 }
 
+void Trinity::Codecs::Lucene::IndexSession::append_partition(Trinity::Codecs::IndexSession *partition_, term_index_ctx *tctxs, const size_t cnt)
+{
+        auto partition = static_cast<Trinity::Codecs::Lucene::IndexSession *>(partition_);
+        const uint32_t positionsBase = positionsOut.size() + positionsOutFlushed;
+        auto *const index = reinterpret_cast<uint8_t *>(partition->indexOut.data());
+
+        require(partition->positionsOutFlushed == 0 && partition->indexOutFlushed == 0);
+
+        for (size_t i{0}; i != cnt; ++i)
+                *(uint32_t *)(index + tctxs[i].indexChunk.offset) += positionsBase;
+
+        positionsOut.serialize(partition->positionsOut.data(), partition->positionsOut.size());
+        Trinity::Codecs::IndexSession::append_partition(partition, tctxs, cnt);
+
+        if (flushFreq && positionsOut.size() > flushFreq)
+                flush_positions_data();
+}
+
 range32_t Trinity::Codecs::Lucene::IndexSession::append_index_chunk(const Trinity::Codecs::AccessProxy *src_, const term_index_ctx srcTCTX)
 {
         const auto src = static_cast<const Trinity::Codecs::Lucene::AccessProxy *>(src_);
@@ -899,10 +917,11 @@ Trinity::Codecs::Encoder *Trinity::Codecs::Lucene::IndexSession::new_encoder()
         return new Trinity::Codecs::Lucene::Encoder(this);
 }
 
-Trinity::Codecs::Decoder *Trinity::Codecs::Lucene::AccessProxy::new_decoder(const term_index_ctx &tctx)
+Trinity::Codecs::Decoder *Trinity::Codecs::Lucene::AccessProxy::new_decoder(const term_index_ctx &tctx, const bool useBlockCache)
 {
         auto d = std::make_unique<Trinity::Codecs::Lucene::Decoder>();
 
+        d->useBlockCache = useBlockCache;
         d->init(tctx, this);
         return d.release();
 }
@@ -1324,6 +1343,8 @@ void Trinity::Codecs::Lucene::Decoder::materialize_hits(const exec_term_id_t ter
 	//const bool trace = curDocument.id == 2151228176 || curDocument.id == 2152925656 || curDocument.id == 2154895013 || curDocument.id == 2151228176;
         auto freq = docFreqs[docsIndex];
         auto outPtr = out;
+        // see Google::Decoder::materialize_hits()
+        const auto maxPos = dws->max_position();
 
         if constexpr (trace)
                 SLog(ansifmt::bold, ansifmt::color_blue, "materializing, skippedHits = ", skippedHits, ", hitsLeft = ", hitsLeft, ansifmt::reset, "\n");
@@ -1352,7 +1373,7 @@ void Trinity::Codecs::Lucene::Decoder::materialize_hits(const exec_term_id_t ter
                         if constexpr (trace)
                                 SLog(" POS = ", pos, ", length = ", pl, "\n");
 
-                        if (pos)
+                        if (pos && pos <= maxPos)
                                 dws->set(termID, pos);
 
                         if (pl)
@@ -1390,7 +1411,7 @@ void Trinity::Codecs::Lucene::Decoder::materialize_hits(const exec_term_id_t ter
                                 outPtr->pos = pos;
                                 outPtr->payloadLen = pl;
 
-                                if (pos)
+                                if (pos && pos <= maxPos)
                                         dws->set(termID, pos);
 
                                 if constexpr (trace)
@@ -1425,9 +1446,8 @@ void Trinity::Codecs::Lucene::Decoder::materialize_hits(const exec_term_id_t ter
 void Trinity::Codecs::Lucene::Decoder::init(const term_index_ctx &tctx, Trinity::Codecs::AccessProxy *access)
 {
         auto ap = static_cast<Trinity::Codecs::Lucene::AccessProxy *>(access);
-        const auto indexPtr = ap->indexPtr;
-        const auto ptr = indexPtr + tctx.indexChunk.offset;
         const auto chunkSize = tctx.indexChunk.size();
+        const auto ptr = ap->index_data(tctx.indexChunk.offset, chunkSize, useBlockCache ? &chunkPin : nullptr);
 
         postingListBase = ptr;
         p = ptr;
@@ -1446,7 +1466,8 @@ void Trinity::Codecs::Lucene::Decoder::init(const term_index_ctx &tctx, Trinity:
         p += sizeof(uint32_t);
         totalHits = hitsLeft = *(uint32_t *)p;
         p += sizeof(uint32_t);
-        p += sizeof(uint32_t); // positions chunk size
+        const auto positionsChunkSize = *(uint32_t *)p;
+        p += sizeof(uint32_t);
         [[maybe_unused]] const auto skiplistSize = *(uint16_t *)p;
         p += sizeof(uint16_t);
 
@@ -1474,7 +1495,7 @@ void Trinity::Codecs::Lucene::Decoder::init(const term_index_ctx &tctx, Trinity:
         }
 
         skipListIdx = 0;
-        hitsBase = hdp = ap->hitsDataPtr + hitsDataOffset;
+        hitsBase = hdp = ap->hits_data(hitsDataOffset, positionsChunkSize, useBlockCache ? &hitsPin : nullptr);
 
         if constexpr (trace)
                 SLog("skiplist.size = ", skiplist.size(), ", docsLeft = ", docsLeft, ", hitsLeft = ", hitsLeft, "\n");
@@ -1498,8 +1519,42 @@ Trinity::Codecs::Lucene::AccessProxy::AccessProxy(const char *bp, const uint8_t
 
                         close(fd);
                         expect(hitsDataPtr != MAP_FAILED);
+                        hitsDataSize = fileSize;
                 }
                 else
                         close(fd);
         }
 }
+
+void Trinity::Codecs::Lucene::AccessProxy::term_data_regions(const term_index_ctx &tctx, std::vector<range_base<const uint8_t *, size_t>> *const out)
+{
+        const auto *p = indexPtr + tctx.indexChunk.offset;
+
+        out->push_back({p, tctx.indexChunk.size()});
+
+        if (hitsDataPtr && tctx.indexChunk.size())
+        {
+                // see Decoder::init()
+                const auto hitsDataOffset = *(uint32_t *)p;
+                const auto positionsChunkSize = *(uint32_t *)(p + sizeof(uint32_t) * 2);
+
+                if (positionsChunkSize)
+                        out->push_back({hitsDataPtr + hitsDataOffset, positionsChunkSize});
+        }
+}
+
+void Trinity::Codecs::Lucene::AccessProxy::use_block_cache(BlockCache *const cache, const int fd)
+{
+        Trinity::Codecs::AccessProxy::use_block_cache(cache, fd);
+
+        if (hitsDataSize)
+        {
+                // we mapped it ourselves, so we know where it is
+                hitsDataFD = open(Buffer{}.append(basePath, "/hits.data").c_str(), O_RDONLY | O_LARGEFILE);
+
+                if (hitsDataFD == -1)
+                        throw Switch::system_error("Unable to access hits.data");
+
+                hitsDataFileID = cache->register_file();
+        }
+}
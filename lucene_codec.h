@@ -62,7 +62,7 @@ namespace Trinity
                                                 close(positionsOutFd);
                                 }
 
-                                constexpr void set_flush_freq(const uint32_t f)
+                                void set_flush_freq(const uint32_t f) override final
                                 {
                                         flushFreq = f;
                                 }
@@ -81,6 +81,14 @@ namespace Trinity
                                 range32_t append_index_chunk(const Trinity::Codecs::AccessProxy *, const term_index_ctx srcTCTX) override final;
 
                                 void merge(merge_participant *, const uint16_t, Trinity::Codecs::Encoder *) override final;
+
+                                Trinity::Codecs::IndexSession *new_partition() override final
+                                {
+                                        return new IndexSession(basePath);
+                                }
+
+                                // Each chunk begins with the absolute offset of the term's positions chunk in hits.data, so we need to relocate that as well
+                                void append_partition(Trinity::Codecs::IndexSession *partition, term_index_ctx *tctxs, const size_t cnt) override final;
                         };
 
                         class Encoder final
@@ -143,6 +151,9 @@ namespace Trinity
                             : public Trinity::Codecs::AccessProxy
                         {
                                 const uint8_t *hitsDataPtr;
+                                uint32_t hitsDataSize{0}; // only known if we mapped hits.data ourselves
+                                int hitsDataFD{-1};       // see use_block_cache()
+                                uint32_t hitsDataFileID{0};
 
                                 AccessProxy(const char *bp, const uint8_t *p, const uint8_t *hd = nullptr);
 
@@ -151,7 +162,33 @@ namespace Trinity
                                         return "LUCENE"_s8;
                                 }
 
-                                Trinity::Codecs::Decoder *new_decoder(const term_index_ctx &tctx) override final;
+                                void data_regions(std::vector<range_base<const uint8_t *, size_t>> *const out) override final
+                                {
+                                        if (hitsDataSize)
+                                                out->push_back({hitsDataPtr, hitsDataSize});
+                                }
+
+                                void term_data_regions(const term_index_ctx &tctx, std::vector<range_base<const uint8_t *, size_t>> *const out) override final;
+
+                                void use_block_cache(BlockCache *const cache, const int fd) override final;
+
+                                // See Trinity::Codecs::AccessProxy::index_data()
+                                const uint8_t *hits_data(const uint32_t offset, const uint32_t size, BlockCache::pin *const pin)
+                                {
+                                        if (hitsDataFD == -1 || !size || !pin)
+                                                return hitsDataPtr + offset;
+
+                                        blockCache->acquire(hitsDataFileID, hitsDataFD, offset, size, pin);
+                                        return pin->data();
+                                }
+
+                                ~AccessProxy()
+                                {
+                                        if (hitsDataFD != -1)
+                                                close(hitsDataFD);
+                                }
+
+                                Trinity::Codecs::Decoder *new_decoder(const term_index_ctx &tctx, const bool useBlockCache = true) override final;
                         };
 
                         class Decoder final
@@ -191,6 +228,7 @@ namespace Trinity
 //#endif
                                 const uint8_t *postingListBase, *hitsBase;
                                 uint32_t totalDocuments, totalHits;
+                                BlockCache::pin chunkPin, hitsPin; // see AccessProxy::index_data()
 
                               private:
                                 uint32_t skiplist_search(const docid_t) const noexcept;
@@ -54,7 +54,7 @@ namespace Trinity
 
                 // Facilitates execution -- ignored during scoring
                 // This is internal and specific to the execution engine impl.
-                uint16_t allCapacity{0};
+                uint32_t allCapacity{0};
                 uint16_t docSeq;
 
                 void set_freq(const tokenpos_t newFreq)
@@ -136,6 +136,8 @@ namespace Trinity
                         // You should probably never to do that, but if you do, because for example you
                         // are only interested in the first few documents matched regardless of their scores
                         // then you can return Abort to return immediately from the execution to the callee
+                        // If the index was sorted by a static rank(see MergeCandidatesCollection::DocIDsOrder::StaticRank), documents are
+                        // matched in descending rank order, so the first documents matched are also the highest ranked ones.
                         // See RECIPES.md and CONCEPTS.md
                         Abort,
                 };
@@ -0,0 +1,477 @@
+#include "memory_index_source.h"
+#include "docwordspace.h"
+
+using namespace Trinity;
+
+namespace // static/local this module
+{
+        // Iterates the first `limit` documents of a term's postings; see MemoryIndexSource comments
+        //
+        // The postings are made of runs in ascending document ID order, so we track a cursor for each run and
+        // merge them. If a document is found in multiple runs, the posting in the latest run is the latest version of the
+        // document; the others are skipped. Masked postings are skipped as well.
+        class MemoryPostingsDecoder final
+            : public Trinity::Codecs::Decoder
+        {
+              private:
+                static constexpr uint32_t N{MemoryIndexSource::BLOCK_SIZE};
+
+                struct cursor final
+                {
+                        const MemoryIndexSource::postings_block *block;
+                        uint32_t idx;
+                        uint32_t end;
+
+                        [[gnu::always_inline]] auto &cur() const noexcept
+                        {
+                                return block->entries[idx % N];
+                        }
+
+                        [[gnu::always_inline]] bool done() const noexcept
+                        {
+                                return idx == end;
+                        }
+
+                        // advances to the next posting; returns false if exhausted
+                        inline bool advance() noexcept
+                        {
+                                if (++idx == end)
+                                        return false;
+
+                                if (idx % N == 0)
+                                        block = block->next;
+
+                                return true;
+                        }
+
+                        // advances to the first posting with id >= target
+                        void skip_to(const docid_t target) noexcept
+                        {
+                                while (!done() && cur().id < target)
+                                {
+                                        const auto blockBase = idx - (idx % N);
+
+                                        if (blockBase + N < end && block->entries[N - 1].id < target)
+                                        {
+                                                // not in this block; skip to the next one
+                                                block = block->next;
+                                                idx = blockBase + N;
+                                        }
+                                        else
+                                                advance();
+                                }
+                        }
+                };
+
+                const MemoryIndexSource::term_postings *const tp;
+                std::vector<cursor> cursors;
+                const MemoryIndexSource::posting *curPosting;
+                uint32_t limit;
+
+              private:
+                inline void finalize() noexcept
+                {
+                        curPosting = nullptr;
+                        curDocument.id = MaxDocIDValue;
+                        curDocument.freq = 0;
+                }
+
+                // Selects the lowest document among the cursors, skipping masked postings and older versions of documents
+                void select_current() noexcept
+                {
+                        for (;;)
+                        {
+                                cursor *best{nullptr};
+
+                                for (auto &c : cursors)
+                                {
+                                        // ties go to the latest run
+                                        if (!c.done() && (!best || c.cur().id <= best->cur().id))
+                                                best = &c;
+                                }
+
+                                if (!best)
+                                {
+                                        finalize();
+                                        return;
+                                }
+
+                                const auto &e = best->cur();
+                                const auto id = e.id;
+
+                                for (auto &c : cursors)
+                                {
+                                        if (&c != best && !c.done() && c.cur().id == id)
+                                                c.advance();
+                                }
+
+                                if (!__atomic_load_n(&e.masked, __ATOMIC_RELAXED))
+                                {
+                                        curPosting = &e;
+                                        curDocument.id = id;
+                                        curDocument.freq = e.freq;
+                                        best->advance();
+                                        return;
+                                }
+
+                                best->advance();
+                        }
+                }
+
+              public:
+                MemoryPostingsDecoder(const MemoryIndexSource::term_postings *const t)
+                    : tp{t}
+                {
+                }
+
+                docid_t begin() override final
+                {
+                        cursors.clear();
+
+                        for (auto run = tp->runs; run && run->start < limit;)
+                        {
+                                const auto next = run->next.load(std::memory_order_acquire);
+                                const auto end = next ? std::min(next->start, limit) : limit;
+
+                                cursors.push_back({run->block, run->start, end});
+                                run = next;
+                        }
+
+                        select_current();
+                        return curDocument.id;
+                }
+
+                bool next() override final
+                {
+                        if (!curPosting)
+                                return false;
+
+                        select_current();
+                        return curPosting;
+                }
+
+                bool seek(const docid_t target) override final
+                {
+                        if (!curPosting)
+                                return false;
+                        else if (curDocument.id >= target)
+                                return curDocument.id == target;
+
+                        for (auto &c : cursors)
+                                c.skip_to(target);
+
+                        select_current();
+                        return curDocument.id == target;
+                }
+
+                void materialize_hits(const exec_term_id_t termID, DocWordsSpace *dwspace, term_hit *out) override final
+                {
+                        const auto freq = curPosting->freq;
+                        const auto hits = curPosting->hits;
+                        const auto maxPos = dwspace->max_position();
+
+                        for (uint32_t i{0}; i != freq; ++i)
+                        {
+                                const auto &it = hits[i];
+
+                                // see Google::Decoder::materialize_hits() for why we don't set position 0
+                                // Documents indexed after the query started may exceed the positions space; see MemoryIndexSource::max_indexed_position()
+                                if (it.pos && it.pos <= maxPos)
+                                        dwspace->set(termID, it.pos);
+
+                                out[i] = it;
+                        }
+                }
+
+                void init(const term_index_ctx &tctx, Trinity::Codecs::AccessProxy *) override final
+                {
+                        limit = tctx.documents;
+                        begin();
+                }
+        };
+}
+
+MemoryIndexSource::term_postings *MemoryIndexSource::postings_for(const uint32_t termID)
+{
+        if (termID < termsPostings.size())
+        {
+                if (auto tp = termsPostings[termID])
+                        return tp;
+        }
+        else
+                termsPostings.resize(termID + 1, nullptr);
+
+        auto tp = allocator.construct<term_postings>();
+        auto b = allocator.New<postings_block>();
+        auto run = allocator.construct<postings_run>();
+
+        b->next = nullptr;
+        run->start = 0;
+        run->block = b;
+        run->next.store(nullptr, std::memory_order_relaxed);
+        tp->first = tp->last = b;
+        tp->runs = tp->lastRun = run;
+        tp->lastDocID = 0;
+        tp->documents.store(0, std::memory_order_relaxed);
+        termsPostings[termID] = tp;
+
+        {
+                // SegmentIndexSession owns the term's storage
+                std::unique_lock<std::shared_mutex> g(dictionaryLock);
+
+                dictionary.insert({sess.term(termID), tp});
+        }
+
+        return tp;
+}
+
+MemoryIndexSource::posting *MemoryIndexSource::append_posting(term_postings *const tp, const docid_t did, const tokenpos_t freq, const term_hit *const hits)
+{
+        const auto n = tp->documents.load(std::memory_order_relaxed);
+        const auto i = n % BLOCK_SIZE;
+        auto b = tp->last;
+
+        if (n && i == 0)
+        {
+                auto nb = allocator.New<postings_block>();
+
+                nb->next = nullptr;
+                b->next = nb;
+                tp->last = b = nb;
+        }
+
+        if (n && did <= tp->lastDocID)
+        {
+                // out of order; begin a new run
+                auto run = allocator.construct<postings_run>();
+
+                run->start = n;
+                run->block = b;
+                run->next.store(nullptr, std::memory_order_relaxed);
+                tp->lastRun->next.store(run, std::memory_order_release);
+                tp->lastRun = run;
+        }
+
+        auto p = b->entries + i;
+
+        *p = {did, freq, hits, false};
+        tp->lastDocID = did;
+
+        // publish; readers that resolve the term from now on will access it
+        tp->documents.store(n + 1, std::memory_order_release);
+        return p;
+}
+
+void MemoryIndexSource::mask_document(const indexed_document &doc)
+{
+        for (uint32_t i{0}; i != doc.termsCnt; ++i)
+                __atomic_store_n(&doc.terms[i].second->masked, true, __ATOMIC_RELAXED);
+
+        if (doc.termsCnt)
+                indexedDocuments.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void MemoryIndexSource::index_document(const document_proxy &proxy, const bool isUpdate)
+{
+        const auto did = proxy.did;
+        auto &hits = proxy.hits;
+
+        if (unlikely(flushed))
+                throw Switch::data_error("Unable to index document ", did, ": source already flushed");
+
+        std::sort(hits.begin(), hits.end(), [](const auto &a, const auto &b) {
+                return a.first < b.first || (a.first == b.first && a.second.first < b.second.first);
+        });
+
+        const auto payloads = reinterpret_cast<const uint8_t *>(proxy.hitsBuf.data());
+        std::vector<std::pair<uint32_t, posting *>> terms;
+        tokenpos_t maxPos{0};
+
+        for (const auto *p = hits.data(), *const e = p + hits.size(); p != e;)
+        {
+                const auto termID = p->first;
+                const auto base = p;
+
+                while (++p != e && p->first == termID)
+                        continue;
+
+                const uint32_t freq = p - base;
+                auto out = allocator.Alloc<term_hit>(freq);
+
+                for (uint32_t i{0}; i != freq; ++i)
+                {
+                        const auto &it = base[i].second;
+                        const auto payloadSize = it.second.size();
+                        uint64_t payload{0};
+
+                        if (payloadSize)
+                                memcpy(&payload, payloads + it.second.start(), payloadSize);
+
+                        out[i] = {payload, tokenpos_t(it.first), payloadSize};
+                }
+
+                // hits are sorted by position, so the last is the highest
+                maxPos = std::max<tokenpos_t>(maxPos, out[freq - 1].pos);
+                if (maxPos > maxPosition.load(std::memory_order_relaxed))
+                        maxPosition.store(maxPos, std::memory_order_relaxed);
+
+                terms.push_back({termID, append_posting(postings_for(termID), did, tokenpos_t(freq), out)});
+        }
+
+        indexed_document doc;
+        auto it = documents.find(did);
+
+        doc.termsCnt = terms.size();
+        doc.terms = allocator.CopyOf(terms.data(), terms.size());
+        doc.fieldsMask = proxy.fieldsMask;
+        doc.fieldLengths = allocator.Alloc<uint32_t>(SwitchBitOps::PopCnt(proxy.fieldsMask));
+        doc.isUpdate = isUpdate;
+
+        for (uint32_t mask = proxy.fieldsMask, i{0}; mask; mask &= mask - 1)
+                doc.fieldLengths[i++] = proxy.fieldLengths[SwitchBitOps::TrailingZeros(mask)];
+
+        if (it != documents.end())
+        {
+                // the postings of the new version have been published, so we can mask the older version's postings
+                // queries that resolved a term before it was published will match neither version; see MemoryIndexSource
+                mask_document(it->second);
+                doc.isUpdate |= it->second.isUpdate;
+                it->second = doc;
+        }
+        else
+        {
+                // an erased document that's indexed again must still mask the document in other sources
+                doc.isUpdate |= erasedDocuments.erase(did);
+                documents.insert({did, doc});
+        }
+
+        if (doc.isUpdate)
+        {
+                std::lock_guard<std::mutex> g(maskedDocumentsLock);
+
+                updatedDocumentIDs.push_back(did);
+                maskedDocumentsDirty = true;
+        }
+
+        if (doc.termsCnt)
+                indexedDocuments.fetch_add(1, std::memory_order_relaxed);
+}
+
+void MemoryIndexSource::erase(const docid_t documentID)
+{
+        if (unlikely(flushed))
+                throw Switch::data_error("Unable to erase document ", documentID, ": source already flushed");
+
+        if (const auto it = documents.find(documentID); it != documents.end())
+        {
+                mask_document(it->second);
+                documents.erase(it);
+        }
+
+        erasedDocuments.insert(documentID);
+
+        std::lock_guard<std::mutex> g(maskedDocumentsLock);
+
+        updatedDocumentIDs.push_back(documentID);
+        maskedDocumentsDirty = true;
+}
+
+void MemoryIndexSource::flush(Trinity::Codecs::IndexSession *const s)
+{
+        if (unlikely(flushed))
+                throw Switch::data_error("Source already flushed");
+
+        std::vector<docid_t> ids;
+
+        flushed = true;
+        ids.reserve(documents.size());
+        for (const auto &it : documents)
+                ids.push_back(it.first);
+        std::sort(ids.begin(), ids.end());
+
+        // replay the latest version of each document
+        for (const auto did : ids)
+        {
+                const auto &doc = documents[did];
+                auto proxy = sess.begin(did);
+
+                for (uint32_t i{0}; i != doc.termsCnt; ++i)
+                {
+                        const auto termID = doc.terms[i].first;
+                        const auto p = doc.terms[i].second;
+
+                        for (uint32_t k{0}; k != p->freq; ++k)
+                        {
+                                const auto &it = p->hits[k];
+
+                                proxy.insert(termID, it.pos, {it.bytes(), it.payloadLen});
+                        }
+                }
+
+                proxy.fieldsMask = doc.fieldsMask;
+                for (uint32_t mask = doc.fieldsMask, i{0}; mask; mask &= mask - 1)
+                        proxy.fieldLengths[SwitchBitOps::TrailingZeros(mask)] = doc.fieldLengths[i++];
+
+                if (doc.isUpdate)
+                        sess.update(proxy);
+                else
+                        sess.insert(proxy);
+        }
+
+        for (const auto did : erasedDocuments)
+                sess.erase(did);
+
+        sess.commit(s);
+}
+
+term_index_ctx MemoryIndexSource::resolve_term_ctx(const str8_t term)
+{
+        std::shared_lock<std::shared_mutex> g(dictionaryLock);
+        const auto it = dictionary.find(term);
+
+        if (it == dictionary.end())
+                return {};
+
+        // documents published so far; the decoder will not consider any documents published after that
+        const auto n = it->second->documents.load(std::memory_order_acquire);
+
+        return {n, {0, n}};
+}
+
+Trinity::Codecs::Decoder *MemoryIndexSource::new_postings_decoder(const str8_t term, const term_index_ctx ctx)
+{
+        const term_postings *tp;
+
+        {
+                std::shared_lock<std::shared_mutex> g(dictionaryLock);
+                const auto it = dictionary.find(term);
+
+                if (it == dictionary.end())
+                        return nullptr;
+
+                tp = it->second;
+        }
+
+        auto dec = new MemoryPostingsDecoder(tp);
+
+        dec->init(ctx, nullptr);
+        return dec;
+}
+
+std::pair<updated_documents, std::shared_ptr<const void>> MemoryIndexSource::masked_documents_snapshot()
+{
+        std::lock_guard<std::mutex> g(maskedDocumentsLock);
+
+        if (maskedDocumentsDirty)
+        {
+                auto b = std::make_shared<IOBuffer>();
+
+                pack_updates(updatedDocumentIDs, b.get());
+                maskedDocuments = unpack_updates({reinterpret_cast<const uint8_t *>(b->data()), uint32_t(b->size())});
+                // the previous buffer is released once no one else holds it
+                maskedDocumentsBuf = std::move(b);
+                maskedDocumentsDirty = false;
+        }
+
+        return {maskedDocuments, maskedDocumentsBuf};
+}
@@ -0,0 +1,190 @@
+#pragma once
+#include "index_source.h"
+#include "indexer.h"
+#include <atomic>
+#include <shared_mutex>
+#include <unordered_set>
+
+namespace Trinity
+{
+        // A RAM-resident index source, with append-only in-memory posting lists
+        // You index documents with the same document_proxy API you use with SegmentIndexSession, and they can be
+        // queried immediately; no need to commit() a segment and then load it via SegmentIndexSource.
+        //
+        // It is designed for a single writer(the thread that indexes documents) and multiple readers(queries) accessing it concurrently.
+        // Readers never block on the writer while iterating postings. When a term is resolved, the number of documents indexed for that term
+        // is captured in its term_index_ctx, and the decoder will only consider those documents, so that each query operates on a consistent
+        // prefix of each posting list, no matter how many documents are appended in the meantime.
+        //
+        // Posting lists are append-only. Each is made of runs of postings in ascending document ID order; when a document is indexed out of order,
+        // a new run is started for the terms it contains, and the decoder merges the runs. Indexing in ascending document ID order is still the fastest
+        // path, because then each posting list is a single run.
+        //
+        // You can index(insert() or update()) a document that's already indexed in this source; the postings of the older version are masked
+        // so that queries only match the latest version. Likewise, erase() masks the document's postings.
+        // The postings of the older version are masked after those of the new version are published. A query that resolved a term before that
+        // won't consider the new version's posting, and may observe the older one masked, so it will match neither version of the document
+        // for that term; queries that resolve the term afterwards will match the new version.
+        //
+        // The latest version of each document is tracked, so that you can flush() them into a segment using any codec, via an
+        // internal SegmentIndexSession. Once you have loaded that segment you can replace this source with it, in your IndexSourcesCollection.
+        class MemoryIndexSource final
+            : public IndexSource
+        {
+              public:
+                struct posting final
+                {
+                        docid_t id;
+                        tokenpos_t freq;
+                        const term_hit *hits;
+                        // set(atomically) once the document is re-indexed or erased
+                        bool masked;
+                };
+
+                static constexpr uint32_t BLOCK_SIZE{128};
+
+                struct postings_block final
+                {
+                        posting entries[BLOCK_SIZE];
+                        postings_block *next;
+                };
+
+                // A run of postings in ascending document ID order, that begins at index `start` of the postings list, in `block`
+                struct postings_run final
+                {
+                        uint32_t start;
+                        const postings_block *block;
+                        std::atomic<postings_run *> next;
+                };
+
+                struct term_postings final
+                {
+                        postings_block *first;
+                        postings_block *last;
+                        postings_run *runs;
+                        // Only accessed by the writer
+                        postings_run *lastRun;
+                        docid_t lastDocID;
+                        // Number of documents published to readers
+                        std::atomic<uint32_t> documents;
+                };
+
+              private:
+                SegmentIndexSession sess;
+                // Only accessed by the writer; indexed by SegmentIndexSession term IDs
+                std::vector<term_postings *> termsPostings;
+
+                // The latest version of an indexed document; only accessed by the writer
+                struct indexed_document final
+                {
+                        std::pair<uint32_t, posting *> *terms;
+                        uint32_t termsCnt;
+                        // SegmentIndexSession::document_proxy::fieldsMask and fieldLengths[] of each field in the mask
+                        uint32_t fieldsMask;
+                        uint32_t *fieldLengths;
+                        // will be flush()ed with SegmentIndexSession::update()
+                        bool isUpdate;
+                };
+
+                std::unordered_map<docid_t, indexed_document> documents;
+                std::unordered_set<docid_t> erasedDocuments;
+                // Guards dictionary; readers only need a shared lock to resolve a term
+                mutable std::shared_mutex dictionaryLock;
+                std::unordered_map<str8_t, term_postings *> dictionary;
+                // Stable memory for blocks and materialized hits; only accessed by the writer
+                simple_allocator allocator{4 * 1024 * 1024};
+                std::atomic<uint64_t> indexedDocuments{0};
+                std::atomic<tokenpos_t> maxPosition{0};
+                bool flushed{false};
+
+                // masked documents; see masked_documents()
+                std::mutex maskedDocumentsLock;
+                std::vector<docid_t> updatedDocumentIDs;
+                bool maskedDocumentsDirty{false};
+                updated_documents maskedDocuments{};
+                // maskedDocuments are packed in it; superseded buffers are released once no IndexSourcesCollection or IndexSourcesSnapshot
+                // uses them(see masked_documents_snapshot())
+                std::shared_ptr<const IOBuffer> maskedDocumentsBuf;
+
+              private:
+                void index_document(const SegmentIndexSession::document_proxy &proxy, const bool isUpdate);
+
+                term_postings *postings_for(const uint32_t termID);
+
+                posting *append_posting(term_postings *const tp, const docid_t did, const tokenpos_t freq, const term_hit *const hits);
+
+                void mask_document(const indexed_document &doc);
+
+              public:
+                using document_proxy = SegmentIndexSession::document_proxy;
+
+                MemoryIndexSource()
+                {
+                        gen = Timings::Microseconds::SysTime();
+                }
+
+                // See SegmentIndexSession::begin()
+                document_proxy begin(const docid_t documentID)
+                {
+                        return sess.begin(documentID);
+                }
+
+                // See SegmentIndexSession::insert()
+                void insert(const document_proxy &proxy)
+                {
+                        index_document(proxy, false);
+                }
+
+                // See SegmentIndexSession::update()
+                void update(const document_proxy &proxy)
+                {
+                        index_document(proxy, true);
+                }
+
+                // See SegmentIndexSession::erase()
+                void erase(const docid_t documentID);
+
+                // Persists the latest version of all indexed documents as a segment in s->basePath; see SegmentIndexSession::commit()
+                // You should probably use the generation() of this source as the segment name.
+                //
+                // The source can still be queried after it has been flushed, but you can't index any more documents into it.
+                void flush(Trinity::Codecs::IndexSession *const s);
+
+                // We must not cache terms because documents are indexed all the time
+                term_index_ctx term_ctx(const str8_t term) override final
+                {
+                        return resolve_term_ctx(term);
+                }
+
+                term_index_ctx resolve_term_ctx(const str8_t term) override final;
+
+                Trinity::Codecs::Decoder *new_postings_decoder(const str8_t term, const term_index_ctx ctx) override final;
+
+                // The returned updated_documents are only valid until the next call, if documents were masked since;
+                // use masked_documents_snapshot() if you need to hold on to them(IndexSourcesCollection does)
+                updated_documents masked_documents() override final
+                {
+                        return masked_documents_snapshot().first;
+                }
+
+                std::pair<updated_documents, std::shared_ptr<const void>> masked_documents_snapshot() override final;
+
+                // The highest position indexed so far
+                // Documents indexed after a query has started may have higher positions; the decoder ignores those for
+                // phrase matching(see DocWordsSpace::max_position())
+                tokenpos_t max_indexed_position() const override final
+                {
+                        return std::max<tokenpos_t>(maxPosition.load(std::memory_order_relaxed), 1);
+                }
+
+                bool index_empty() const noexcept override final
+                {
+                        return indexedDocuments.load(std::memory_order_relaxed) == 0;
+                }
+
+                uint64_t total_documents() const noexcept override final
+                {
+                        return indexedDocuments.load(std::memory_order_relaxed);
+                }
+        };
+}
@@ -1,7 +1,35 @@
 #include "merge.h"
 #include "docwordspace.h"
+#include "utils.h"
 #include <set>
+#include <switch_bitops.h>
 #include <text.h>
+#include <thread>
+
+void Trinity::MergeIOThrottle::consume(const size_t bytes)
+{
+        uint64_t wait{0};
+
+        {
+                std::lock_guard<std::mutex> g(lock);
+
+                if (!bytesPerSecond)
+                        return;
+
+                const auto now = Timings::Microseconds::Tick();
+
+                // allow for upto a second of burst
+                budget = std::min<double>(budget + double(now - lastRefill) * bytesPerSecond / 1e6, bytesPerSecond);
+                lastRefill = now;
+                budget -= bytes;
+
+                if (budget < 0)
+                        wait = uint64_t(-budget * 1e6 / bytesPerSecond);
+        }
+
+        if (wait)
+                std::this_thread::sleep_for(std::chrono::microseconds(wait));
+}
 
 void Trinity::MergeCandidatesCollection::commit()
 {
@@ -25,31 +53,185 @@ void Trinity::MergeCandidatesCollection::commit()
 std::unique_ptr<Trinity::masked_documents_registry> Trinity::MergeCandidatesCollection::scanner_registry_for(const uint16_t idx)
 {
         const auto n = map[idx].second;
+        auto r = masked_documents_registry::make(all.data(), n);
 
-        return masked_documents_registry::make(all.data(), n);
+        r->randomAccess = !map[idx].first.globalDocIDsAscending;
+        return r;
 }
 
+void Trinity::MergeCandidatesCollection::persist(const char *basePath) const
+{
+        if (Utilities::to_file(reinterpret_cast<const char *>(&documents), sizeof(documents), Buffer{}.append(basePath, "/documents").c_str()) == -1)
+                throw Switch::system_error("Failed to persist documents count");
+
+        if (docIDsOrder != DocIDsOrder::Preserve && globalDocIDs.size() && Utilities::to_file(reinterpret_cast<const char *>(globalDocIDs.data()), globalDocIDs.size() * sizeof(docid_t), Buffer{}.append(basePath, "/globalids").c_str()) == -1)
+                throw Switch::system_error("Failed to persist global document IDs");
+
+        if (maxPosition && Utilities::to_file(reinterpret_cast<const char *>(&maxPosition), sizeof(maxPosition), Buffer{}.append(basePath, "/max_position").c_str()) == -1)
+                throw Switch::system_error("Failed to persist max position");
+}
 
 // Make sure you have commited first
 // Unlike with e.g SegmentIndexSession where the order of postlists in the index is based on our translation(term=>integer id) and the ascending order of that id
 // here the order will match the order the terms are found in `tersm`, because we perform a merge-sort and so we process terms in lexicograpphic order
-void Trinity::MergeCandidatesCollection::merge(Trinity::Codecs::IndexSession *is, simple_allocator *allocator, std::vector<std::pair<str8_t, Trinity::term_index_ctx>> *const terms, const uint32_t flushFreq)
+uint64_t Trinity::MergeCandidatesCollection::merge(Trinity::Codecs::IndexSession *is, simple_allocator *allocator, std::vector<std::pair<str8_t, Trinity::term_index_ctx>> *const terms, const uint32_t flushFreq)
+{
+        merge_impl(is, allocator, terms, -1, nullptr, flushFreq);
+        return documents;
+}
+
+uint64_t Trinity::MergeCandidatesCollection::merge(Trinity::Codecs::IndexSession *is, const int indexFd, TermsWriter *termsWriter, const uint32_t flushFreq)
+{
+        simple_allocator allocator;
+        std::vector<std::pair<str8_t, Trinity::term_index_ctx>> terms;
+
+        if (flushFreq)
+                is->set_flush_freq(flushFreq);
+
+        merge_impl(is, &allocator, &terms, indexFd, termsWriter, flushFreq);
+        return documents;
+}
+
+void Trinity::MergeCandidatesCollection::merge_impl(Trinity::Codecs::IndexSession *is, simple_allocator *allocator, std::vector<std::pair<str8_t, Trinity::term_index_ctx>> *const terms,
+                                                    const int indexFd, TermsWriter *const termsWriter, const uint32_t flushFreq)
 {
         static constexpr bool trace{false};
 
-        struct tracked_candidate
+        // A candidate that provides a term, and the term's term_index_ctx in the candidate
+        struct term_participant final
+        {
+                uint16_t idx; // in candidates
+                term_index_ctx tctx;
+        };
+
+        struct merge_decoder final
+        {
+                Trinity::Codecs::Decoder *dec;
+                masked_documents_registry *maskedDocsReg;
+                const docid_t *globalDocIDs;
+
+                inline docid_t cur_document() const noexcept
+                {
+                        return translate_docid(globalDocIDs, dec->curDocument.id);
+                }
+        };
+
+        // A document of a term's participant, collected when the term's postings need to be sorted by document ID; see merge_term()
+        struct sorted_document final
+        {
+                docid_t id;      // in the merged index
+                uint16_t order;  // participant's index; documents of more recent participants take precedence
+                uint32_t freq;
+                size_t hitsOffset; // in merge_scratch::sortedHits
+        };
+
+        // Maps global IDs of live documents to the local IDs assigned to them, unless docIDsOrder is Preserve
+        struct docids_remap final
+        {
+                std::vector<uint64_t> live;   // one bit per global ID
+                std::vector<uint32_t> before; // live documents in live[0, i)
+                std::vector<docid_t> local;   // indexed by dense_index(); empty for DocIDsOrder::Dense
+
+                void set(const docid_t id)
+                {
+                        const auto i = id / 64;
+
+                        if (i >= live.size())
+                                live.resize(i + 1, 0);
+                        live[i] |= uint64_t(1) << (id & 63);
+                }
+
+                void commit()
+                {
+                        uint32_t n{0};
+
+                        before.reserve(live.size());
+                        for (const auto v : live)
+                        {
+                                before.push_back(n);
+                                n += SwitchBitOps::PopCnt(v);
+                        }
+                }
+
+                // index of a live document in ascending global IDs order
+                inline uint32_t dense_index(const docid_t id) const noexcept
+                {
+                        const auto i = id / 64;
+
+                        return before[i] + SwitchBitOps::PopCnt(live[i] & ((uint64_t(1) << (id & 63)) - 1));
+                }
+
+                inline docid_t map(const docid_t id) const noexcept
+                {
+                        const auto i = dense_index(id);
+
+                        return local.empty() ? i + 1 : local[i];
+                }
+        };
+
+        // State used for merging terms; each merge thread has its own
+        struct merge_scratch final
+        {
+                // dummy, for materialize_hits(); it is sparse for Limits::MaxPosition(see DocWordsSpace), so we reset() it
+                // before each materialize_hits() call so that it only ever holds the hits of one (term, document)
+                DocWordsSpace dws{Limits::MaxPosition};
+                size_t termHitsCapacity{0};
+                term_hit *termHitsStorage{nullptr};
+                std::vector<Trinity::Codecs::IndexSession::merge_participant> mergeParticipants;
+                std::vector<merge_decoder> decodersV;
+                // (current document, index in decodersV) of each decoder of decodersV, a min-heap; see merge_term()
+                std::vector<std::pair<docid_t, uint16_t>> decodersHeap;
+                std::vector<uint16_t> toAdvance;
+                std::vector<sorted_document> sortedDocs;
+                std::vector<term_hit> sortedHits;
+
+                term_hit *hits_storage(const uint32_t freq)
+                {
+                        if (freq > termHitsCapacity)
+                        {
+                                if (termHitsStorage)
+                                        std::free(termHitsStorage);
+
+                                termHitsCapacity = freq + 128;
+                                termHitsStorage = (term_hit *)malloc(sizeof(term_hit) * termHitsCapacity);
+                        }
+
+                        return termHitsStorage;
+                }
+
+                ~merge_scratch()
+                {
+                        if (termHitsStorage)
+                                std::free(termHitsStorage);
+                }
+        };
+
+        // A candidate's terms view, and its current term; the term is decoded once, when the view is advanced
+        struct merge_cursor final
         {
-                uint16_t idx;
-                merge_candidate candidate;
+                IndexSourceTermsView *terms;
+                uint16_t idx; // in candidates
+                bool done;
+                str8_t term;
+                term_index_ctx tctx;
+
+                void fetch()
+                {
+                        if (!(done = terms->done()))
+                                std::tie(term, tctx) = terms->cur();
+                }
         };
 
-        std::vector<tracked_candidate> all_;
+        std::vector<merge_cursor> cursors;
 
         if (trace)
                 SLog("Merging ", candidates.size(), " candidates\n");
 
         require(candidates.size() < std::numeric_limits<uint16_t>::max());
 
+        maxPosition = 0;
+        documents = 0;
+        globalDocIDs.clear();
         for (uint16_t i{0}; i != candidates.size(); ++i)
         {
                 if (trace)
@@ -58,98 +240,161 @@ void Trinity::MergeCandidatesCollection::merge(Trinity::Codecs::IndexSession *is
                 if (i)
                         require(candidates[i].gen < candidates[i - 1].gen);
 
+                if (candidates[i].ap)
+                        maxPosition = std::max(maxPosition, candidates[i].maxIndexedPosition);
+
+                // otherwise, the live documents are counted once they are collected
+                if (docIDsOrder == DocIDsOrder::Preserve)
+                        documents += candidates[i].documents;
+
                 if (candidates[i].terms && false == candidates[i].terms->done() && candidates[i].ap)
 		{
 			// ap may be nullptr if we only wanted to e.g mask documents
-                        all_.push_back({i, candidates[i]});
+                        cursors.push_back({candidates[i].terms, i, false, {}, {}});
+                        cursors.back().fetch();
 		}
         }
 
-        if (all_.empty())
+        if (cursors.empty())
                 return;
 
-        auto all = all_.data();
-        uint16_t rem = all_.size();
-        uint16_t toAdvance[rem];
         const auto isCODEC = is->codec_identifier();
-        DocWordsSpace dws{Limits::MaxPosition}; // dummy, for materialize_hits()
-        size_t termHitsCapacity{0};
-        term_hit *termHitsStorage{nullptr};
-        std::vector<Trinity::Codecs::IndexSession::merge_participant> mergeParticipants;
-        std::vector<std::pair<Trinity::Codecs::Decoder *, masked_documents_registry *>> decodersV;
-        term_index_ctx tctx;
-        std::unique_ptr<Trinity::Codecs::Encoder> enc(is->new_encoder());
-
-        Defer(
-            {
-                    if (termHitsStorage)
-                            std::free(termHitsStorage);
-            });
+        const bool remapping = docIDsOrder != DocIDsOrder::Preserve;
+        docids_remap remap;
 
-        for (;;)
-        {
-                uint8_t toAdvanceCnt{1};
-                const auto pair = all[0].candidate.terms->cur();
-                auto selected{pair};
-                auto codec = all[0].candidate.ap->codec_identifier();
+        if (remapping && docIDsOrder == DocIDsOrder::StaticRank && !staticRank)
+                throw Switch::data_error("staticRank is required for DocIDsOrder::StaticRank");
+
+        // Merges the postings of `outTerm` of the `cnt` participants(in candidates order) into `is` via `enc`
+        const auto merge_term = [this, isCODEC, remapping, &remap](Trinity::Codecs::IndexSession *const is, Trinity::Codecs::Encoder *const enc, merge_scratch &scratch,
+                                                const str8_t outTerm, const term_participant *const participants, const uint16_t cnt,
+                                                std::vector<std::pair<str8_t, Trinity::term_index_ctx>> *const terms) {
+                const auto codec = candidates[participants[0].idx].ap->codec_identifier();
                 bool sameCODEC{true};
+                bool localIDs{false};
+                bool unordered{false};
+                term_index_ctx tctx;
 
-                toAdvance[0] = 0;
-                for (uint16_t i{1}; i != rem; ++i)
+                for (uint16_t i{0}; i != cnt; ++i)
                 {
-                        const auto pair = all[i].candidate.terms->cur();
-                        const auto r = terms_cmp(pair.first.data(), pair.first.size(), selected.first.data(), selected.first.size());
+                        const auto &c = candidates[participants[i].idx];
 
-                        if (r < 0)
+                        if (c.globalDocIDs)
                         {
-                                toAdvanceCnt = 1;
-                                toAdvance[0] = i;
-                                selected = pair;
-                                sameCODEC = true;
-                                codec = all[i].candidate.ap->codec_identifier();
+                                // we can't just copy or merge their chunks; we need to translate their document IDs
+                                localIDs = true;
                         }
-                        else if (r == 0)
-                        {
-                                if (sameCODEC)
-                                {
-                                        auto c = all[i].candidate.ap->codec_identifier();
 
-                                        if (c != codec)
-                                                sameCODEC = false;
-                                }
+                        if (!c.globalDocIDsAscending)
+                                unordered = true;
 
-                                toAdvance[toAdvanceCnt++] = i;
-                        }
+                        if (i && sameCODEC && c.ap->codec_identifier() != codec)
+                                sameCODEC = false;
                 }
 
-                const str8_t outTerm(allocator->CopyOf(selected.first.data(), selected.first.size()), selected.first.size());
-              	[[maybe_unused]] const bool fastPath = sameCODEC && codec == isCODEC;
+              	[[maybe_unused]] const bool fastPath = sameCODEC && codec == isCODEC && !localIDs;
                 static constexpr bool trace{false};
-                //const bool trace = selected.first.Eq(_S("ANNEX"));
+                //const bool trace = outTerm.Eq(_S("ANNEX"));
 
                 if (trace)
-                        SLog("TERM [", selected.first, "], toAdvanceCnt = ", toAdvanceCnt, ", sameCODEC = ", sameCODEC, ", first = ", toAdvance[0], ", fastPath = ", fastPath, "\n");
+                        SLog("TERM [", outTerm, "], cnt = ", cnt, ", sameCODEC = ", sameCODEC, ", first = ", participants[0].idx, ", fastPath = ", fastPath, "\n");
+
+                if (remapping || unordered)
+                {
+                        // The documents of the participants are not in the merged index's document IDs order, so we can't merge-sort them.
+                        // We collect the live documents of all participants and their hits, and sort them instead.
+                        // If multiple participants provide the same document, the most recent participant's(lowest order) is selected
+                        auto &docs = scratch.sortedDocs;
+                        auto &hits = scratch.sortedHits;
+
+                        docs.clear();
+                        hits.clear();
+
+                        for (uint16_t i{0}; i != cnt; ++i)
+                        {
+                                const auto &p = participants[i];
+
+                                if (unlikely(0 == p.tctx.documents))
+                                        continue;
+
+                                const auto &c = candidates[p.idx];
+                                auto maskedDocsReg = scanner_registry_for(p.idx);
+                                std::unique_ptr<Trinity::Codecs::Decoder> dec(c.ap->new_decoder(p.tctx, false));
+
+                                for (auto id = dec->begin(); id != MaxDocIDValue; id = dec->curDocument.id)
+                                {
+                                        const auto docID = translate_docid(c.globalDocIDs, id);
+
+                                        // if a document is masked for a participant, it is also masked for all older participants
+                                        if (!maskedDocsReg->test(docID))
+                                        {
+                                                const auto freq = dec->curDocument.freq;
+                                                const auto offset = hits.size();
+
+                                                hits.resize(offset + freq);
+                                                scratch.dws.reset();
+                                                dec->materialize_hits(1 /* dummy */, &scratch.dws /* dummy */, hits.data() + offset);
+                                                docs.push_back({remapping ? remap.map(docID) : docID, i, freq, offset});
+                                        }
+
+                                        if (!dec->next())
+                                                break;
+                                }
+                        }
+
+                        if (docs.empty())
+                                return;
+
+                        std::sort(docs.begin(), docs.end(), [](const auto &a, const auto &b) noexcept {
+                                return a.id < b.id || (a.id == b.id && a.order < b.order);
+                        });
+
+                        enc->begin_term();
+                        for (size_t i{0}; i != docs.size(); ++i)
+                        {
+                                const auto &d = docs[i];
+
+                                if (i && d.id == docs[i - 1].id)
+                                        continue;
 
-                if (toAdvanceCnt == 1)
+                                enc->begin_document(d.id);
+                                for (uint32_t k{0}; k != d.freq; ++k)
+                                {
+                                        const auto &th = hits[d.hitsOffset + k];
+                                        const auto bytes = (uint8_t *)&th.payload;
+
+                                        enc->new_hit(th.pos, {bytes, th.payloadLen});
+                                }
+                                enc->end_document();
+                        }
+                        enc->end_term(&tctx);
+
+                        if (tctx.documents)
+                                terms->push_back({outTerm, tctx});
+                        return;
+                }
+
+                if (cnt == 1)
                 {
-                        auto c = all[toAdvance[0]].candidate;
-                        auto maskedDocsReg = scanner_registry_for(all[toAdvance[0]].idx);
+                        const auto &c = candidates[participants[0].idx];
+                        const auto termCTX = participants[0].tctx;
+                        auto maskedDocsReg = scanner_registry_for(participants[0].idx);
 
                         if (fastPath && maskedDocsReg->empty())
                         {
-                                if (likely(selected.second.documents))
+                                if (likely(termCTX.documents))
                                 {
                                         // See comments below for why this is possible
-                                        const auto chunk = is->append_index_chunk(c.ap, selected.second);
+                                        const auto chunk = is->append_index_chunk(c.ap, termCTX);
 
-                                        terms->push_back({outTerm, {selected.second.documents, chunk}});
+                                        terms->push_back({outTerm, {termCTX.documents, chunk}});
                                 }
                                 else if (trace)
                                         SLog("No documents\n");
                         }
                         else
                         {
-                                if (unlikely(0 == selected.second.documents))
+                                if (unlikely(0 == termCTX.documents))
                                 {
                                         // It's possible, however unlikely (check your implementation)
                                         // that you have e.g indexed a term, but indexed no documents for that term
@@ -160,38 +405,32 @@ void Trinity::MergeCandidatesCollection::merge(Trinity::Codecs::IndexSession *is
 					// Note that SegmentIndexSession and this merge() method explicitly drop terms with no documents associated with them, so
 					// the only real way to get a term with no document is to use the various Trinity segment constructs directly.
                                         if (trace)
-                                                Print("0 documents for TERM [", selected.first, "]\n");
+                                                Print("0 documents for TERM [", outTerm, "]\n");
                                 }
                                 else
                                 {
-                                        std::unique_ptr<Trinity::Codecs::Decoder> dec(c.ap->new_decoder(selected.second));
+                                        std::unique_ptr<Trinity::Codecs::Decoder> dec(c.ap->new_decoder(termCTX, false));
 
                                         dec->begin();
                                         enc->begin_term();
 
                                         do
                                         {
-                                                const auto docID = dec->curDocument.id;
-                                                const auto freq = dec->curDocument.freq;
+                                                require(dec->curDocument.id != MaxDocIDValue); // sanity check
 
-                                                require(docID != MaxDocIDValue); // sanity check
+                                                const auto docID = translate_docid(c.globalDocIDs, dec->curDocument.id);
+                                                const auto freq = dec->curDocument.freq;
 
 						if (trace)
 							SLog("docID = ", docID, ", masked = ", maskedDocsReg->test(docID), "\n");
 
                                                 if (!maskedDocsReg->test(docID))
                                                 {
-                                                        if (freq > termHitsCapacity)
-                                                        {
-                                                                if (termHitsStorage)
-                                                                        std::free(termHitsStorage);
-
-                                                                termHitsCapacity = freq + 128;
-                                                                termHitsStorage = (term_hit *)malloc(sizeof(term_hit) * termHitsCapacity);
-                                                        }
+                                                        auto termHitsStorage = scratch.hits_storage(freq);
 
                                                         enc->begin_document(docID);
-                                                        dec->materialize_hits(1 /* dummy */, &dws /* dummy */, termHitsStorage);
+                                                        scratch.dws.reset();
+                                                        dec->materialize_hits(1 /* dummy */, &scratch.dws /* dummy */, termHitsStorage);
 
                                                         for (uint32_t i{0}; i != freq; ++i)
                                                         {
@@ -222,173 +461,510 @@ void Trinity::MergeCandidatesCollection::merge(Trinity::Codecs::IndexSession *is
                                 }
                         }
                 }
-                else
+                else if (fastPath)
                 {
-                        if (fastPath)
+                        auto &mergeParticipants = scratch.mergeParticipants;
+
+                        mergeParticipants.clear();
+
+                        for (uint16_t i{0}; i != cnt; ++i)
                         {
-                                mergeParticipants.clear();
+                                const auto &p = participants[i];
 
-                                for (uint16_t i{0}; i != toAdvanceCnt; ++i)
+                                if (likely(p.tctx.documents))
                                 {
-                                        const auto idx = toAdvance[i];
-
-                                        if (likely(all[idx].candidate.terms->cur().second.documents))
-                                        {
-                                                // See comments earliert for why this is possible
+                                        // See comments earliert for why this is possible
 
-                                                mergeParticipants.push_back(
-                                                    {all[idx].candidate.ap,
-                                                     all[idx].candidate.terms->cur().second,
-                                                     scanner_registry_for(all[idx].idx).release()});
-                                        }
-                                        else if (trace)
-                                                SLog("No documents for candidate ", i, "\n");
+                                        mergeParticipants.push_back(
+                                            {candidates[p.idx].ap,
+                                             p.tctx,
+                                             scanner_registry_for(p.idx).release()});
                                 }
+                                else if (trace)
+                                        SLog("No documents for candidate ", i, "\n");
+                        }
 
-                                if (mergeParticipants.size())
-                                {
-                                        enc->begin_term();
-                                        is->merge(mergeParticipants.data(), mergeParticipants.size(), enc.get());
-                                        enc->end_term(&tctx);
+                        if (mergeParticipants.size())
+                        {
+                                enc->begin_term();
+                                is->merge(mergeParticipants.data(), mergeParticipants.size(), enc);
+                                enc->end_term(&tctx);
 
-                                        if (tctx.documents)
-                                                terms->push_back({outTerm, tctx});
+                                if (tctx.documents)
+                                        terms->push_back({outTerm, tctx});
 
-                                        for (uint16_t i{0}; i != mergeParticipants.size(); ++i)
-                                                delete mergeParticipants[i].maskedDocsReg;
-                                }
+                                for (uint16_t i{0}; i != mergeParticipants.size(); ++i)
+                                        delete mergeParticipants[i].maskedDocsReg;
                         }
-                        else
+                }
+                else
+                {
+                        auto &decodersV = scratch.decodersV;
+
+                        // we got to merge-sort across different codecs and output to an encoder of a different, potentially, codec
+                        for (uint16_t i{0}; i != cnt; ++i)
                         {
-                                // we got to merge-sort across different codecs and output to an encoder of a different, potentially, codec
-                                for (uint16_t i{0}; i != toAdvanceCnt; ++i)
+                                const auto &p = participants[i];
+
+                                if (likely(p.tctx.documents))
                                 {
-                                        const auto idx = toAdvance[i];
+                                        // see earlier comments for why this is possible
+                                        auto ap = candidates[p.idx].ap;
+                                        auto dec = ap->new_decoder(p.tctx, false);
+                                        auto reg = scanner_registry_for(p.idx).release();
 
-                                        if (likely(all[idx].candidate.terms->cur().second.documents))
-                                        {
-                                                // see earlier comments for why this is possible
-                                                auto ap = all[idx].candidate.ap;
-                                                auto dec = ap->new_decoder(all[idx].candidate.terms->cur().second);
-                                                auto reg = scanner_registry_for(all[idx].idx).release();
-
-                                                require(reg);
-                                                dec->begin();
-                                                decodersV.push_back({dec, reg});
-                                        }
-                                        else if (trace)
-                                                SLog("No documents for candidate ", i, "\n");
+                                        require(reg);
+                                        dec->begin();
+                                        decodersV.push_back({dec, reg, candidates[p.idx].globalDocIDs});
                                 }
+                                else if (trace)
+                                        SLog("No documents for candidate ", i, "\n");
+                        }
 
-                                if (uint16_t rem = decodersV.size())
+                        if (const auto n = decodersV.size())
+                        {
+                                // Decoders are selected with a min-heap keyed on their current document, so that we only need O(log(n)) comparisons for
+                                // each merged document, which matters when merging many segments at once. Ties are broken by the index of the decoder,
+                                // so that the first decoder of a document is the most recent one, because participants are sorted by gen DESC
+                                auto decoders = decodersV.data();
+                                auto &heap = scratch.decodersHeap;
+                                auto &toAdvance = scratch.toAdvance;
+                                const std::greater<std::pair<docid_t, uint16_t>> heapCmp;
+
+                                heap.clear();
+                                for (uint16_t i{0}; i != n; ++i)
+                                        heap.push_back({decoders[i].cur_document(), i});
+                                std::make_heap(heap.begin(), heap.end(), heapCmp);
+
+                                enc->begin_term();
+                                while (heap.size())
                                 {
-                                        auto decoders = decodersV.data();
-                                        uint16_t toAdvance[128];
+                                        const auto lowestDID = heap.front().first;
+
+                                        toAdvance.clear();
+                                        do
+                                        {
+                                                std::pop_heap(heap.begin(), heap.end(), heapCmp);
+                                                toAdvance.push_back(heap.back().second);
+                                                heap.pop_back();
+                                        } while (heap.size() && heap.front().first == lowestDID);
 
-                                        require(sizeof_array(toAdvance) >= decodersV.size());
+					if (trace)
+						SLog("Lowest = ", lowestDID, ", masked = ", decoders[toAdvance[0]].maskedDocsReg->test(lowestDID), "\n");
 
-                                        enc->begin_term();
-                                        for (;;)
+                                        if (!decoders[toAdvance[0]].maskedDocsReg->test(lowestDID))
                                         {
-                                                uint16_t toAdvanceCnt{1};
-                                                auto lowestDID = decoders[0].first->curDocument.id;
+                                                auto dec = decoders[toAdvance[0]].dec;
+                                                const auto freq = dec->curDocument.freq;
+                                                auto termHitsStorage = scratch.hits_storage(freq);
+
+                                                enc->begin_document(lowestDID);
+                                                scratch.dws.reset();
+                                                dec->materialize_hits(1 /* dummy */, &scratch.dws /* dummy */, termHitsStorage);
 
-                                                toAdvance[0] = 0;
-                                                for (uint16_t i{1}; i != rem; ++i)
+                                                for (uint32_t i{0}; i != freq; ++i)
                                                 {
-                                                        const auto id = decoders[i].first->curDocument.id;
+                                                        const auto &th = termHitsStorage[i];
+                                                        const auto bytes = (uint8_t *)&th.payload;
 
-                                                        if (id < lowestDID)
-                                                        {
-                                                                lowestDID = id;
-                                                                toAdvanceCnt = 1;
-                                                                toAdvance[0] = i;
-                                                        }
-                                                        else if (id == lowestDID)
-                                                                toAdvance[toAdvanceCnt++] = i;
+                                                        enc->new_hit(th.pos, {bytes, th.payloadLen});
                                                 }
+                                                enc->end_document();
+                                        }
 
-                                                // always choose the first because they are always sorted by gen DESC
-
-						if (trace)
-							SLog("Lowest = ", lowestDID, ", masked = ", decoders[toAdvance[0]].second->test(lowestDID), "\n");
+                                        for (const auto idx : toAdvance)
+                                        {
+                                                auto dec = decoders[idx].dec;
 
-                                                if (!decoders[toAdvance[0]].second->test(lowestDID))
+                                                if (!dec->next())
                                                 {
-                                                        auto dec = decoders[toAdvance[0]].first;
-                                                        const auto freq = dec->curDocument.freq;
+                                                        delete dec;
+                                                        delete decoders[idx].maskedDocsReg;
+                                                }
+                                                else
+                                                {
+                                                        heap.push_back({decoders[idx].cur_document(), idx});
+                                                        std::push_heap(heap.begin(), heap.end(), heapCmp);
+                                                }
+                                        }
+                                }
 
-                                                        if (freq > termHitsCapacity)
-                                                        {
-                                                                if (termHitsStorage)
-                                                                        std::free(termHitsStorage);
+                                decodersV.clear();
+                                enc->end_term(&tctx);
 
-                                                                termHitsCapacity = freq + 128;
-                                                                termHitsStorage = (term_hit *)malloc(sizeof(term_hit) * termHitsCapacity);
-                                                        }
+                                if (tctx.documents)
+                                        terms->push_back({outTerm, tctx});
+                        }
+                }
+        };
 
-                                                        enc->begin_document(lowestDID);
-                                                        dec->materialize_hits(1 /* dummy */, &dws /* dummy */, termHitsStorage);
+        // Parallel merge; see MergeCandidatesCollection::threads
+        std::vector<std::unique_ptr<Trinity::Codecs::IndexSession>> partitions;
 
-                                                        for (uint32_t i{0}; i != freq; ++i)
-                                                        {
-                                                                const auto &th = termHitsStorage[i];
-                                                                const auto bytes = (uint8_t *)&th.payload;
+        for (uint32_t i{0}; threads > 1 && i != threads; ++i)
+        {
+                auto p = is->new_partition();
 
-                                                                enc->new_hit(th.pos, {bytes, th.payloadLen});
-                                                        }
-                                                        enc->end_document();
-                                                }
+                if (!p)
+                {
+                        // not supported by this codec
+                        partitions.clear();
+                        break;
+                }
 
-                                                do
-                                                {
-                                                        const auto idx = toAdvance[--toAdvanceCnt];
-                                                        auto dec = decoders[idx].first;
+                partitions.emplace_back(p);
+        }
 
-                                                        if (!dec->next())
-                                                        {
-                                                                delete dec;
-                                                                delete decoders[idx].second;
+        // Terms are selected with a loser tree over the cursors, so that we only need O(log(cursors)) terms comparisons for each
+        // selected term, instead of comparing the current terms of all cursors, which matters when merging many segments at once.
+        //
+        // nodes[0] is the winner(the cursor with the lowest term) and nodes[1, n) are the losers of the internal nodes of the tree, where
+        // the leaves(cursors) are at [n, 2n). Ties are broken by cursor index, so that cursors with the same term are selected
+        // in candidates order(i.e gen DESC), which is what merge_term() expects.
+        const uint32_t n = cursors.size();
+        const auto C = cursors.data();
+        std::unique_ptr<uint32_t[]> nodes(new uint32_t[n]);
+        const auto precedes = [C](const uint32_t a, const uint32_t b) noexcept {
+                if (C[a].done)
+                        return false;
+                else if (C[b].done)
+                        return true;
+
+                const auto r = terms_cmp(C[a].term.data(), C[a].term.size(), C[b].term.data(), C[b].term.size());
+
+                return r < 0 || (r == 0 && a < b);
+        };
+        const auto replay = [n, N = nodes.get(), &precedes](const uint32_t leaf) noexcept {
+                auto winner = leaf;
 
-                                                                if (!--rem)
-                                                                        goto l10;
+                for (auto t = (leaf + n) >> 1; t; t >>= 1)
+                {
+                        if (precedes(N[t], winner))
+                                std::swap(N[t], winner);
+                }
+                N[0] = winner;
+        };
 
-                                                                memmove(decoders + idx, decoders + idx + 1, (rem - idx) * sizeof(decoders[0]));
-                                                        }
-                                                } while (toAdvanceCnt);
-                                        }
+        if (n == 1)
+                nodes[0] = 0;
+        else
+        {
+                // winners of the subtrees; leaves are at [n, 2n)
+                std::unique_ptr<uint32_t[]> winners(new uint32_t[n * 2]);
 
-                                l10:
-                                        decodersV.clear();
-                                        enc->end_term(&tctx);
+                for (uint32_t i{0}; i != n; ++i)
+                        winners[n + i] = i;
 
-                                        if (tctx.documents)
-                                                terms->push_back({outTerm, tctx});
-                                }
+                for (auto t = n - 1; t; --t)
+                {
+                        const auto l = winners[t * 2], r = winners[t * 2 + 1];
+
+                        if (precedes(l, r))
+                        {
+                                nodes[t] = r;
+                                winners[t] = l;
+                        }
+                        else
+                        {
+                                nodes[t] = l;
+                                winners[t] = r;
                         }
                 }
+                nodes[0] = winners[1];
+        }
 
-                if (flushFreq && is->indexOut.size() > flushFreq)
+        term_participant participants[n];
+        std::unique_ptr<Trinity::Codecs::Encoder> enc(partitions.empty() ? is->new_encoder() : nullptr);
+        merge_scratch scratch;
+        size_t throttledOutput{is->indexOut.size()};
+        // parallel merge: terms are selected first, and merged later, see below
+        struct merge_term_task final
+        {
+                str8_t term;
+                uint32_t participantsOffset;
+                uint16_t participantsCnt;
+                uint64_t cost; // size of the participants chunks
+        };
+        std::vector<merge_term_task> tasks;
+        std::vector<term_participant> tasksParticipants;
+        // all terms are selected first if we need to remap document IDs, because we need to know all live documents before
+        // we can merge any term
+        const bool deferred = remapping || !partitions.empty();
+        // streaming merge; see merge(IndexSession *, int, TermsWriter *, uint32_t)
+        static constexpr uint32_t flushAlignment{64 * 1024};
+        uint64_t unsynced{0};
+        const auto flush_output = [this, is, terms, indexFd, termsWriter, flushFreq, &unsynced]() {
+                if (termsWriter)
+                {
+                        for (const auto &it : *terms)
+                                termsWriter->append(it.first, it.second);
+                        terms->clear();
+                }
+
+                if (indexFd != -1 && flushFreq && is->indexOut.size() > flushFreq)
+                {
+                        const auto before = is->indexOutFlushed;
+
+                        is->flush_index(indexFd, flushAlignment);
+                        unsynced += is->indexOutFlushed - before;
+
+                        if (syncInterval && unsynced >= syncInterval)
+                        {
+                                // so that the kernel won't accumulate many dirty pages, only to write them all at once when the segment is persisted
+                                if (fdatasync(indexFd) == -1)
+                                        throw Switch::system_error("Failed to sync index");
+
+                                unsynced = 0;
+                        }
+                }
+        };
+        const auto throttle_output = [this, is, &throttledOutput]() {
+                if (throttle)
                 {
-                        // TODO: support pending
+                        if (const auto n = is->indexOut.size(); n > throttledOutput)
+                                throttle->consume(n - throttledOutput);
                 }
+                throttledOutput = is->indexOut.size();
+        };
+
+        for (;;)
+        {
+                const auto first = nodes[0];
+
+                if (C[first].done)
+                        break;
 
+                const str8_t outTerm(allocator->CopyOf(C[first].term.data(), C[first].term.size()), C[first].term.size());
+                uint16_t cnt{0};
+
+                // Select all cursors with that term; each selected cursor is advanced(so that its term is higher than outTerm)
+                // and replayed, and the next winner is the next cursor with the same term, if any
                 do
                 {
-                        const auto idx = toAdvance[--toAdvanceCnt];
-                        auto terms = all[idx].candidate.terms;
+                        const auto w = nodes[0];
+                        auto &c = C[w];
+
+                        participants[cnt++] = {c.idx, c.tctx};
+                        c.terms->next();
+                        c.fetch();
+                        replay(w);
+                } while (!C[nodes[0]].done && !terms_cmp(C[nodes[0]].term.data(), C[nodes[0]].term.size(), outTerm.data(), outTerm.size()));
 
-                        terms->next();
-                        if (terms->done())
+                if (!deferred)
+                {
+                        merge_term(is, enc.get(), scratch, outTerm, participants, cnt, terms);
+                        throttle_output();
+                        flush_output();
+                        throttledOutput = is->indexOut.size();
+
+                        if (termsWriter)
                         {
-                                if (!--rem)
-                                        goto l1;
+                                // outTerm was written
+                                allocator->reuse();
+                        }
+                }
+                else
+                {
+                        uint64_t cost{1};
+
+                        for (uint16_t i{0}; i != cnt; ++i)
+                                cost += participants[i].tctx.indexChunk.size();
+
+                        tasks.push_back({outTerm, uint32_t(tasksParticipants.size()), cnt, cost});
+                        tasksParticipants.insert(tasksParticipants.end(), participants, participants + cnt);
+                }
+        }
+
+        if (!deferred)
+                return;
 
-                                memmove(all + idx, all + idx + 1, (rem - idx) * sizeof(all[0]));
+        if (remapping)
+        {
+                // Collect all live documents. A document is live if it's not masked for any participant that provides it
+                std::vector<std::unique_ptr<masked_documents_registry>> registries(candidates.size());
+
+                for (const auto &t : tasks)
+                {
+                        for (uint16_t i{0}; i != t.participantsCnt; ++i)
+                        {
+                                const auto &p = tasksParticipants[t.participantsOffset + i];
+
+                                if (unlikely(0 == p.tctx.documents))
+                                        continue;
+
+                                const auto &c = candidates[p.idx];
+                                auto &maskedDocsReg = registries[p.idx];
+                                std::unique_ptr<Trinity::Codecs::Decoder> dec(c.ap->new_decoder(p.tctx, false));
+
+                                if (!maskedDocsReg)
+                                {
+                                        // reused across terms
+                                        maskedDocsReg = scanner_registry_for(p.idx);
+                                        maskedDocsReg->randomAccess = true;
+                                }
+
+                                for (auto id = dec->begin(); id != MaxDocIDValue; id = dec->curDocument.id)
+                                {
+                                        const auto docID = translate_docid(c.globalDocIDs, id);
+
+                                        if (!maskedDocsReg->test(docID))
+                                                remap.set(docID);
+
+                                        if (!dec->next())
+                                                break;
+                                }
+                        }
+                }
+
+                remap.commit();
+                globalDocIDs.clear();
+                for (size_t i{0}; i != remap.live.size(); ++i)
+                {
+                        for (auto v = remap.live[i]; v; v &= v - 1)
+                                globalDocIDs.push_back(i * 64 + SwitchBitOps::TrailingZeros(v));
+                }
+
+                if (docIDsOrder == DocIDsOrder::StaticRank)
+                {
+                        std::vector<std::pair<uint64_t, docid_t>> ranked;
+
+                        ranked.reserve(globalDocIDs.size());
+                        for (const auto id : globalDocIDs)
+                                ranked.push_back({staticRank(id), id});
+
+                        std::sort(ranked.begin(), ranked.end(), [](const auto &a, const auto &b) noexcept {
+                                return b.first < a.first || (a.first == b.first && a.second < b.second);
+                        });
+
+                        remap.local.resize(ranked.size());
+                        for (uint32_t i{0}; i != ranked.size(); ++i)
+                        {
+                                const auto id = ranked[i].second;
+
+                                globalDocIDs[i] = id;
+                                remap.local[remap.dense_index(id)] = i + 1;
                         }
-                } while (toAdvanceCnt);
+                }
+
+                documents = globalDocIDs.size();
+
+                if (trace)
+                        SLog(globalDocIDs.size(), " live documents\n");
+        }
+
+        if (partitions.empty())
+        {
+                for (const auto &t : tasks)
+                {
+                        merge_term(is, enc.get(), scratch, t.term, tasksParticipants.data() + t.participantsOffset, t.participantsCnt, terms);
+                        throttle_output();
+                        flush_output();
+                        throttledOutput = is->indexOut.size();
+                }
+                return;
+        }
+
+        // Split the selected terms into contiguous ranges of about the same cost, and merge each range into its own partition
+        // concurrently. Partitions are appended to `is` in order, so the index is identical to the one we would have built serially.
+        //
+        // If the output is streamed, the terms are merged in batches of about flushFreq bytes(input) per partition, so that
+        // we won't hold the whole merged index in memory
+        const auto K = partitions.size();
+        const uint64_t batchBudget = termsWriter && flushFreq ? uint64_t(flushFreq) * K : std::numeric_limits<uint64_t>::max();
+        std::vector<std::vector<std::pair<str8_t, Trinity::term_index_ctx>>> partitionsTerms(K);
+        std::vector<term_index_ctx> tctxs;
+
+        for (size_t batchBase{0}; batchBase != tasks.size();)
+        {
+                std::vector<size_t> bounds{batchBase};
+                std::vector<std::thread> workers;
+                std::exception_ptr failure;
+                std::mutex failureLock;
+                uint64_t totalCost{0}, cost{0};
+                auto batchEnd = batchBase;
+
+                do
+                {
+                        totalCost += tasks[batchEnd++].cost;
+                } while (batchEnd != tasks.size() && totalCost + tasks[batchEnd].cost <= batchBudget);
+
+                for (auto i = batchBase; i != batchEnd && bounds.size() != K; ++i)
+                {
+                        cost += tasks[i].cost;
+                        if (cost >= totalCost * bounds.size() / K)
+                                bounds.push_back(i + 1);
+                }
+                while (bounds.size() != K + 1)
+                        bounds.push_back(batchEnd);
+
+                for (size_t i{0}; i != K; ++i)
+                {
+                        if (!partitions[i])
+                                partitions[i].reset(is->new_partition());
+                }
+
+                for (size_t i{0}; i != K; ++i)
+                {
+                        workers.emplace_back([&, i]() {
+                                try
+                                {
+                                        auto p = partitions[i].get();
+                                        std::unique_ptr<Trinity::Codecs::Encoder> enc(p->new_encoder());
+                                        merge_scratch scratch;
+                                        size_t throttledOutput{0};
+
+                                        for (auto k = bounds[i]; k != bounds[i + 1]; ++k)
+                                        {
+                                                const auto &t = tasks[k];
+
+                                                merge_term(p, enc.get(), scratch, t.term, tasksParticipants.data() + t.participantsOffset, t.participantsCnt, &partitionsTerms[i]);
+
+                                                if (throttle)
+                                                {
+                                                        if (const auto n = p->indexOut.size(); n > throttledOutput)
+                                                        {
+                                                                throttle->consume(n - throttledOutput);
+                                                                throttledOutput = n;
+                                                        }
+                                                }
+                                        }
+                                }
+                                catch (...)
+                                {
+                                        std::lock_guard<std::mutex> g(failureLock);
+
+                                        if (!failure)
+                                                failure = std::current_exception();
+                                }
+                        });
+                }
+
+                for (auto &t : workers)
+                        t.join();
+
+                if (failure)
+                        std::rethrow_exception(failure);
+
+                for (size_t i{0}; i != K; ++i)
+                {
+                        auto &v = partitionsTerms[i];
+
+                        tctxs.clear();
+                        for (const auto &it : v)
+                                tctxs.push_back(it.second);
+
+                        is->append_partition(partitions[i].get(), tctxs.data(), tctxs.size());
+                        partitions[i].reset();
+
+                        for (size_t j{0}; j != v.size(); ++j)
+                                terms->push_back({v[j].first, tctxs[j]});
+
+                        v.clear();
+                        flush_output();
+                }
+
+                batchBase = batchEnd;
         }
-l1:;
 }
 
 std::vector<std::pair<uint64_t, Trinity::MergeCandidatesCollection::IndexSourceRetention>>
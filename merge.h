@@ -1,6 +1,8 @@
 #pragma once
 #include "docidupdates.h"
 #include "terms.h"
+#include <functional>
+#include <mutex>
 
 namespace Trinity
 {
@@ -21,16 +23,61 @@ namespace Trinity
                 // see MergeCandidatesCollection::merge() impl.
                 updated_documents maskedDocuments;
 
+                // If the index source uses segment-local document IDs; see IndexSource::global_docids()
+                // The merged postings will use global document IDs
+                const docid_t *globalDocIDs{nullptr};
+
+                // See IndexSource::global_docids_ascending()
+                bool globalDocIDsAscending{true};
+
+                // See IndexSource::max_indexed_position(); only relevant if ap is set
+                // Defaults to Limits::MaxPosition, so that the merged index won't under-report the positions it indexes
+                tokenpos_t maxIndexedPosition{Limits::MaxPosition};
+
+                // See IndexSource::total_documents()
+                uint64_t documents{0};
+
                 merge_candidate &operator=(const merge_candidate &o)
                 {
                         gen = o.gen;
                         terms = o.terms;
                         ap = o.ap;
                         new (&maskedDocuments) updated_documents(o.maskedDocuments);
+                        globalDocIDs = o.globalDocIDs;
+                        globalDocIDsAscending = o.globalDocIDsAscending;
+                        maxIndexedPosition = o.maxIndexedPosition;
+                        documents = o.documents;
                         return *this;
                 }
         };
 
+        // Rate-limits the output of merges, so that background merges won't starve queries of I/O bandwidth
+        // Shared among all merges that should be accounted for together; see MergeCandidatesCollection::throttle
+        class MergeIOThrottle final
+        {
+              private:
+                std::mutex lock;
+                uint64_t bytesPerSecond;
+                double budget{0}; // in bytes
+                uint64_t lastRefill;
+
+              public:
+                MergeIOThrottle(const uint64_t bps)
+                    : bytesPerSecond{bps}, lastRefill{Timings::Microseconds::Tick()}
+                {
+                }
+
+                void set_rate(const uint64_t bps)
+                {
+                        std::lock_guard<std::mutex> g(lock);
+
+                        bytesPerSecond = bps;
+                }
+
+                // Blocks until `bytes` can be written without exceeding the rate
+                void consume(const size_t bytes);
+        };
+
         // See IndexSourcesCollection
         class MergeCandidatesCollection final
         {
@@ -38,8 +85,53 @@ namespace Trinity
                 std::vector<updated_documents> all;
                 std::vector<std::pair<merge_candidate, uint16_t>> map;
 
+              private:
+                void merge_impl(Codecs::IndexSession *, simple_allocator *, std::vector<std::pair<str8_t, term_index_ctx>> *const, const int indexFd, TermsWriter *const, const uint32_t flushFreq);
+
+              public:
+                // How merge() assigns document IDs in the merged index
+                enum class DocIDsOrder : uint8_t
+                {
+                        // Postings retain their (global) document IDs
+                        Preserve = 0,
+                        // Live documents are assigned dense, segment-local IDs [1, N] in ascending global ID order, so that
+                        // the gaps left by masked documents are reclaimed
+                        Dense,
+                        // Live documents are assigned segment-local IDs in descending staticRank() order(ties are broken by global ID),
+                        // so that the first documents matched by a query executed on the merged index are the highest ranked ones, and
+                        // a MatchedIndexDocumentsFilter can return ConsiderResponse::Abort once it has collected as many as it needs
+                        StaticRank
+                };
+
               public:
                 std::vector<merge_candidate> candidates;
+                // If set, merge() will consume() the bytes it outputs
+                MergeIOThrottle *throttle{nullptr};
+                // If > 1, merge() will select all terms first, then split them into that many ranges of about the same size(sum of the size of the
+                // terms' posting lists in the candidates) and merge the ranges concurrently, one thread per range, if the output codec supports it
+                // (see IndexSession::new_partition()). Each range's output is held in memory until it's appended to the output session.
+                // The index is identical to the one merged by a single thread.
+                uint32_t threads{1};
+                // Unless Preserve, merge() will first scan the postings of all candidates for the live documents(i.e not masked), and then
+                // rewrite the postings with the local IDs it assigns to them; see globalDocIDs
+                DocIDsOrder docIDsOrder{DocIDsOrder::Preserve};
+                // Required for DocIDsOrder::StaticRank; the rank of a (global) document ID, higher ranks first
+                // It will be invoked once for each live document
+                std::function<uint64_t(const docid_t)> staticRank;
+                // Unless docIDsOrder is Preserve, merge() sets this to the global ID of each local ID of the merged index(globalDocIDs[localID - 1])
+                // You should persist it along with the merged index; e.g SegmentIndexSource loads it from the `globalids` file of a segment
+                std::vector<docid_t> globalDocIDs;
+                // merge() sets this to the highest maxIndexedPosition of the candidates that provide postings
+                // You should persist it along with the merged index, so that the index source of the merged index can report it in max_indexed_position();
+                // e.g SegmentIndexSource loads it from the `max_position` file of a segment
+                tokenpos_t maxPosition{0};
+                // merge() sets this to the number of documents of the merged index, and also returns it
+                // Unless docIDsOrder is Preserve, it is exact(i.e globalDocIDs.size()). Otherwise, it is the sum of the candidates' documents, so
+                // documents masked by more recent candidates are accounted for; see IndexSource::total_documents()
+                uint64_t documents{0};
+                // Streaming merge() only: if not 0, the index file is fdatasync()ed whenever that many bytes have been flushed since the last sync, so
+                // that the kernel won't accumulate the whole merged index in dirty pages and then write it all at once
+                uint64_t syncInterval{0};
 
               public:
                 void insert(const merge_candidate c)
@@ -59,13 +151,29 @@ namespace Trinity
                 // You may want to use
                 // - Trinity::pack_terms() to build the terms files and then persist them
                 // - Trinity::persist_segment() to persist the actual index
+                // - persist() to persist documents, globalDocIDs and maxPosition
                 //
                 // IMPORTANT:
                 // You should use consider_tracked_sources() after you have merge()ed to figure out what to do with all tracked sources.
                 //
                 // You are expected to outIndexSess->begin() before you merge(), and outIndexSess->end() afterwards, though you may
                 // want to use Trinity::persist_segment(outIndexSess) which will persist and invoke end() for you
-                void merge(Codecs::IndexSession *outIndexSess, simple_allocator *, std::vector<std::pair<str8_t, term_index_ctx>> *const outTerms, const uint32_t flushFreq = 0);
+                //
+                // Returns the number of documents of the merged index; see documents
+                uint64_t merge(Codecs::IndexSession *outIndexSess, simple_allocator *, std::vector<std::pair<str8_t, term_index_ctx>> *const outTerms, const uint32_t flushFreq = 0);
+
+                // Streaming merge(): instead of collecting all output terms, they are written to `termsWriter` as they are merged, and outIndexSess->indexOut
+                // is flushed to `indexFd`(in large, aligned writes, see IndexSession::flush_index()) whenever it grows larger than `flushFreq` bytes, along with other
+                // data the codec may buffer(see IndexSession::set_flush_freq()), so that the memory used for the merged index is bounded.
+                // If threads > 1, the terms are merged in batches, so that each partition holds about flushFreq bytes.
+                //
+                // Unless docIDsOrder is Preserve or threads > 1, terms are not retained either.
+                // You should termsWriter->commit() afterwards, and use Trinity::persist_segment(outIndexSess, .., indexFd) to persist the index, and persist()
+                uint64_t merge(Codecs::IndexSession *outIndexSess, const int indexFd, TermsWriter *termsWriter, const uint32_t flushFreq);
+
+                // Persists what merge() produced other than the index and the terms into the segment directory `basePath`(see SegmentIndexSource):
+                // documents into its `documents` file, globalDocIDs into its `globalids` file(unless docIDsOrder is Preserve), and maxPosition into its `max_position` file
+                void persist(const char *basePath) const;
 
 		enum class IndexSourceRetention : uint8_t
 		{
@@ -0,0 +1,1000 @@
+#include "merge_scheduler.h"
+#include "google_codec.h"
+#include "indexer.h"
+#include "lucene_codec.h"
+#include "segment_index_source.h"
+#include "utils.h"
+#include <cmath>
+#include <dirent.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+using namespace Trinity;
+
+namespace // static/local this module
+{
+        // snprintf() into `out`(PATH_MAX bytes); throws if the path doesn't fit
+        template <typename... Args>
+        static void format_path(char *const out, const char *const fmt, Args &&... args)
+        {
+                const auto r = snprintf(out, PATH_MAX, fmt, std::forward<Args>(args)...);
+
+                if (unlikely(r < 0 || r >= PATH_MAX))
+                        throw Switch::data_error("Path too long");
+        }
+
+        static uint64_t file_size(const char *const basePath, const char *const name)
+        {
+                char path[PATH_MAX];
+                struct stat64 st;
+
+                format_path(path, "%s/%s", basePath, name);
+                return stat64(path, &st) == -1 ? 0 : st.st_size;
+        }
+
+        static uint64_t read_u64(const char *const basePath, const char *const name)
+        {
+                char path[PATH_MAX];
+                uint64_t v{0};
+
+                format_path(path, "%s/%s", basePath, name);
+                if (int fd = open(path, O_RDONLY | O_LARGEFILE); fd != -1)
+                {
+                        if (pread64(fd, &v, sizeof(v), 0) != sizeof(v))
+                                v = 0;
+                        close(fd);
+                }
+
+                return v;
+        }
+
+        static bool is_segment_name(const char *const name)
+        {
+                if (!*name)
+                        return false;
+
+                for (const auto *p = name; *p; ++p)
+                {
+                        if (!isdigit(*p))
+                                return false;
+                }
+
+                return true;
+        }
+
+        // Reads and unpacks the updated_documents.ids file of a segment, if any
+        // storage holds the file contents, which the returned updated_documents reference
+        static updated_documents load_updated_documents(const char *const basePath, std::unique_ptr<IOBuffer> *const storage)
+        {
+                char path[PATH_MAX];
+
+                format_path(path, "%s/updated_documents.ids", basePath);
+
+                int fd = open(path, O_RDONLY | O_LARGEFILE);
+
+                if (fd == -1)
+                {
+                        if (errno != ENOENT)
+                                throw Switch::system_error("open() failed for ", path);
+
+                        return {};
+                }
+
+                Defer({
+                        close(fd);
+                });
+
+                const auto fileSize = lseek64(fd, 0, SEEK_END);
+
+                if (!fileSize)
+                        return {};
+
+                auto b = std::make_unique<IOBuffer>();
+
+                b->reserve(fileSize);
+                if (pread64(fd, b->data(), fileSize, 0) != fileSize)
+                        throw Switch::system_error("Failed to read ", path);
+
+                b->resize(fileSize);
+                *storage = std::move(b);
+
+                return unpack_updates({reinterpret_cast<const uint8_t *>((*storage)->data()), uint32_t(fileSize)});
+        }
+
+        // Segments are flat directories
+        static void remove_segment_dir(const char *const basePath)
+        {
+                char path[PATH_MAX];
+
+                if (auto dh = opendir(basePath))
+                {
+                        while (auto de = readdir(dh))
+                        {
+                                if (de->d_name[0] == '.' && (de->d_name[1] == '\0' || (de->d_name[1] == '.' && de->d_name[2] == '\0')))
+                                        continue;
+
+                                format_path(path, "%s/%s", basePath, de->d_name);
+                                unlink(path);
+                        }
+
+                        closedir(dh);
+                }
+
+                rmdir(basePath);
+        }
+
+        static void sync_path(const char *const path, const int flags)
+        {
+                int fd = open(path, flags | O_RDONLY | O_LARGEFILE);
+
+                if (fd == -1)
+                        throw Switch::system_error("Failed to open ", path);
+
+                const auto r = fsync(fd);
+
+                close(fd);
+                if (r == -1)
+                        throw Switch::system_error("Failed to sync ", path);
+        }
+
+        // fsync()s all files of a segment, and then its directory
+        static void sync_segment_dir(const char *const basePath)
+        {
+                char path[PATH_MAX];
+                auto dh = opendir(basePath);
+
+                if (!dh)
+                        throw Switch::system_error("Failed to access ", basePath);
+
+                Defer({
+                        closedir(dh);
+                });
+
+                while (auto de = readdir(dh))
+                {
+                        if (de->d_name[0] == '.')
+                                continue;
+
+                        format_path(path, "%s/%s", basePath, de->d_name);
+                        sync_path(path, 0);
+                }
+
+                sync_path(basePath, O_DIRECTORY);
+        }
+
+        static bool path_exists(const char *const path)
+        {
+                struct stat64 st;
+
+                return stat64(path, &st) == 0;
+        }
+
+        // The generations of the segments merged into a merged segment; see MergeScheduler::run_merge()
+        // The manifest is persisted last, so a merged segment is complete if it exists
+        static std::vector<uint64_t> load_merge_manifest(const char *const basePath)
+        {
+                char path[PATH_MAX];
+                std::vector<uint64_t> gens;
+
+                format_path(path, "%s/merge_sources", basePath);
+
+                int fd = open(path, O_RDONLY | O_LARGEFILE);
+
+                if (fd == -1)
+                {
+                        if (errno != ENOENT)
+                                throw Switch::system_error("open() failed for ", path);
+
+                        return gens;
+                }
+
+                Defer({
+                        close(fd);
+                });
+
+                const auto fileSize = lseek64(fd, 0, SEEK_END);
+
+                if (fileSize <= 0 || fileSize % sizeof(uint64_t))
+                        throw Switch::data_error("Unexpected merge manifest ", path);
+
+                gens.resize(fileSize / sizeof(uint64_t));
+                if (pread64(fd, gens.data(), fileSize, 0) != fileSize)
+                        throw Switch::system_error("Failed to read ", path);
+
+                return gens;
+        }
+
+        // Swaps <indexPath>/.merge.<gen>(the merged segment) with <indexPath>/<gen>, so that the merged segment is installed
+        // atomically and .merge.<gen> holds the segment it replaced
+        // The index directory is synced by retire_merged_segments()
+        static void install_merged_segment(const char *const indexPath, const uint64_t gen)
+        {
+                char path[PATH_MAX], mergePath[PATH_MAX];
+
+                format_path(path, "%s/%" PRIu64, indexPath, gen);
+                format_path(mergePath, "%s/.merge.%" PRIu64, indexPath, gen);
+
+#ifndef RENAME_EXCHANGE
+#define RENAME_EXCHANGE (1 << 1)
+#endif
+                if (syscall(SYS_renameat2, AT_FDCWD, mergePath, AT_FDCWD, path, RENAME_EXCHANGE) == -1)
+                {
+                        if (errno != ENOENT || rename(mergePath, path) == -1)
+                                throw Switch::system_error("Failed to install merged segment ", path);
+                }
+        }
+
+        // Retires the segments merged into the installed merged segment <indexPath>/<gen>, by renaming them to <indexPath>/.retired.<gen>, and
+        // removes its manifest. This is idempotent, so that it can complete a merge interrupted by a crash; see MergeScheduler::recover()
+        static bool retire_merged_segments(const char *const indexPath, const uint64_t gen)
+        {
+                char path[PATH_MAX], retiredPath[PATH_MAX], basePath[PATH_MAX];
+
+                format_path(basePath, "%s/%" PRIu64, indexPath, gen);
+
+                const auto gens = load_merge_manifest(basePath);
+
+                if (gens.empty())
+                        return false;
+
+                for (const auto it : gens)
+                {
+                        if (it == gen)
+                                format_path(path, "%s/.merge.%" PRIu64, indexPath, it);
+                        else
+                                format_path(path, "%s/%" PRIu64, indexPath, it);
+
+                        if (!path_exists(path))
+                                continue;
+
+                        format_path(retiredPath, "%s/.retired.%" PRIu64, indexPath, it);
+                        remove_segment_dir(retiredPath);
+                        if (rename(path, retiredPath) == -1)
+                                throw Switch::system_error("Failed to retire ", path);
+                }
+
+                sync_path(indexPath, O_DIRECTORY);
+
+                format_path(path, "%s/merge_sources", basePath);
+                if (unlink(path) == -1)
+                        throw Switch::system_error("Failed to remove ", path);
+
+                sync_path(basePath, O_DIRECTORY);
+                return true;
+        }
+}
+
+uint32_t tiered_merge_policy::allowed_segments(const uint64_t totalSize, const uint64_t minSegmentSize) const
+{
+        // see Lucene's TieredMergePolicy; each tier is maxMergeAtOnce times larger than the previous one
+        double levelSize = std::max<uint64_t>(minSegmentSize, floorSegmentSize);
+        double bytesLeft = totalSize;
+        uint32_t allowed{0};
+
+        for (;;)
+        {
+                const auto segmentsInLevel = bytesLeft / levelSize;
+
+                if (segmentsInLevel < segmentsPerTier)
+                {
+                        allowed += std::ceil(segmentsInLevel);
+                        break;
+                }
+
+                allowed += segmentsPerTier;
+                bytesLeft -= segmentsPerTier * levelSize;
+                levelSize *= std::max<uint32_t>(2, maxMergeAtOnce);
+        }
+
+        return std::max(allowed, segmentsPerTier);
+}
+
+std::vector<uint64_t> tiered_merge_policy::select(const std::vector<merge_segment_info> &segments, const std::vector<uint64_t> &merging) const
+{
+        const auto n = segments.size();
+        const auto floored_size = [this](const merge_segment_info &s) {
+                return std::max(s.size, floorSegmentSize);
+        };
+        const auto eligible = [&merging](const merge_segment_info &s) {
+                return !s.updatesOnly && std::find(merging.begin(), merging.end(), s.gen) == merging.end();
+        };
+        uint64_t totalSize{0}, minSize{std::numeric_limits<uint64_t>::max()};
+        uint32_t eligibleCnt{0};
+        bool haveMasked{false};
+
+        for (const auto &s : segments)
+        {
+                if (!eligible(s))
+                        continue;
+
+                ++eligibleCnt;
+                totalSize += floored_size(s);
+                minSize = std::min(minSize, s.size);
+                haveMasked |= s.masked_ratio() >= forceMergeMaskedRatio;
+        }
+
+        if (!eligibleCnt)
+                return {};
+
+        // If we are within budget, we 'll only merge in order to reclaim masked documents
+        const bool overBudget = eligibleCnt > allowed_segments(totalSize, minSize);
+
+        if (!overBudget && !haveMasked)
+                return {};
+
+        double bestScore{0};
+        std::pair<size_t, size_t> best{0, 0};
+
+        for (size_t i{0}; i != n; ++i)
+        {
+                uint64_t windowSize{0}, windowMaxSize{0}, windowDocuments{0}, windowMasked{0};
+                bool windowHasMasked{false};
+
+                // windows are segments with adjacent generations; updates-only segments and segments being merged break them
+                for (size_t j{i}; j != n && j - i < maxMergeAtOnce && eligible(segments[j]); ++j)
+                {
+                        const auto &s = segments[j];
+
+                        if (windowSize + s.size > maxMergedSegmentSize && j != i)
+                                break;
+
+                        windowSize += s.size;
+                        windowMaxSize = std::max(windowMaxSize, floored_size(s));
+                        windowDocuments += s.documents;
+                        windowMasked += std::min(s.maskedDocuments, s.documents);
+                        windowHasMasked |= s.masked_ratio() >= forceMergeMaskedRatio;
+
+                        const auto cnt = j - i + 1;
+
+                        if (cnt == 1 && !windowHasMasked)
+                        {
+                                // merging a single segment only makes sense if we can reclaim its masked documents
+                                continue;
+                        }
+                        else if (!overBudget && !windowHasMasked)
+                                continue;
+
+                        // lower is better: prefer windows of similar-sized segments(skew), smaller merges, and merges that reclaim many masked documents
+                        const double flooredTotal = std::max<uint64_t>(windowSize, floorSegmentSize * cnt);
+                        const double skew = cnt == 1 ? 1.0 / maxMergeAtOnce : windowMaxSize / flooredTotal;
+                        const double nonMaskedRatio = windowDocuments ? double(windowDocuments - windowMasked) / windowDocuments : 1;
+                        const double score = skew * std::pow(double(windowSize), 0.05) * std::pow(nonMaskedRatio, maskedDocumentsWeight);
+
+                        if (best.second == 0 || score < bestScore)
+                        {
+                                bestScore = score;
+                                best = {i, cnt};
+                        }
+                }
+        }
+
+        std::vector<uint64_t> res;
+
+        for (size_t i{best.first}; i != best.first + best.second; ++i)
+                res.push_back(segments[i].gen);
+
+        return res;
+}
+
+std::vector<merge_segment_info> Trinity::index_segments(const char *indexPath)
+{
+        std::vector<merge_segment_info> res;
+        char path[PATH_MAX];
+        auto dh = opendir(indexPath);
+
+        if (!dh)
+                throw Switch::system_error("Failed to access ", indexPath);
+
+        Defer({
+                closedir(dh);
+        });
+
+        std::vector<std::pair<uint64_t, uint64_t>> updates; // (updated documents, applied updates)
+        std::vector<docid_t> ids;
+
+        while (auto de = readdir(dh))
+        {
+                if (!is_segment_name(de->d_name))
+                        continue;
+
+                format_path(path, "%s/%s", indexPath, de->d_name);
+
+                struct stat64 st;
+
+                if (stat64(path, &st) == -1 || !S_ISDIR(st.st_mode))
+                        continue;
+
+                merge_segment_info s;
+                std::unique_ptr<IOBuffer> storage;
+
+                s.gen = strtoull(de->d_name, nullptr, 10);
+                s.size = file_size(path, "index") + file_size(path, "terms.data") + file_size(path, "hits.data");
+                s.documents = read_u64(path, "documents");
+                s.maskedDocuments = 0;
+                // only updated documents were retained for this segment
+                s.updatesOnly = !file_size(path, "codec");
+
+                ids.clear();
+                collect_updated_documents(load_updated_documents(path, &storage), &ids);
+                updates.push_back({ids.size(), read_u64(path, "applied_updates")});
+                res.push_back(s);
+        }
+
+        std::vector<uint32_t> order(res.size());
+
+        for (uint32_t i{0}; i != order.size(); ++i)
+                order[i] = i;
+
+        std::sort(order.begin(), order.end(), [&res](const auto a, const auto b) {
+                return res[b].gen < res[a].gen;
+        });
+
+        // Estimate how many documents of each segment are masked by more recent segments
+        // This is an upper bound; an updated document ID may not exist in an older segment, or may be updated in multiple segments.
+        // Masks of more recent segments were already applied to merged segments(see merge_segments()), so we don't account for those
+        std::vector<merge_segment_info> sorted;
+        uint64_t newerUpdates{0};
+
+        for (const auto i : order)
+        {
+                auto s = res[i];
+
+                s.maskedDocuments = newerUpdates > updates[i].second ? newerUpdates - updates[i].second : 0;
+                newerUpdates += updates[i].first;
+                sorted.push_back(s);
+        }
+
+        return sorted;
+}
+
+// The merged segment retains the norms of documents that are not masked by more recent segments(merged or not); norms are keyed
+// by global document IDs so they are not affected by document IDs remapping. See IndexSource::field_length()
+//
+// The norms of each segment are sorted by (document, field), so we k-way merge them, and stream the merged norms to the merged segment's file
+static void merge_norms(const std::vector<SegmentIndexSource *> &sources, const std::vector<std::pair<uint64_t, updated_documents>> &maskedBy, const char *outPath)
+{
+        struct cursor final
+        {
+                const field_norm *it;
+                const field_norm *end;
+                uint64_t gen;
+        };
+        std::vector<cursor> cursors;
+        std::vector<std::pair<uint64_t, updated_documents_scanner>> masks;
+
+        for (const auto s : sources)
+        {
+                const auto norms = s->field_norms();
+
+                if (norms.size())
+                        cursors.push_back({norms.offset, norms.offset + norms.size(), s->generation()});
+
+                if (const auto ud = s->masked_documents())
+                        masks.push_back({s->generation(), updated_documents_scanner(ud)});
+        }
+
+        if (cursors.empty())
+                return;
+
+        for (const auto &it : maskedBy)
+        {
+                if (it.second)
+                        masks.push_back({it.first, updated_documents_scanner(it.second)});
+        }
+
+        const auto path = Buffer{}.append(outPath, "/norms");
+        std::vector<uint8_t> masked(masks.size());
+        docid_t documentID{0};
+        bool anyDocument{false};
+        IOBuffer b;
+        int fd{-1};
+
+        Defer({
+                if (fd != -1)
+                        close(fd);
+        });
+
+        const auto flush = [&]() {
+                if (fd == -1)
+                {
+                        fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0775);
+
+                        if (fd == -1)
+                                throw Switch::system_error("Failed to persist norms");
+                }
+
+                if (Utilities::to_file(b.data(), b.size(), fd) == -1)
+                {
+                        // to_file() closes fd on failure
+                        fd = -1;
+                        throw Switch::system_error("Failed to persist norms");
+                }
+
+                b.clear();
+        };
+
+        for (;;)
+        {
+                // for each (document, field), the norm of the most recent segment
+                const cursor *best{nullptr};
+
+                for (const auto &c : cursors)
+                {
+                        if (c.it != c.end && (!best || *c.it < *best->it || (!(*best->it < *c.it) && c.gen > best->gen)))
+                                best = &c;
+                }
+
+                if (!best)
+                        break;
+
+                const auto n = *best->it;
+                const auto gen = best->gen;
+
+                if (!anyDocument || n.documentID != documentID)
+                {
+                        // scanners are tested with ascending document IDs, once per document
+                        documentID = n.documentID;
+                        anyDocument = true;
+                        for (size_t i{0}; i != masks.size(); ++i)
+                                masked[i] = masks[i].second.test(documentID);
+                }
+
+                size_t i{0};
+
+                while (i != masks.size() && !(masks[i].first > gen && masked[i]))
+                        ++i;
+
+                if (i == masks.size())
+                {
+                        b.serialize(&n, sizeof(n));
+                        if (b.size() > 1024 * 1024)
+                                flush();
+                }
+
+                // the (document, field) norms of older segments are superseded
+                for (auto &c : cursors)
+                {
+                        if (c.it != c.end && c.it->documentID == n.documentID && c.it->field == n.field)
+                                ++c.it;
+                }
+        }
+
+        if (b.size())
+                flush();
+
+        if (fd != -1)
+        {
+                const auto synced = fsync(fd) != -1;
+                const auto closed = close(fd) != -1;
+
+                fd = -1;
+                if (!synced || !closed)
+                        throw Switch::system_error("Failed to persist norms");
+        }
+}
+
+void Trinity::merge_segments(const char *indexPath, const std::vector<uint64_t> &gens, const std::vector<std::pair<uint64_t, updated_documents>> &maskedBy, const char *outPath, const bool retainMasked,
+                             std::function<Trinity::Codecs::IndexSession *(const char *)> newSession, MergeIOThrottle *throttle, const uint32_t threads,
+                             const MergeCandidatesCollection::DocIDsOrder docIDsOrder, std::function<uint64_t(const docid_t)> staticRank,
+                             const uint32_t flushFreq, const uint64_t syncInterval)
+{
+        char path[PATH_MAX];
+        std::vector<SegmentIndexSource *> sources;
+        std::vector<std::unique_ptr<IndexSourceTermsView>> views;
+        MergeCandidatesCollection collection;
+        std::vector<docid_t> updatedDocumentIDs;
+        std::vector<str8_t> commonGrams;
+        bool anyPostings{false};
+
+        expect(gens.size());
+
+        Defer({
+                for (auto it : sources)
+                        it->Release();
+        });
+
+        for (const auto gen : gens)
+        {
+                format_path(path, "%s/%" PRIu64, indexPath, gen);
+
+                auto s = new SegmentIndexSource(path);
+
+                sources.push_back(s);
+
+                const auto ud = s->masked_documents();
+
+                if (retainMasked)
+                        collect_updated_documents(ud, &updatedDocumentIDs);
+
+                if (auto ap = s->access_proxy())
+                {
+                        // The merged segment only indexes a bigram for all its documents if all merged segments did
+                        const auto &grams = s->common_grams();
+
+                        if (!anyPostings)
+                                commonGrams = grams;
+                        else
+                        {
+                                commonGrams.erase(std::remove_if(commonGrams.begin(), commonGrams.end(), [&grams](const auto &it) {
+                                                          return !std::binary_search(grams.begin(), grams.end(), it, [](const auto &a, const auto &b) noexcept {
+                                                                  return terms_cmp(a.data(), a.size(), b.data(), b.size()) < 0;
+                                                          });
+                                                  }),
+                                                  commonGrams.end());
+                        }
+                        anyPostings = true;
+
+                        views.emplace_back(s->segment_terms()->new_terms_view());
+                        collection.insert({s->generation(), views.back().get(), ap, ud, s->global_docids(), s->global_docids_ascending(), s->max_indexed_position(), s->total_documents()});
+                }
+                else
+                        collection.insert({s->generation(), nullptr, nullptr, ud, nullptr, true, 0, s->total_documents()});
+        }
+
+        // Documents masked by more recent segments are dropped from the merged segment
+        // merge() only needs their masks; they are not merged
+        uint64_t appliedUpdates{0};
+        std::vector<docid_t> ids;
+
+        for (const auto &it : maskedBy)
+        {
+                ids.clear();
+                collect_updated_documents(it.second, &ids);
+                appliedUpdates += ids.size();
+                collection.insert({it.first, nullptr, nullptr, it.second, nullptr});
+        }
+
+        if (mkdir(outPath, 0775) == -1 && errno != EEXIST)
+                throw Switch::system_error("Failed to create ", outPath);
+
+        std::unique_ptr<Trinity::Codecs::IndexSession> sess;
+
+        if (newSession)
+                sess.reset(newSession(outPath));
+        else if (auto ap = sources.front()->access_proxy(); ap && ap->codec_identifier().Eq(_S("LUCENE")))
+                sess.reset(new Trinity::Codecs::Lucene::IndexSession(outPath));
+        else
+                sess.reset(new Trinity::Codecs::Google::IndexSession(outPath));
+
+        const auto indexFilePath = Buffer{}.append(outPath, "/index.t");
+        int indexFd = open(indexFilePath.c_str(), O_WRONLY | O_CREAT | O_LARGEFILE | O_TRUNC, 0775);
+
+        if (indexFd == -1)
+                throw Switch::system_error("Failed to persist index ", indexFilePath.AsS32());
+
+        Defer({
+                if (indexFd != -1)
+                        close(indexFd);
+        });
+
+        TermsWriter termsWriter(outPath);
+
+        collection.throttle = throttle;
+        collection.threads = threads;
+        collection.docIDsOrder = docIDsOrder;
+        collection.staticRank = std::move(staticRank);
+        collection.syncInterval = syncInterval;
+        collection.commit();
+        sess->begin();
+        collection.merge(sess.get(), indexFd, &termsWriter, flushFreq);
+        termsWriter.commit();
+
+        collection.persist(outPath);
+
+        if (commonGrams.size())
+                persist_common_grams(outPath, commonGrams);
+
+        merge_norms(sources, maskedBy, outPath);
+
+        // so that index_segments() won't consider documents masked by those updates again
+        if (appliedUpdates && Utilities::to_file(reinterpret_cast<const char *>(&appliedUpdates), sizeof(appliedUpdates), Buffer{}.append(outPath, "/applied_updates").c_str()) == -1)
+                throw Switch::system_error("Failed to persist applied updates count");
+
+        std::sort(updatedDocumentIDs.begin(), updatedDocumentIDs.end());
+        updatedDocumentIDs.erase(std::unique(updatedDocumentIDs.begin(), updatedDocumentIDs.end()), updatedDocumentIDs.end());
+        persist_segment(sess.get(), updatedDocumentIDs, indexFd);
+
+        if (syncInterval && fsync(indexFd) == -1)
+                throw Switch::system_error("Failed to persist index");
+
+        const auto r = close(indexFd);
+
+        indexFd = -1;
+        if (r == -1)
+                throw Switch::system_error("Failed to persist index");
+
+        if (rename(indexFilePath.c_str(), Buffer{}.append(outPath, "/index").c_str()) == -1)
+                throw Switch::system_error("Failed to persist index");
+}
+
+MergeScheduler::MergeScheduler(const char *p, const options &o, std::function<void(const merge_outcome &)> cb)
+    : indexPath(p), opts(o), onMerged(std::move(cb)), throttle(o.maxMergeBytesPerSecond)
+{
+}
+
+// Retires the segments merged into installed merged segments, if that failed(see run_merge())
+void MergeScheduler::complete_merges()
+{
+        char path[PATH_MAX];
+
+        for (const auto &it : index_segments(indexPath.c_str()))
+        {
+                format_path(path, "%s/%" PRIu64 "/merge_sources", indexPath.c_str(), it.gen);
+                if (path_exists(path))
+                        retire_merged_segments(indexPath.c_str(), it.gen);
+        }
+}
+
+void MergeScheduler::recover()
+{
+        char path[PATH_MAX];
+        std::vector<std::string> names;
+        std::lock_guard<std::mutex> g(lock);
+        const auto scan = [&]() {
+                names.clear();
+                if (auto dh = opendir(indexPath.c_str()))
+                {
+                        while (auto de = readdir(dh))
+                        {
+                                if (!strncmp(de->d_name, _S(".merge.")) || !strncmp(de->d_name, _S(".retired.")))
+                                        names.push_back(de->d_name);
+                        }
+
+                        closedir(dh);
+                }
+                else
+                        throw Switch::system_error("Failed to access ", indexPath.c_str());
+        };
+
+        scan();
+
+        // merged segments persisted before the crash are installed
+        for (const auto &name : names)
+        {
+                if (strncmp(name.data(), _S(".merge.")))
+                        continue;
+
+                const auto gen = strtoull(name.data() + STRLEN(".merge."), nullptr, 10);
+
+                format_path(path, "%s/%s/merge_sources", indexPath.c_str(), name.data());
+                if (path_exists(path))
+                {
+                        format_path(path, "%s/%" PRIu64 "/merge_sources", indexPath.c_str(), gen);
+                        if (!path_exists(path))
+                                install_merged_segment(indexPath.c_str(), gen);
+                }
+        }
+
+        complete_merges();
+
+        // complete_merges() retires the segments it replaced, so we scan again
+        // whatever's left is either a partial merged segment, or was retired
+        scan();
+        for (const auto &name : names)
+        {
+                if (!strncmp(name.data(), _S(".merge.")) || opts.deleteRetired)
+                {
+                        format_path(path, "%s/%s", indexPath.c_str(), name.data());
+                        remove_segment_dir(path);
+                }
+        }
+
+        sync_path(indexPath.c_str(), O_DIRECTORY);
+}
+
+std::vector<uint64_t> MergeScheduler::select_merge(std::vector<merge_segment_info> *const segments)
+{
+        complete_merges();
+        *segments = index_segments(indexPath.c_str());
+
+        auto gens = opts.policy.select(*segments, merging);
+
+        merging.insert(merging.end(), gens.begin(), gens.end());
+        return gens;
+}
+
+void MergeScheduler::run_merge(const std::vector<uint64_t> &gens, const std::vector<merge_segment_info> &segments)
+{
+        const auto before = Timings::Microseconds::Tick();
+        const auto gen = gens.front();
+        const auto oldest = gens.back();
+        char path[PATH_MAX], outPath[PATH_MAX];
+        std::vector<std::pair<uint64_t, updated_documents>> maskedBy;
+        std::vector<std::unique_ptr<IOBuffer>> maskedByStorage;
+        bool retainMasked{false};
+
+        Defer({
+                std::lock_guard<std::mutex> g(lock);
+
+                for (const auto it : gens)
+                        merging.erase(std::find(merging.begin(), merging.end(), it));
+        });
+
+        {
+                // segments directories are only renamed while holding the lock
+                std::lock_guard<std::mutex> g(lock);
+
+                for (const auto &s : segments)
+                {
+                        if (s.gen > gen)
+                        {
+                                format_path(path, "%s/%" PRIu64, indexPath.c_str(), s.gen);
+                                maskedByStorage.emplace_back();
+                                maskedBy.push_back({s.gen, load_updated_documents(path, &maskedByStorage.back())});
+                        }
+                        else if (s.gen < oldest)
+                                retainMasked = true;
+                }
+        }
+
+        format_path(outPath, "%s/.merge.%" PRIu64, indexPath.c_str(), gen);
+        remove_segment_dir(outPath);
+
+        try
+        {
+                merge_segments(indexPath.c_str(), gens, maskedBy, outPath, retainMasked, opts.newSession, opts.maxMergeBytesPerSecond ? &throttle : nullptr, opts.threadsPerMerge,
+                               opts.docIDsOrder, opts.staticRank, opts.flushFreq, opts.syncInterval);
+
+                // The merged segment must be durable before it replaces the merged segments
+                // The manifest is persisted last; recover() only installs merged segments that have one
+                sync_segment_dir(outPath);
+                format_path(path, "%s/merge_sources", outPath);
+                if (Utilities::to_file(reinterpret_cast<const char *>(gens.data()), gens.size() * sizeof(uint64_t), path) == -1)
+                        throw Switch::system_error("Failed to persist merge manifest");
+                sync_path(outPath, O_DIRECTORY);
+
+                std::lock_guard<std::mutex> g(lock);
+
+                install_merged_segment(indexPath.c_str(), gen);
+        }
+        catch (...)
+        {
+                remove_segment_dir(outPath);
+                throw;
+        }
+
+        merge_outcome outcome;
+
+        outcome.gen = gen;
+        outcome.merged = gens;
+        for (const auto it : gens)
+                outcome.retention.push_back({it, MergeCandidatesCollection::IndexSourceRetention::Delete});
+
+        // The merged segment is installed; if we fail to retire the merged segments, the next select_merge() or recover() will
+        try
+        {
+                std::lock_guard<std::mutex> g(lock);
+
+                retire_merged_segments(indexPath.c_str(), gen);
+        }
+        catch (const std::exception &e)
+        {
+                SLog("Failed to retire merged segments:", e.what(), "\n");
+        }
+
+        outcome.duration = Timings::Microseconds::Since(before);
+        if (onMerged)
+                onMerged(outcome);
+
+        if (opts.deleteRetired)
+        {
+                for (const auto it : gens)
+                {
+                        format_path(path, "%s/.retired.%" PRIu64, indexPath.c_str(), it);
+                        remove_segment_dir(path);
+                }
+        }
+}
+
+bool MergeScheduler::merge_once()
+{
+        std::vector<merge_segment_info> segments;
+        std::vector<uint64_t> gens;
+
+        {
+                std::lock_guard<std::mutex> g(lock);
+
+                gens = select_merge(&segments);
+        }
+
+        if (gens.empty())
+                return false;
+
+        run_merge(gens, segments);
+        return true;
+}
+
+void MergeScheduler::worker()
+{
+        if (opts.threadsNice)
+                setpriority(PRIO_PROCESS, syscall(SYS_gettid), opts.threadsNice);
+
+        std::unique_lock<std::mutex> g(lock);
+        uint32_t failures{0};
+
+        while (!stopping)
+        {
+                std::vector<merge_segment_info> segments;
+                const auto gens = select_merge(&segments);
+
+                if (gens.empty())
+                {
+                        cv.wait_for(g, std::chrono::milliseconds(opts.pollInterval), [this]() { return stopping || triggered; });
+                        triggered = false;
+                        continue;
+                }
+
+                g.unlock();
+
+                try
+                {
+                        run_merge(gens, segments);
+                        failures = 0;
+                }
+                catch (const std::exception &e)
+                {
+                        // we 'll retry later; the same merge will likely be selected again, so we back off
+                        // instead of retrying it immediately
+                        SLog("Failed to merge segments:", e.what(), "\n");
+                        ++failures;
+                }
+
+                g.lock();
+
+                if (failures)
+                {
+                        const auto delay = std::min<uint64_t>(uint64_t(opts.minRetryInterval) << std::min<uint32_t>(failures - 1, 20), opts.maxRetryInterval);
+
+                        cv.wait_for(g, std::chrono::milliseconds(delay), [this]() { return stopping; });
+                }
+        }
+}
+
+void MergeScheduler::start()
+{
+        {
+                std::lock_guard<std::mutex> g(lock);
+
+                if (threads.size())
+                        return;
+        }
+
+        // resolve merges interrupted by a crash before we select any
+        recover();
+
+        std::lock_guard<std::mutex> g(lock);
+
+        if (threads.size())
+                return;
+
+        stopping = false;
+        for (uint32_t i{0}; i != std::max<uint32_t>(1, opts.maxConcurrentMerges); ++i)
+                threads.emplace_back(&MergeScheduler::worker, this);
+}
+
+void MergeScheduler::stop()
+{
+        {
+                std::lock_guard<std::mutex> g(lock);
+
+                stopping = true;
+        }
+
+        cv.notify_all();
+        for (auto &t : threads)
+                t.join();
+
+        threads.clear();
+}
+
+void MergeScheduler::trigger()
+{
+        {
+                std::lock_guard<std::mutex> g(lock);
+
+                triggered = true;
+        }
+
+        cv.notify_all();
+}
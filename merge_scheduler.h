@@ -0,0 +1,187 @@
+#pragma once
+#include "merge.h"
+#include <condition_variable>
+#include <functional>
+#include <thread>
+
+namespace Trinity
+{
+        // A segment(a directory named after its generation) in an index directory; see MergeScheduler
+        struct merge_segment_info final
+        {
+                uint64_t gen;
+                uint64_t size;            // size(in bytes) of the index and terms files
+                uint64_t documents;       // see SegmentIndexSource::total_documents()
+                uint64_t maskedDocuments; // estimate; number of documents updated or erased in more recent segments(upper bound)
+                // Only the updated documents IDs of a segment were retained (see MergeCandidatesCollection::IndexSourceRetention)
+                // Such segments are never merged, and merges never span them, because they still mask older segments
+                bool updatesOnly;
+
+                inline double masked_ratio() const noexcept
+                {
+                        return documents ? double(std::min(maskedDocuments, documents)) / documents : 0;
+                }
+        };
+
+        // Selects which segments to merge, similar to Lucene's TieredMergePolicy
+        //
+        // Segments are organized in tiers, based on their size. The number of segments allowed in an index is
+        // segmentsPerTier for each tier, and if there are more segments than that, windows of up to maxMergeAtOnce segments
+        // are scored and the best(lowest score) window is selected. Windows with segments of similar size, smaller resulting segments and
+        // segments with many masked documents score better.
+        //
+        // Only windows of segments with adjacent generations are considered, because a merged segment takes the place(generation)
+        // of the segments merged into it, and it must mask and be masked by the same segments they did.
+        struct tiered_merge_policy final
+        {
+                uint32_t segmentsPerTier{10};
+                uint32_t maxMergeAtOnce{10};
+                // segments smaller than this are treated as if they were this large, so that tiny segments are merged aggressively
+                uint64_t floorSegmentSize{2 * 1024 * 1024};
+                // never produce segments larger than this
+                uint64_t maxMergedSegmentSize{5ul * 1024 * 1024 * 1024};
+                // how much masked documents matter; higher values favor merges that reclaim masked documents
+                double maskedDocumentsWeight{2.0};
+                // segments with a higher ratio of masked documents are merged even if the index is within budget
+                double forceMergeMaskedRatio{0.5};
+
+                // Returns the allowed number of segments for an index of `totalSize` bytes, whose smallest segment is `minSegmentSize`
+                uint32_t allowed_segments(const uint64_t totalSize, const uint64_t minSegmentSize) const;
+
+                // `segments` must be sorted by generation, descending.
+                // `merging` is the generations of segments already being merged; they are not considered.
+                // Returns the generations(descending) of the segments to merge, or an empty vector
+                std::vector<uint64_t> select(const std::vector<merge_segment_info> &segments, const std::vector<uint64_t> &merging) const;
+        };
+
+        struct merge_outcome final
+        {
+                // The generation of the merged segment; that's the generation of the most recent segment merged into it
+                uint64_t gen;
+                // All merged segments(generations), including gen
+                std::vector<uint64_t> merged;
+                // Retention for all merged segments, see MergeCandidatesCollection::consider_tracked_sources()
+                // Masked documents of the merged segments are retained in the merged segment if needed, so this is always Delete
+                std::vector<std::pair<uint64_t, MergeCandidatesCollection::IndexSourceRetention>> retention;
+                uint64_t duration; // in microseconds
+        };
+
+        // Merges the segments `gens`(generations, adjacent in the index, descending) of the index in `indexPath` into a new
+        // segment in `outPath`, with the generation gens[0]; see MergeScheduler.
+        //
+        // `maskedBy` are the (generation, masked documents) of all segments more recent than gens[0]; documents they mask are dropped
+        // The merged segment retains all documents masked by the merged segments if `retainMasked` is set, which is required if there are any older segments
+        // If newSession is not set, the codec of the most recent segment is used
+        // See MergeCandidatesCollection::threads for `threads`
+        // See MergeCandidatesCollection::docIDsOrder for `docIDsOrder` and `staticRank`; unless Preserve, the local to global document IDs mapping
+        // is persisted in the merged segment's `globalids` file
+        // The merged segment is streamed to its files(see MergeCandidatesCollection::merge(IndexSession *, int, TermsWriter *, uint32_t)); see there for
+        // `flushFreq`, and MergeCandidatesCollection::syncInterval for `syncInterval`. If syncInterval is set, the index file is also fsync()ed once persisted
+        void merge_segments(const char *indexPath, const std::vector<uint64_t> &gens, const std::vector<std::pair<uint64_t, updated_documents>> &maskedBy,
+                            const char *outPath, const bool retainMasked,
+                            std::function<Trinity::Codecs::IndexSession *(const char *)> newSession, MergeIOThrottle *throttle = nullptr, const uint32_t threads = 1,
+                            const MergeCandidatesCollection::DocIDsOrder docIDsOrder = MergeCandidatesCollection::DocIDsOrder::Preserve,
+                            std::function<uint64_t(const docid_t)> staticRank = nullptr, const uint32_t flushFreq = 0, const uint64_t syncInterval = 0);
+
+        // Scans `indexPath` for segments (directories named after their generation) and returns them sorted by generation, descending
+        std::vector<merge_segment_info> index_segments(const char *indexPath);
+
+        // Merges segments of an index in the background, so that the number of segments (and so the number of sources a query needs to be executed on)
+        // is bounded under continuous indexing.
+        //
+        // A merged segment replaces the most recent segment merged into it(same generation), and the segment directories are swapped like so:
+        // 	- the merged segment is created in <indexPath>/.merge.<gen>, and its files are fsync()ed
+        // 	- the generations of the merged segments are persisted in its `merge_sources` manifest
+        // 	- <indexPath>/.merge.<gen> and <indexPath>/<gen> are exchanged atomically(renameat2(RENAME_EXCHANGE))
+        // 	- all other merged segments directories, and <indexPath>/.merge.<gen>, are renamed to <indexPath>/.retired.<gen>, and the manifest is removed
+        // 	- onMerged() is invoked; you should load the new segment and retire the merged ones from your IndexSourcesCollection/IndexSourcesPublisher
+        // 	- retired directories are deleted (unless options.deleteRetired is false)
+        //
+        // The index directory is fsync()ed after each step, so that if the process crashes, recover() can either complete
+        // the merge(the manifest was persisted) or discard it.
+        //
+        // Segments and their files remain accessible to queries that use them until they are released, because they are memory mapped or the files are open.
+        // You should not create segments in the index directory with a generation lower than that of any existing segment while the scheduler is running.
+        class MergeScheduler final
+        {
+              public:
+                struct options final
+                {
+                        tiered_merge_policy policy;
+                        // CPU budget: up to that many merges will run concurrently, each in its own thread
+                        uint32_t maxConcurrentMerges{1};
+                        // Each merge will use upto that many threads; see MergeCandidatesCollection::threads
+                        uint32_t threadsPerMerge{1};
+                        // How merged segments' document IDs are assigned; see MergeCandidatesCollection::docIDsOrder
+                        // staticRank may be invoked concurrently by multiple merges
+                        MergeCandidatesCollection::DocIDsOrder docIDsOrder{MergeCandidatesCollection::DocIDsOrder::Preserve};
+                        std::function<uint64_t(const docid_t)> staticRank;
+                        // Memory budget(in bytes) for each merge's output; see merge_segments()
+                        uint32_t flushFreq{16 * 1024 * 1024};
+                        // If not 0, merges will sync their output every that many bytes; see merge_segments()
+                        uint64_t syncInterval{0};
+                        // If not 0, merge threads will run with this nice value (see setpriority(2))
+                        int threadsNice{0};
+                        // I/O budget: if not 0, merges will output upto that many bytes/second, in total
+                        uint64_t maxMergeBytesPerSecond{0};
+                        // How often(in milliseconds) to check for segments to merge, in addition to trigger()
+                        uint32_t pollInterval{10 * 1000};
+                        // After a merge fails, a merge thread waits before it selects another merge; starting with minRetryInterval(in milliseconds), the
+                        // delay is doubled for every consecutive failure, upto maxRetryInterval
+                        uint32_t minRetryInterval{1000};
+                        uint32_t maxRetryInterval{5 * 60 * 1000};
+                        bool deleteRetired{true};
+                        // Creates the IndexSession for the merged segment in the provided path; if not set, the codec of the most recent merged segment is used
+                        std::function<Trinity::Codecs::IndexSession *(const char *)> newSession;
+                };
+
+              private:
+                const std::string indexPath;
+                options opts;
+                std::function<void(const merge_outcome &)> onMerged;
+                MergeIOThrottle throttle;
+                std::mutex lock;
+                std::condition_variable cv;
+                std::vector<uint64_t> merging; // generations of segments being merged
+                std::vector<std::thread> threads;
+                bool stopping{false};
+                bool triggered{false};
+
+              private:
+                // selects a merge and marks its segments as merging; must hold lock
+                std::vector<uint64_t> select_merge(std::vector<merge_segment_info> *const segments);
+
+                void run_merge(const std::vector<uint64_t> &gens, const std::vector<merge_segment_info> &segments);
+
+                // must hold lock
+                void complete_merges();
+
+                void worker();
+
+              public:
+                MergeScheduler(const char *indexPath, const options &o, std::function<void(const merge_outcome &)> onMerged);
+
+                ~MergeScheduler()
+                {
+                        stop();
+                }
+
+                // Starts the merge threads; recover()s first
+                void start();
+
+                // Completes merges interrupted by a crash and removes partial merged segments(<indexPath>/.merge.*), and
+                // retired segments(<indexPath>/.retired.*) if options.deleteRetired is set.
+                // If you use merge_once() instead of start(), invoke this once before you do, and not while merges are running
+                void recover();
+
+                // Waits for running merges to complete and stops the merge threads
+                void stop();
+
+                // Checks for segments to merge now, e.g after you have committed a new segment
+                void trigger();
+
+                // Selects and runs one merge in the calling thread; returns false if there was nothing to merge
+                // This is useful if you want to schedule merges yourself
+                bool merge_once();
+        };
+}
@@ -1,4 +1,5 @@
 #include "queries.h"
+#include "terms.h"
 #include <unordered_map>
 #include <set>
 
@@ -77,9 +78,39 @@ static std::pair<str32_t, range_base<uint16_t, uint16_t>> parse_term(ast_parser
         }
 }
 
+// If a [field:] prefix for any of ctx.fields follows, consumes it and returns the field, otherwise returns 0 (the default field)
+static field_id_t parse_field(ast_parser &ctx)
+{
+        if (!ctx.fields)
+                return 0;
+
+        const auto s = ctx.content;
+        uint32_t n{0};
+
+        while (n != s.size() && (isalnum(s.data()[n]) || s.data()[n] == '_'))
+                ++n;
+
+        if (!n || n > Limits::MaxTermLength || n + 1 >= s.size() || s.data()[n] != ':' || isspace(s.data()[n + 1]))
+                return 0;
+
+        const auto it = ctx.fields->find(str8_t(s.data(), n));
+
+        if (it == ctx.fields->end())
+                return 0;
+
+        require(it->second <= Limits::MaxFields);
+        ctx.content.strip_prefix(n + 1);
+        return it->second;
+}
+
 static ast_node *parse_phrase_or_token(ast_parser &ctx)
 {
+        char_t fieldTerm[Limits::MaxTermLength];
+
         ctx.skip_ws();
+
+        const auto field = parse_field(ctx);
+
         if (ctx.content && ctx.content.StripPrefix(_S("\"")))
         {
                 auto &terms = ctx.terms;
@@ -101,7 +132,9 @@ static ast_node *parse_phrase_or_token(ast_parser &ctx)
                                 if (unlikely(token.size() > Limits::MaxTermLength))
                                         return ctx.alloc_node(ast_node::Type::ConstFalse);
 
-                                t.token.Set(token.data(), uint8_t(token.size()));
+                                t.token = field_term(field, str8_t(token.data(), uint8_t(token.size())), fieldTerm);
+                                if (unlikely(!t.token))
+                                        return ctx.alloc_node(ast_node::Type::ConstFalse);
 
                                 if (n != sizeof_array(terms))
                                 {
@@ -126,6 +159,8 @@ static ast_node *parse_phrase_or_token(ast_parser &ctx)
                         std::copy(terms, terms + n, p->terms);
                         p->rep = 1;
                         p->toNextSpan = DefaultToNextSpan;
+                        p->window = 0;
+                        p->ordered = false;
                         p->rewrite_ctx.range.reset();
                         p->rewrite_ctx.srcSeqSize = 0;
                         p->rewrite_ctx.translationCoefficient = 1.0;
@@ -142,7 +177,9 @@ static ast_node *parse_phrase_or_token(ast_parser &ctx)
 
                 term t;
 
-                t.token.Set(token.data(), uint8_t(token.size()));
+                t.token = field_term(field, str8_t(token.data(), uint8_t(token.size())), fieldTerm);
+                if (unlikely(!t.token))
+                        return ctx.alloc_node(ast_node::Type::ConstFalse);
 
                 auto node = ctx.alloc_node(ast_node::Type::Token);
                 auto p = (phrase *)ctx.allocator.Alloc(sizeof(phrase) + sizeof(term));
@@ -153,6 +190,8 @@ static ast_node *parse_phrase_or_token(ast_parser &ctx)
                 p->terms[0] = t;
                 p->rep = 1;
                 p->toNextSpan = DefaultToNextSpan;
+                p->window = 0;
+                p->ordered = false;
                 p->rewrite_ctx.range.reset();
                 p->rewrite_ctx.srcSeqSize = 0;
                 p->rewrite_ctx.translationCoefficient = 1.0;
@@ -229,6 +268,126 @@ static auto parse_operator(ast_parser &ctx)
         return parse_operator_impl(ctx);
 }
 
+// If a NEAR/k or ONEAR/k operator follows, consumes it and returns k, otherwise returns 0
+static uint16_t parse_proximity_operator(ast_parser &ctx, bool *const ordered)
+{
+        if (ctx.parserFlags & uint32_t(ast_parser::Flags::NEARAsToken))
+                return 0;
+
+        ctx.skip_ws();
+
+        auto s = ctx.content;
+        const bool o = s.StripPrefix(_S("ONEAR/"));
+        uint32_t k{0};
+
+        if (!o && !s.StripPrefix(_S("NEAR/")))
+                return 0;
+
+        while (s && isdigit(s.front()) && k <= Limits::MaxProximityWindow)
+        {
+                k = k * 10 + (s.front() - '0');
+                s.strip_prefix(1);
+        }
+
+        if (!k || k > Limits::MaxProximityWindow || (s && isalnum(s.front())))
+                return 0;
+
+        ctx.content = s;
+        *ordered = o;
+        return k;
+}
+
+static ast_node *proximity_phrase(ast_parser &ctx, const term *const terms, const uint8_t size, const uint16_t window, const bool ordered, const range_base<uint16_t, uint16_t> range)
+{
+        auto p = (phrase *)ctx.allocator.Alloc(sizeof(phrase) + sizeof(term) * size);
+        auto res = ctx.alloc_node(ast_node::Type::Phrase);
+
+        p->size = size;
+        std::copy(terms, terms + size, p->terms);
+        p->rep = 1;
+        p->toNextSpan = DefaultToNextSpan;
+        p->window = window;
+        p->ordered = ordered;
+        p->rewrite_ctx.range.reset();
+        p->rewrite_ctx.srcSeqSize = 0;
+        p->rewrite_ctx.translationCoefficient = 1.0;
+        p->flags = 0;
+        p->inputRange = range;
+        res->p = p;
+        return res;
+}
+
+// [apple NEAR/2 iphone NEAR/2 case] => a proximity phrase; see phrase::window
+// Only tokens can be operands of those operators; for anything else, e.g [apple NEAR/2 "iphone case"], the operator is treated as AND
+//
+// A proximity phrase has a single window, so a chain of operators with different k or of both NEAR and ONEAR is
+// split into runs of the same operator and k, and their proximity phrases share the token at their boundary, e.g
+// [a NEAR/2 b ONEAR/4 c] => [(a NEAR/2 b) AND (b ONEAR/4 c)]
+static ast_node *parse_proximity(ast_parser &ctx, ast_node *const n)
+{
+        term terms[Limits::MaxPhraseSize]; // parse_phrase_or_token() uses ctx.terms
+        term last;
+        range_base<uint16_t, uint16_t> range, lastRange;
+        uint8_t size{1};
+        uint16_t window{0};
+        bool ordered{true};
+        ast_node *res{nullptr}, *rest{nullptr};
+        const auto conjunction = [&ctx](ast_node *const lhs, ast_node *const rhs) {
+                if (!lhs)
+                        return rhs;
+
+                auto b = ctx.alloc_node(ast_node::Type::BinOp);
+
+                b->binop.op = Operator::AND;
+                b->binop.lhs = lhs;
+                b->binop.rhs = rhs;
+                return b;
+        };
+
+        if (n->type != ast_node::Type::Token)
+                return n;
+
+        terms[0] = n->p->terms[0];
+        range = n->p->inputRange;
+
+        for (bool o; const auto k = parse_proximity_operator(ctx, &o);)
+        {
+                auto e = parse_phrase_or_token(ctx);
+
+                if (!e)
+                        break;
+                else if (e->type != ast_node::Type::Token)
+                {
+                        rest = e;
+                        break;
+                }
+
+                if (window && (k != window || o != ordered))
+                {
+                        // begin a new run from the last token
+                        res = conjunction(res, proximity_phrase(ctx, terms, size, window, ordered, range));
+                        terms[0] = last;
+                        size = 1;
+                        range = lastRange;
+                }
+
+                window = k;
+                ordered = o;
+                last = e->p->terms[0];
+                lastRange = e->p->inputRange;
+                range.len = lastRange.offset + lastRange.len - range.offset;
+
+                if (size != sizeof_array(terms))
+                {
+                        // silently ignore the rest, same as for phrases
+                        terms[size++] = last;
+                }
+        }
+
+        res = conjunction(res, size == 1 ? n : proximity_phrase(ctx, terms, size, window, ordered, range));
+        return rest ? conjunction(res, rest) : res;
+}
+
 // define for more verbose representation of binops
 //#define _VERBOSE_DESCR 1
 
@@ -263,14 +422,37 @@ static void PrintImpl(Buffer &b, const Operator op)
         }
 }
 
+// Terms of fields(see field_term()) are printed as #field:term
+static void print_term(Buffer &b, const str8_t token)
+{
+        if (const auto field = term_field(token))
+                b.append('#', uint32_t(field), ':');
+        b.append(term_token(token));
+}
+
 void PrintImpl(Buffer &b, const Trinity::phrase &p)
 {
-        b.append('"');
-        for (uint32_t i{0}; i != p.size; ++i)
-                b.append(p.terms[i].token, ' ');
-        if (p.size)
-                b.shrink_by(1);
-        b.append('"');
+        if (p.window)
+        {
+                for (uint32_t i{0}; i != p.size; ++i)
+                {
+                        if (i)
+                                b.append(p.ordered ? " ONEAR/"_s8 : " NEAR/"_s8, p.window, ' ');
+                        print_term(b, p.terms[i].token);
+                }
+        }
+        else
+        {
+                b.append('"');
+                for (uint32_t i{0}; i != p.size; ++i)
+                {
+                        print_term(b, p.terms[i].token);
+                        b.append(' ');
+                }
+                if (p.size)
+                        b.shrink_by(1);
+                b.append('"');
+        }
 #if defined(_VERBOSE_DESCR)
         b.append('<');
         b.append("idx:", p.index, " span:", p.toNextSpan);
@@ -293,7 +475,7 @@ void PrintImpl(Buffer &b, const Trinity::phrase &p)
 
 static void print_token(Buffer &b, const phrase *const p)
 {
-        b.append(p->terms[0].token);
+        print_term(b, p->terms[0].token);
 #if defined(_VERBOSE_DESCR)
         b.append('<');
         b.append("idx:", p->index, " span:", p->toNextSpan);
@@ -439,7 +621,7 @@ static ast_node *parse_unary(ast_parser &ctx)
                         ctx.content.strip_prefix(r.second);
                         ctx.skip_ws();
 
-                        auto exprNode = parse_phrase_or_token(ctx) ?: ctx.parse_failnode();
+                        auto exprNode = parse_proximity(ctx, parse_phrase_or_token(ctx) ?: ctx.parse_failnode());
                         auto n = ctx.alloc_node(ast_node::Type::UnaryOp);
 
                         n->unaryop.op = r.first;
@@ -447,7 +629,7 @@ static ast_node *parse_unary(ast_parser &ctx)
                         return n;
                 }
                 else if (const auto n = parse_phrase_or_token(ctx))
-                        return n;
+                        return parse_proximity(ctx, n);
                 else
                         return ctx.parse_failnode();
         }
@@ -1325,6 +1507,8 @@ ast_node *ast_node::copy(simple_allocator *const a)
                         np->rep = n->p->rep;
                         np->index = n->p->index;
                         np->toNextSpan = n->p->toNextSpan;
+                        np->window = n->p->window;
+                        np->ordered = n->p->ordered;
                         np->flags = n->p->flags;
                         np->inputRange = n->p->inputRange;
                         np->rewrite_ctx.range = n->p->rewrite_ctx.range;
@@ -1726,9 +1910,9 @@ std::vector<ast_node *> &query::nodes(ast_node *root, std::vector<ast_node *> *c
         return *res;
 }
 
-bool query::parse(const str32_t in, std::pair<uint32_t, uint8_t> (*tp)(const str32_t, char_t *, const bool), const uint32_t parseFlags)
+bool query::parse(const str32_t in, std::pair<uint32_t, uint8_t> (*tp)(const str32_t, char_t *, const bool), const uint32_t parseFlags, const query_fields *fields)
 {
-        ast_parser ctx{in, allocator, tp, parseFlags};
+        ast_parser ctx{in, allocator, tp, parseFlags, fields};
 
         tokensParser = tp; // May come in handy later
         root = parse_expr(ctx);
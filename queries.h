@@ -4,6 +4,7 @@
 #include <switch_mallocators.h>
 #include <switch_vector.h>
 #include <text.h>
+#include <unordered_map>
 
 namespace Trinity
 {
@@ -180,6 +181,9 @@ namespace Trinity
                 str8_t token;
         };
 
+        // Maps field names to field IDs, so that queries can be restricted to fields, e.g [title:apple body:"iphone case"]; see ast_parser::fields
+        using query_fields = std::unordered_map<str8_t, field_id_t>;
+
         // This is an AST parser
         //
         // Encapsulates the input query(text) to be parsed,
@@ -201,7 +205,9 @@ namespace Trinity
 			// Treat NOT as a regular token
 			NOTAsToken = 1<<1,
 			// Treat AND as a regular token
-			ANDAsToken = 1<<2
+			ANDAsToken = 1<<2,
+			// Treat NEAR/k and ONEAR/k as regular tokens
+			NEARAsToken = 1<<3
 		};
 
                 str32_t content;
@@ -211,6 +217,9 @@ namespace Trinity
                 // It is important that your queries token parser semantics are also implemented in your documents content parser
                 std::pair<uint32_t, uint8_t> (*token_parser)(const str32_t, char_t *, const bool);
 		const uint32_t parserFlags;
+		// If set, [field:token] and [field:"phrase"], for any field in fields, are restricted to that field; their terms are
+		// parsed into (field, term) terms(see field_term()), which only match hits indexed for the field(see SegmentIndexSession::document_proxy::insert())
+		const query_fields *const fields;
                 std::vector<str8_t> distinctTokens;
                 // facilitates parsing
                 std::vector<char_t> groupTerm;
@@ -221,8 +230,8 @@ namespace Trinity
                         return ast_node::make(allocator, t);
                 }
 
-                ast_parser(const str32_t input, simple_allocator &a, std::pair<uint32_t, uint8_t> (*p)(const str32_t, char_t *, const bool) = default_token_parser_impl, const uint32_t parserFlags_ = 0)
-                    : content{input}, contentBase{content.data()}, allocator{a}, token_parser{p}, parserFlags{parserFlags_}
+                ast_parser(const str32_t input, simple_allocator &a, std::pair<uint32_t, uint8_t> (*p)(const str32_t, char_t *, const bool) = default_token_parser_impl, const uint32_t parserFlags_ = 0, const query_fields *const fields_ = nullptr)
+                    : content{input}, contentBase{content.data()}, allocator{a}, token_parser{p}, parserFlags{parserFlags_}, fields{fields_}
                 {
                 }
 
@@ -310,6 +319,15 @@ namespace Trinity
                 // and you 'd rather not have to go through hoops to accomplish it
                 range_base<uint16_t, uint16_t> inputRange;
 
+                // 0 for exact phrases. For proximity phrases, e.g [apple NEAR/3 iphone] or [apple ONEAR/3 iphone], this is k
+                //
+                // The terms of a proximity phrase must all be found in a document within a span of (size + window - 1) positions, i.e
+                // for 2 terms, at most `window` positions apart. If `ordered` is set(ONEAR), they must also be found in the phrase order.
+                // A chain of such operators with the same k, e.g [a NEAR/2 b NEAR/2 c], is parsed into a single proximity phrase. A chain of different
+                // operators or k, e.g [a NEAR/2 b ONEAR/4 c], is parsed into a conjunction of proximity phrases, one for each run of the same operator and k.
+                uint16_t window;
+                bool ordered;
+
 		struct
                 {
                         // A range, which represents the logical span in the input query terms list that was expanded/rewritten/captured.
@@ -341,7 +359,7 @@ namespace Trinity
 
                 bool operator==(const phrase &o) const noexcept
                 {
-                        if (size == o.size)
+                        if (size == o.size && window == o.window && ordered == o.ordered)
                         {
                                 uint8_t i;
 
@@ -363,6 +381,8 @@ namespace Trinity
                         p->rep = 1;
                         p->inputRange.reset();
                         p->toNextSpan = DefaultToNextSpan;
+                        p->window = 0;
+                        p->ordered = false;
 			p->rewrite_ctx.range.reset();
 			p->rewrite_ctx.srcSeqSize = 1;
 			p->rewrite_ctx.translationCoefficient = 1.0;
@@ -417,7 +437,8 @@ namespace Trinity
 		 */
                 void leader_nodes(std::vector<ast_node *> *const out);
 
-                bool parse(const str32_t in, std::pair<uint32_t, uint8_t> (*tp)(const str32_t, char_t *, const bool) = default_token_parser_impl, uint32_t parserFlags = 0);
+                // See ast_parser::fields for `fields`
+                bool parse(const str32_t in, std::pair<uint32_t, uint8_t> (*tp)(const str32_t, char_t *, const bool) = default_token_parser_impl, uint32_t parserFlags = 0, const query_fields *fields = nullptr);
 
                 // This is handy. When we copy a query to another query, we want to make sure
                 // that tokens point to the destination query allocator, not the source, because it is possible for
@@ -435,10 +456,10 @@ namespace Trinity
                         return root;
                 }
 
-                query(const str32_t in, std::pair<uint32_t, uint8_t> (*tp)(const str32_t, char_t *, const bool) = default_token_parser_impl, const uint32_t parserFlags = 0)
+                query(const str32_t in, std::pair<uint32_t, uint8_t> (*tp)(const str32_t, char_t *, const bool) = default_token_parser_impl, const uint32_t parserFlags = 0, const query_fields *fields = nullptr)
                     : tokensParser{tp}
                 {
-                        if (!parse(in, tp, parserFlags))
+                        if (!parse(in, tp, parserFlags, fields))
                                 throw Switch::data_error("Failed to parse query");
                 }
 
@@ -1,9 +1,78 @@
 #include "segment_index_source.h"
 #include "google_codec.h"
 #include "lucene_codec.h"
+#include <atomic>
+#include <thread>
 
-Trinity::SegmentIndexSource::SegmentIndexSource(const char *basePath)
+namespace // static/local this module
 {
+        using region_t = range_base<const uint8_t *, size_t>;
+
+        static const size_t page_size = sysconf(_SC_PAGESIZE);
+
+        // regions must be page aligned for madvise(), mlock() and mincore()
+        static inline region_t page_aligned(const region_t r)
+        {
+                const auto start = uintptr_t(r.offset) & ~(page_size - 1);
+                const auto end = uintptr_t(r.offset) + r.size();
+
+                return {reinterpret_cast<const uint8_t *>(start), size_t(end - start)};
+        }
+
+        static void warmup_region(region_t r, const Trinity::segment_warmup_options &opts)
+        {
+                if (!r.size())
+                        return;
+                else if (opts.maxBytes && r.size() > opts.maxBytes)
+                        r.len = opts.maxBytes;
+
+                r = page_aligned(r);
+
+                auto ptr = const_cast<uint8_t *>(r.offset);
+
+#ifdef MADV_HUGEPAGE
+                if (opts.hugePages)
+                        madvise(ptr, r.size(), MADV_HUGEPAGE);
+#endif
+
+                madvise(ptr, r.size(), MADV_WILLNEED);
+
+                if (opts.pretouch)
+                {
+                        uint8_t v{0};
+
+                        for (const auto *p = r.offset, *const e = p + r.size(); p < e; p += page_size)
+                                v ^= *reinterpret_cast<const volatile uint8_t *>(p);
+
+                        // so that the reads won't be optimised away
+                        asm volatile(""
+                                     :
+                                     : "r"(v));
+                }
+        }
+
+        static void region_residency(const region_t r, Trinity::segment_region_residency *const res)
+        {
+                if (!r.size())
+                        return;
+
+                const auto ar = page_aligned(r);
+                const auto pages = (ar.size() + page_size - 1) / page_size;
+                std::unique_ptr<unsigned char[]> vec(new unsigned char[pages]);
+
+                if (mincore(const_cast<uint8_t *>(ar.offset), ar.size(), vec.get()) == -1)
+                        throw Switch::system_error("mincore() failed");
+
+                for (size_t i{0}; i != pages; ++i)
+                        res->resident += vec[i] & 1;
+
+                res->total += pages;
+        }
+}
+
+Trinity::SegmentIndexSource::SegmentIndexSource(const char *basePath, BlockCache *blockCache)
+{
+        const auto before = Timings::Microseconds::Tick();
         int fd;
         char path[PATH_MAX];
 	strwlen32_t bp(basePath);
@@ -34,12 +103,134 @@ Trinity::SegmentIndexSource::SegmentIndexSource(const char *basePath)
 		if (unlikely(fileData == MAP_FAILED))
 			throw Switch::data_error("Failed to access ", path, ":" , strerror(errno));
 			
+                // unpack_updates() only reads the trailer; the containers are accessed in place, so there is nothing to parse or defer here
+                // besides the mmap(), which open_segments() runs in parallel along with the rest of the constructor
                 maskedDocuments.fileData.Set((uint8_t *)fileData, fileSize);
                 new (&maskedDocuments.set) updated_documents(unpack_updates(maskedDocuments.fileData));
         }
         else
                 close(fd);
 
+        // segments created before we tracked that won't have this file
+        snprintf(path, sizeof(path), "%s/documents", basePath);
+        fd = open(path, O_RDONLY | O_LARGEFILE);
+
+        if (fd == -1)
+        {
+                if (errno != ENOENT)
+                        throw Switch::system_error("open() failed for documents");
+        }
+        else
+        {
+                const auto res = pread64(fd, &documentsCnt, sizeof(documentsCnt), 0);
+
+                close(fd);
+                if (res != sizeof(documentsCnt))
+                        throw Switch::data_error("Failed to access ", path);
+        }
+
+        // segments created before we tracked that won't have this file, and neither will segments without positions
+        snprintf(path, sizeof(path), "%s/max_position", basePath);
+        fd = open(path, O_RDONLY | O_LARGEFILE);
+
+        if (fd == -1)
+        {
+                if (errno != ENOENT)
+                        throw Switch::system_error("open() failed for max_position");
+        }
+        else
+        {
+                const auto res = pread64(fd, &maxPosition, sizeof(maxPosition), 0);
+
+                close(fd);
+                if (res != sizeof(maxPosition) || maxPosition > Limits::MaxPosition)
+                        throw Switch::data_error("Failed to access ", path);
+        }
+
+        // only if the segment was built with dense(segment-local) document IDs, or its document IDs were remapped by a merge
+        snprintf(path, sizeof(path), "%s/globalids", basePath);
+        fd = open(path, O_RDONLY | O_LARGEFILE);
+
+        if (fd == -1)
+        {
+                if (errno != ENOENT)
+                        throw Switch::system_error("open() failed for globalids");
+        }
+        else if (const auto fileSize = lseek64(fd, 0, SEEK_END))
+        {
+                auto fileData = mmap(nullptr, fileSize, PROT_READ, MAP_SHARED, fd, 0);
+
+                close(fd);
+                if (unlikely(fileData == MAP_FAILED))
+                        throw Switch::data_error("Failed to access ", path, ":", strerror(errno));
+
+                globalIDsData.Set(static_cast<const uint8_t *>(fileData), fileSize);
+                globalDocIDs = reinterpret_cast<const docid_t *>(fileData);
+                globalDocIDsAscending = std::is_sorted(globalDocIDs, globalDocIDs + fileSize / sizeof(docid_t));
+        }
+        else
+                close(fd);
+
+        // only if documents were indexed with fields; see SegmentIndexSession::document_proxy::insert()
+        snprintf(path, sizeof(path), "%s/norms", basePath);
+        fd = open(path, O_RDONLY | O_LARGEFILE);
+
+        if (fd == -1)
+        {
+                if (errno != ENOENT)
+                        throw Switch::system_error("open() failed for norms");
+        }
+        else if (const auto fileSize = lseek64(fd, 0, SEEK_END))
+        {
+                auto fileData = mmap(nullptr, fileSize, PROT_READ, MAP_SHARED, fd, 0);
+
+                close(fd);
+                if (unlikely(fileData == MAP_FAILED))
+                        throw Switch::data_error("Failed to access ", path, ":", strerror(errno));
+                else if (unlikely(fileSize % sizeof(field_norm)))
+                {
+                        munmap(fileData, fileSize);
+                        throw Switch::data_error("Invalid norms file ", path);
+                }
+
+                norms.Set(static_cast<const field_norm *>(fileData), fileSize / sizeof(field_norm));
+        }
+        else
+                close(fd);
+
+        // only if the segment was built with common grams, see SegmentIndexSession::set_common_grams()
+        snprintf(path, sizeof(path), "%s/commongrams", basePath);
+        fd = open(path, O_RDONLY | O_LARGEFILE);
+
+        if (fd == -1)
+        {
+                if (errno != ENOENT)
+                        throw Switch::system_error("open() failed for commongrams");
+        }
+        else if (const auto fileSize = lseek64(fd, 0, SEEK_END))
+        {
+                commonGramsData.reset(new char_t[fileSize]);
+
+                const auto res = pread64(fd, commonGramsData.get(), fileSize, 0);
+
+                close(fd);
+                if (res != fileSize)
+                        throw Switch::data_error("Failed to access ", path);
+
+                for (const auto *p = commonGramsData.get(), *const e = p + fileSize; p != e;)
+                {
+                        const auto len = uint8_t(*p++);
+
+                        if (unlikely(!len || len > e - p))
+                                throw Switch::data_error("Invalid common grams file");
+
+                        commonGrams.push_back({p, len});
+                        p += len;
+                }
+        }
+        else
+                close(fd);
+
         terms.reset(new SegmentTerms(basePath));
 
         snprintf(path, sizeof(path), "%s/index", basePath);
@@ -118,4 +309,220 @@ Trinity::SegmentIndexSource::SegmentIndexSource(const char *basePath)
                 accessProxy.reset(new Trinity::Codecs::Lucene::AccessProxy(basePath, index.start()));
         else
                 throw Switch::data_error("Unknown codec");
+
+#ifndef TRINITY_MEMRESIDENT_INDEX
+        if (blockCache && index.size())
+        {
+                snprintf(path, sizeof(path), "%s/index", basePath);
+                fd = open(path, O_RDONLY | O_LARGEFILE);
+                if (unlikely(fd == -1))
+                        throw Switch::system_error("Failed to access ", path);
+
+                accessProxy->use_block_cache(blockCache, fd);
+        }
+#endif
+
+        openDuration = Timings::Microseconds::Since(before);
+}
+
+uint32_t Trinity::SegmentIndexSource::field_length(const docid_t documentID, const field_id_t field) const
+{
+        const field_norm k{documentID, 0, field};
+        const auto *const end = norms.offset + norms.size();
+        const auto it = std::lower_bound(norms.offset, end, k);
+
+        return it != end && it->documentID == documentID && it->field == field ? it->length : 0;
+}
+
+bool Trinity::SegmentIndexSource::indexes_bigram(const str8_t first, const str8_t second) const
+{
+        char_t buf[Limits::MaxTermLength];
+        const auto bigram = bigram_term(first, second, buf);
+
+        if (!bigram || commonGrams.empty())
+                return false;
+
+        return std::binary_search(commonGrams.begin(), commonGrams.end(), bigram, [](const auto &a, const auto &b) noexcept {
+                return terms_cmp(a.data(), a.size(), b.data(), b.size()) < 0;
+        });
+}
+
+std::vector<Trinity::segment_open_result> Trinity::open_segments(const std::vector<const char *> &basePaths, uint32_t concurrency, BlockCache *blockCache)
+{
+        const auto n = basePaths.size();
+        std::vector<segment_open_result> res(n, {nullptr, 0});
+        std::atomic<size_t> next{0};
+        std::exception_ptr failure;
+        std::mutex failureLock;
+        std::vector<std::thread> workers;
+
+        if (!concurrency)
+                concurrency = std::max<uint32_t>(1, std::thread::hardware_concurrency());
+
+        // segments are independent of each other; each worker just grabs the next segment to open
+        const auto work = [&]() {
+                for (size_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) < n;)
+                {
+                        try
+                        {
+                                auto s = new SegmentIndexSource(basePaths[i], blockCache);
+
+                                res[i] = {s, s->open_duration()};
+                        }
+                        catch (...)
+                        {
+                                std::lock_guard<std::mutex> g(failureLock);
+
+                                if (!failure)
+                                        failure = std::current_exception();
+
+                                // no need to open any more segments
+                                next.store(n, std::memory_order_relaxed);
+                        }
+                }
+        };
+
+        for (uint32_t i{1}; i < concurrency && i < n; ++i)
+                workers.emplace_back(work);
+
+        work();
+
+        for (auto &t : workers)
+                t.join();
+
+        if (failure)
+        {
+                for (auto &it : res)
+                {
+                        if (it.source)
+                                it.source->Release();
+                }
+
+                std::rethrow_exception(failure);
+        }
+
+        return res;
+}
+
+void Trinity::SegmentIndexSource::warmup(const segment_warmup_options &opts)
+{
+        if (opts.regions & SegmentRegions::Index)
+                warmup_region({index.offset, index.size()}, opts);
+
+        if (opts.regions & SegmentRegions::TermsData)
+        {
+                const auto td = terms->terms_data();
+
+                warmup_region({td.offset, td.size()}, opts);
+        }
+
+        if ((opts.regions & SegmentRegions::CodecData) && accessProxy)
+        {
+                std::vector<region_t> regions;
+
+                accessProxy->data_regions(&regions);
+                for (const auto r : regions)
+                        warmup_region(r, opts);
+        }
+
+        if (opts.lockTerms)
+        {
+                std::vector<region_t> regions;
+
+                std::lock_guard<std::mutex> g(lockedRegionsLock);
+
+                terms->index_regions(&regions);
+                unlock_regions(lockedTerms);
+                for (const auto r : regions)
+                {
+                        const auto ar = page_aligned(r);
+
+                        if (mlock(ar.offset, ar.size()) == -1)
+                        {
+                                unlock_regions(lockedTerms);
+                                throw Switch::system_error("mlock() failed for terms skiplist");
+                        }
+
+                        lockedTerms.push_back(ar);
+                }
+        }
+}
+
+void Trinity::SegmentIndexSource::unlock_regions(std::vector<region_t> &regions)
+{
+        for (const auto r : regions)
+                munlock(r.offset, r.size());
+
+        regions.clear();
+}
+
+void Trinity::SegmentIndexSource::unlock_postings()
+{
+        std::lock_guard<std::mutex> g(lockedRegionsLock);
+
+        unlock_regions(lockedPostings);
+}
+
+size_t Trinity::SegmentIndexSource::lock_postings(const std::vector<str8_t> &termsList)
+{
+        std::vector<region_t> regions;
+        size_t locked{0};
+
+        if (!accessProxy)
+                return 0;
+
+        for (const auto term : termsList)
+        {
+                const auto tctx = term_ctx(term);
+
+                if (tctx.documents)
+                        accessProxy->term_data_regions(tctx, &regions);
+        }
+
+        std::lock_guard<std::mutex> g(lockedRegionsLock);
+        const auto base = lockedPostings.size();
+
+        for (const auto r : regions)
+        {
+                if (!r.size())
+                        continue;
+
+                const auto ar = page_aligned(r);
+
+                if (mlock(ar.offset, ar.size()) == -1)
+                {
+                        // undo this call's locks; regions locked by earlier calls may overlap, so we re-lock those
+                        std::vector<region_t> undo(lockedPostings.begin() + base, lockedPostings.end());
+
+                        lockedPostings.resize(base);
+                        unlock_regions(undo);
+                        for (const auto it : lockedPostings)
+                                mlock(it.offset, it.size());
+
+                        throw Switch::system_error("mlock() failed for postings");
+                }
+
+                lockedPostings.push_back(ar);
+                locked += ar.size();
+        }
+
+        return locked;
+}
+
+Trinity::segment_residency Trinity::SegmentIndexSource::residency()
+{
+        segment_residency res{};
+        std::vector<region_t> regions;
+        const auto td = terms->terms_data();
+
+        region_residency({index.offset, index.size()}, &res.index);
+        region_residency({td.offset, td.size()}, &res.termsData);
+
+        if (accessProxy)
+                accessProxy->data_regions(&regions);
+
+        for (const auto r : regions)
+                region_residency(r, &res.codecData);
+
+        return res;
 }
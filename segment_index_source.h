@@ -5,6 +5,54 @@
 
 namespace Trinity
 {
+	// Memory regions of a segment; see SegmentIndexSource::warmup() and SegmentIndexSource::residency()
+	enum class SegmentRegions : uint8_t
+	{
+		Index = 1,     // index (posting lists)
+		TermsData = 2, // terms dictionary
+		CodecData = 4, // codec specific files(e.g lucene's hits.data)
+		All = Index | TermsData | CodecData
+	};
+
+	inline SegmentRegions operator|(const SegmentRegions a, const SegmentRegions b)
+	{
+		return SegmentRegions(uint8_t(a) | uint8_t(b));
+	}
+
+	inline bool operator&(const SegmentRegions a, const SegmentRegions b)
+	{
+		return uint8_t(a) & uint8_t(b);
+	}
+
+	struct segment_warmup_options final
+	{
+		SegmentRegions regions{SegmentRegions::All};
+		// By default, we only advise the kernel that we will need the data(MADV_WILLNEED), and readahead happens asynchronously.
+		// If set, we will also touch every page so that all data will be resident by the time warmup() returns
+		bool pretouch{false};
+		// If not 0, only upto that many bytes from the beginning of each region are warmed up
+		size_t maxBytes{0};
+		// Request transparent huge pages for the mapped regions(MADV_HUGEPAGE), where supported.
+		// Most kernels only support that for anonymous memory(i.e TRINITY_MEMRESIDENT_INDEX), so failures are ignored
+		bool hugePages{false};
+		// mlock() the terms skiplist, so that terms lookups never fault
+		// It is munlock()ed when the segment is destroyed
+		bool lockTerms{false};
+	};
+
+	struct segment_region_residency final
+	{
+		size_t resident; // in pages
+		size_t total;    // in pages
+	};
+
+	struct segment_residency final
+	{
+		segment_region_residency index;
+		segment_region_residency termsData;
+		segment_region_residency codecData;
+	};
+
 	// You can use SegmentIndexSession to create a new segment
 	// This is a utility class
         class SegmentIndexSource final
@@ -14,6 +62,18 @@ namespace Trinity
                 std::unique_ptr<Trinity::Codecs::AccessProxy> accessProxy;
 		std::unique_ptr<SegmentTerms> terms; // all terms for this segment
 		range_base<const uint8_t *, uint32_t> index;
+		uint64_t openDuration{0}; // in microseconds
+		uint64_t documentsCnt{0}; // see SegmentIndexSession::commit()
+		tokenpos_t maxPosition{0}; // see SegmentIndexSession::commit()
+		range_base<const uint8_t *, size_t> globalIDsData; // see SegmentIndexSession::set_dense_document_ids()
+		range_base<const field_norm *, size_t> norms; // sorted by (document, field); see field_length()
+		// bigram terms indexed in this segment, sorted; see SegmentIndexSession::set_common_grams()
+		std::unique_ptr<char_t[]> commonGramsData;
+		std::vector<str8_t> commonGrams;
+		// mlock()ed regions(page aligned); see warmup() and lock_postings()
+		std::mutex lockedRegionsLock;
+		std::vector<range_base<const uint8_t *, size_t>> lockedTerms;
+		std::vector<range_base<const uint8_t *, size_t>> lockedPostings;
 
                 struct masked_documents_struct final
                 {
@@ -32,8 +92,13 @@ namespace Trinity
 			}
                 } maskedDocuments;
 
+              private:
+		static void unlock_regions(std::vector<range_base<const uint8_t *, size_t>> &regions);
+
               public:
-                SegmentIndexSource(const char *basePath);
+                // If `blockCache` is provided, the postings will be read into it via pread() when accessed by queries, instead of
+                // being accessed via the memory mapped index (see BlockCache)
+                SegmentIndexSource(const char *basePath, BlockCache *blockCache = nullptr);
 
 		bool index_empty() const noexcept override final
 		{
@@ -55,11 +120,61 @@ namespace Trinity
 			return terms.get();
 		}
 
+		// How long it took to open this segment(construct this source), in microseconds
+		// The terms skiplist is materialized lazily, so this doesn't account for that; see SegmentTerms
+		auto open_duration() const noexcept
+		{
+			return openDuration;
+		}
+
                 Trinity::Codecs::Decoder *new_postings_decoder(const strwlen8_t, const term_index_ctx ctx) override final
                 {
                         return accessProxy->new_decoder(ctx);
                 }
 
+		uint64_t total_documents() const noexcept override final
+		{
+			return documentsCnt;
+		}
+
+		// The highest position indexed in this segment, so that segments of short documents get a small(dense) DocWordsSpace
+		// Segments created before we tracked that use the IndexSource default
+		tokenpos_t max_indexed_position() const override final
+		{
+			return maxPosition ?: IndexSource::max_indexed_position();
+		}
+
+		bool indexes_bigram(const str8_t first, const str8_t second) const override final;
+
+		uint32_t field_length(const docid_t documentID, const field_id_t field) const override final;
+
+		auto field_norms() const noexcept
+		{
+			return norms;
+		}
+
+		const auto &common_grams() const noexcept
+		{
+			return commonGrams;
+		}
+
+		// Segments are memory mapped, so the first queries that access a segment will likely take major page faults.
+		// You can warm up a segment before you make it available to queries(e.g after a merge), so that they won't.
+		void warmup(const segment_warmup_options &opts = {});
+
+		// mlock()s the postings of all `terms`(e.g the most frequently queried terms), so that they will never be paged out
+		// Returns the number of bytes locked.
+		// This is subject to RLIMIT_MEMLOCK; throws Switch::system_error if mlock() fails, in which case nothing is locked by this call
+		//
+		// Locks don't nest; unlock_postings() unlocks the postings locked by all calls, e.g so that you can lock a different set of terms.
+		size_t lock_postings(const std::vector<str8_t> &terms);
+
+		// munlock()s all postings locked via lock_postings()
+		void unlock_postings();
+
+		// Reports how many pages of each region are resident in memory (via mincore())
+		segment_residency residency();
+
                 updated_documents masked_documents() override final
                 {
                         return maskedDocuments.set;
@@ -67,6 +182,16 @@ namespace Trinity
 
                 ~SegmentIndexSource()
 		{
+			// the terms skiplist is not memory mapped, so freeing it wouldn't unlock its pages
+			unlock_regions(lockedTerms);
+			unlock_regions(lockedPostings);
+
+			if (auto ptr = (void *)globalIDsData.offset)
+				munmap(ptr, globalIDsData.size());
+
+			if (auto ptr = (void *)norms.offset)
+				munmap(ptr, norms.size() * sizeof(field_norm));
+
 			if (auto ptr = (void *)index.offset)
 			{
 #ifdef TRINITY_MEMRESIDENT_INDEX
@@ -77,4 +202,19 @@ namespace Trinity
 			}
 		}
         };
+
+	struct segment_open_result final
+	{
+		SegmentIndexSource *source;
+		uint64_t duration; // in microseconds; see SegmentIndexSource::open_duration()
+	};
+
+	// Opens all segments in `basePaths` concurrently, using upto `concurrency` threads (0 for std::thread::hardware_concurrency())
+	// and returns a segment_open_result for each of them, in the same order as in `basePaths`.
+	// You own the returned sources; Release() them when you no longer need them (e.g after you have inserted them into an IndexSourcesCollection)
+	//
+	// If any of the segments fails to open, all sources opened are released and the first exception raised is rethrown.
+	//
+	// Each segment's masked documents(updated_documents.ids) are loaded by its constructor, so they are loaded concurrently too.
+	std::vector<segment_open_result> open_segments(const std::vector<const char *> &basePaths, uint32_t concurrency = 0, BlockCache *blockCache = nullptr);
 }
@@ -1,10 +1,61 @@
 #include "terms.h"
+#include "utils.h"
 #include <compress.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <text.h>
 #include <fcntl.h>
 
+using namespace Trinity;
+
+// Scans the terms data block that begins at `blockOffset` for `q`
+// `blockTerm` is the term of the skiplist entry for that block
+static Trinity::term_index_ctx lookup_term_in_block(range_base<const uint8_t *, uint32_t> termsData, const str8_t q, const uint32_t blockOffset, const str8_t blockTerm)
+{
+	char_t termStorage[Limits::MaxTermLength];
+
+	Dexpect(blockTerm.size() <= sizeof_array(termStorage));
+        memcpy(termStorage, blockTerm.data(), blockTerm.size() * sizeof(char_t));
+
+        for (const auto *p = termsData.offset + blockOffset, *const e = termsData.offset + termsData.size(); p != e;)
+        {
+                const auto commonPrefixLen = *p++;
+                const auto suffixLen = *p++;
+
+		Dexpect(commonPrefixLen + suffixLen <= sizeof_array(termStorage));
+
+                memcpy(termStorage + commonPrefixLen * sizeof(char_t), p, suffixLen * sizeof(char_t));
+                p += suffixLen * sizeof(char_t);
+
+                const auto curTermLen = commonPrefixLen + suffixLen;
+                const auto r = terms_cmp(q.data(), q.size(), termStorage, curTermLen);
+
+                if (r < 0)
+                {
+                        // definitely not here
+                        break;
+                }
+                else if (r == 0)
+                {
+                        term_index_ctx tctx;
+
+                        tctx.documents = Compression::decode_varuint32(p);
+                        tctx.indexChunk.len = Compression::decode_varuint32(p);
+                        tctx.indexChunk.offset = *(uint32_t *)p;
+
+                        return tctx;
+                }
+                else
+                {
+                        Compression::decode_varuint32(p);
+                        Compression::decode_varuint32(p);
+                        p += sizeof(uint32_t);
+                }
+        }
+
+        return {};
+}
+
 Trinity::term_index_ctx Trinity::lookup_term(range_base<const uint8_t *, uint32_t> termsData, const str8_t q, const std::vector<Trinity::terms_skiplist_entry> &skipList)
 {
         int32_t top{int32_t(skipList.size()) - 1};
@@ -26,7 +77,7 @@ Trinity::term_index_ctx Trinity::lookup_term(range_base<const uint8_t *, uint32_
                         return t->tctx;
 #else
 			top = mid;
-			goto l100;
+			break;
 #endif
                 }
                 else if (terms_cmp(q.data(), q.size(), t->term.data(), t->term.size()) < 0)
@@ -38,52 +89,117 @@ Trinity::term_index_ctx Trinity::lookup_term(range_base<const uint8_t *, uint32_
         if (top == -1)
                 return {};
 
-l100:
         const auto &it = skipList[top];
-        const auto o = it.blockOffset;
-        auto prev = it.term;
-	char_t termStorage[Limits::MaxTermLength];
 
-	Dexpect(prev.size() <= sizeof_array(termStorage));
-        memcpy(termStorage, prev.data(), prev.size() * sizeof(char_t));
+        return lookup_term_in_block(termsData, q, it.blockOffset, it.term);
+}
+
+Trinity::term_index_ctx Trinity::lookup_term(range_base<const uint8_t *, uint32_t> termsData, const str8_t q, const Trinity::terms_skiplist &skipList)
+{
+	expect(q.size() <= Limits::MaxTermLength);
 
-        for (const auto *p = termsData.offset + o, *const e = termsData.offset + termsData.size(); p != e;)
+        if (const auto it = skipList.search(q))
         {
-                const auto commonPrefixLen = *p++;
-                const auto suffixLen = *p++;
+                const auto blockTerm = skipList.term(*it);
 
-		Dexpect(commonPrefixLen + suffixLen <= sizeof_array(termStorage));
+#ifdef TRINITY_TERMS_FAT_INDEX
+                if (blockTerm == q)
+                {
+                        // found in the index/skiplist
+                        return it->tctx;
+                }
+#endif
 
-                memcpy(termStorage + commonPrefixLen * sizeof(char_t), p, suffixLen * sizeof(char_t));
-                p += suffixLen * sizeof(char_t);
+                return lookup_term_in_block(termsData, q, it->blockOffset, blockTerm);
+        }
+        else
+                return {};
+}
 
-                const auto curTermLen = commonPrefixLen + suffixLen;
-                const auto r = terms_cmp(q.data(), q.size(), termStorage, curTermLen);
+const Trinity::terms_skiplist::entry *Trinity::terms_skiplist::search(const str8_t q) const noexcept
+{
+        const auto key = key_prefix(q.data(), q.size());
+        const auto n = cnt;
+        const auto *const __restrict__ base = entries;
+        uint32_t k{1};
+
+        // Walk down the implicit tree; k's bits track the path taken (1 for right, 0 for left)
+        // We go right whenever the entry is lower or equal to q, so the last entry we went right from is the one we are looking for.
+        while (k <= n)
+        {
+                const auto &e = base[k];
 
-                if (r < 0)
+#if defined(TRINITY_ENABLE_PREFETCH)
+                // 4 entries/cache line; the descendants of k 4 levels down are [16k, 16k + 16)
+                _mm_prefetch(reinterpret_cast<const char *>(base + (k << 4)), _MM_HINT_T0);
+#endif
+
+                if (TermsCmpBytewise && e.prefix != key)
+                        k = (k << 1) | (e.prefix < key);
+                else
                 {
-                        // definitely not here
-                        break;
+                        const auto t = term(e);
+
+                        k = (k << 1) | (terms_cmp(t.data(), t.size(), q.data(), q.size()) <= 0);
                 }
-                else if (r == 0)
-                {
-                        term_index_ctx tctx;
+        }
 
-                        tctx.documents = Compression::decode_varuint32(p);
-                        tctx.indexChunk.len = Compression::decode_varuint32(p);
-                        tctx.indexChunk.offset = *(uint32_t *)p;
+        // Strip the trailing left turns, and the last right turn
+        k >>= __builtin_ffs(k);
+        return k ? base + k : nullptr;
+}
 
-                        return tctx;
-                }
-                else
+void Trinity::terms_skiplist::build(const range_base<const uint8_t *, uint32_t> termsIndex)
+{
+        std::vector<entry> sorted;
+
+        termsStorage.clear();
+        for (const auto *p = reinterpret_cast<const uint8_t *>(termsIndex.start()), *const e = p + termsIndex.size(); p != e;)
+        {
+                const str8_t term((char_t *)p + 1, *p);
+                entry t;
+
+                p += (term.size() * sizeof(char_t)) + sizeof(uint8_t);
+#ifdef TRINITY_TERMS_FAT_INDEX
                 {
-                        Compression::decode_varuint32(p);
-                        Compression::decode_varuint32(p);
+                        t.tctx.documents = Compression::decode_varuint32(p);
+                        t.tctx.indexChunk.len = Compression::decode_varuint32(p);
+                        t.tctx.indexChunk.offset = *(uint32_t *)p;
                         p += sizeof(uint32_t);
                 }
+#endif
+                t.blockOffset = Compression::decode_varuint32(p);
+                t.prefix = key_prefix(term.data(), term.size());
+                t.termOffset = termsStorage.size();
+
+                termsStorage.push_back(char_t(term.size()));
+                termsStorage.insert(termsStorage.end(), term.data(), term.data() + term.size());
+                sorted.push_back(t);
         }
 
-        return {};
+        std::free(entries);
+        entries = nullptr;
+        cnt = sorted.size();
+
+        if (!cnt)
+                return;
+
+        // 64 bytes aligned, so that entries[4k, 4k + 4) share a cache line
+        if (posix_memalign(reinterpret_cast<void **>(&entries), 64, sizeof(entry) * (cnt + 1)))
+                throw Switch::system_error("Failed to allocate memory for terms skiplist");
+
+        // in-order traversal of the implicit tree assigns the sorted entries
+        const auto fill = [this, all = sorted.data()](auto &&self, uint32_t i, const uint32_t k) -> uint32_t {
+                if (k <= cnt)
+                {
+                        i = self(self, i, k << 1);
+                        entries[k] = all[i++];
+                        i = self(self, i, (k << 1) | 1);
+                }
+                return i;
+        };
+
+        fill(fill, 0, 1);
 }
 
 void Trinity::unpack_terms_skiplist(const range_base<const uint8_t *, const uint32_t> termsIndex, std::vector<Trinity::terms_skiplist_entry> *skipList, simple_allocator &allocator)
@@ -109,9 +225,47 @@ void Trinity::unpack_terms_skiplist(const range_base<const uint8_t *, const uint
         }
 }
 
+// Packs `cur` into the terms data and index; `dataOffset` is the offset of data in the terms data file
+static void pack_term(const str8_t cur, const str8_t prev, const term_index_ctx &tctx, uint32_t &nextSkipListEntry, const uint32_t dataOffset, IOBuffer *const data, IOBuffer *const index)
+{
+        static constexpr uint32_t SKIPLIST_INTERVAL{64}; // 128 or 64 is more than fine
+
+        if (--nextSkipListEntry == 0)
+        {
+                // store (term, terms file offset, terminfo) in terms index
+                // skip that term, will be in the index
+                nextSkipListEntry = SKIPLIST_INTERVAL;
+
+                index->pack(uint8_t(cur.size()));
+                index->serialize(cur.data(), cur.size() * sizeof(char_t));
+#ifdef TRINITY_TERMS_FAT_INDEX
+                {
+                        index->encode_varuint32(tctx.documents);
+                        index->encode_varuint32(tctx.indexChunk.len);
+                        index->pack(tctx.indexChunk.offset);
+                }
+#endif
+                index->encode_varuint32(dataOffset + data->size()); // offset in the terms data file
+        }
+#ifdef TRINITY_TERMS_FAT_INDEX
+        else
+#endif
+        {
+                const auto commonPrefix = cur.CommonPrefixLen(prev);
+                const auto suffix = cur.SuffixFrom(commonPrefix);
+
+                data->pack(uint8_t(commonPrefix), uint8_t(suffix.size()));
+                data->serialize(suffix.data(), suffix.size() * sizeof(char_t));
+                {
+                        data->encode_varuint32(tctx.documents);
+                        data->encode_varuint32(tctx.indexChunk.len);
+                        data->pack(tctx.indexChunk.offset);
+                }
+        }
+}
+
 void Trinity::pack_terms(std::vector<std::pair<str8_t, term_index_ctx>> &terms, IOBuffer *const data, IOBuffer *const index)
 {
-        static constexpr uint32_t SKIPLIST_INTERVAL{64};	 // 128 or 64 is more than fine
         uint32_t nextSkipListEntry{1}; 	// so that we will output for the first term (required)
         str8_t prev;
 
@@ -121,46 +275,84 @@ void Trinity::pack_terms(std::vector<std::pair<str8_t, term_index_ctx>> &terms,
 
 	for (const auto &it : terms)
         {
-                const auto cur = it.first;
+                pack_term(it.first, prev, it.second, nextSkipListEntry, 0, data, index);
+                prev = it.first;
+        }
+}
 
-                if (--nextSkipListEntry == 0)
-                {
-                        // store (term, terms file offset, terminfo) in terms index
-                        // skip that term, will be in the index
-                        nextSkipListEntry = SKIPLIST_INTERVAL;
+Trinity::TermsWriter::TermsWriter(const char *basePath)
+{
+        dataPath.append(basePath, "/terms.data");
+        indexPath.append(basePath, "/terms.idx");
 
-                        index->pack(uint8_t(cur.size()));
-                        index->serialize(cur.data(), cur.size() * sizeof(char_t));
-#ifdef TRINITY_TERMS_FAT_INDEX
-                        {
-                                index->encode_varuint32(it.second.documents);
-                                index->encode_varuint32(it.second.indexChunk.len);
-                                index->pack(it.second.indexChunk.offset);
-                        }
-#endif
-                        index->encode_varuint32(data->size()); // offset in the terms data file
+        dataFd = open(dataPath.c_str(), O_WRONLY | O_CREAT | O_LARGEFILE | O_TRUNC, 0775);
+        if (dataFd == -1)
+                throw Switch::system_error("Failed to persist terms.data");
 
-                }
-#ifdef TRINITY_TERMS_FAT_INDEX
-                else
-#endif
-                {
-                        const auto commonPrefix = cur.CommonPrefixLen(prev);
-                        const auto suffix = cur.SuffixFrom(commonPrefix);
-
-                        data->pack(uint8_t(commonPrefix), uint8_t(suffix.size()));
-                        data->serialize(suffix.data(), suffix.size() * sizeof(char_t));
-                        {
-                                data->encode_varuint32(it.second.documents);
-                                data->encode_varuint32(it.second.indexChunk.len);
-                                data->pack(it.second.indexChunk.offset);
-                        }
-                }
+        indexFd = open(indexPath.c_str(), O_WRONLY | O_CREAT | O_LARGEFILE | O_TRUNC, 0775);
+        if (indexFd == -1)
+        {
+                close(dataFd);
+                throw Switch::system_error("Failed to persist terms.idx");
+        }
+}
+
+Trinity::TermsWriter::~TermsWriter()
+{
+        if (dataFd != -1)
+                close(dataFd);
+        if (indexFd != -1)
+                close(indexFd);
+}
 
-                prev = cur;
+void Trinity::TermsWriter::flush()
+{
+        if (data.size())
+        {
+                if (Utilities::to_file(data.data(), data.size(), dataFd) == -1)
+                        throw Switch::system_error("Failed to persist terms.data");
+
+                dataFlushed += data.size();
+                data.clear();
+        }
+
+        if (index.size())
+        {
+                if (Utilities::to_file(index.data(), index.size(), indexFd) == -1)
+                        throw Switch::system_error("Failed to persist terms.idx");
+
+                index.clear();
         }
 }
 
+void Trinity::TermsWriter::append(const str8_t term, const term_index_ctx tctx)
+{
+        const str8_t prev(prevStorage, prevLen);
+
+        if (unlikely(prevLen && terms_cmp(term.data(), term.size(), prev.data(), prev.size()) <= 0))
+                throw Switch::data_error("Unexpected term [", term, "]: terms must be provided in ascending order");
+
+        pack_term(term, prev, tctx, nextSkipListEntry, dataFlushed, &data, &index);
+
+        memcpy(prevStorage, term.data(), term.size() * sizeof(char_t));
+        prevLen = term.size();
+
+        if (data.size() > flushFreq)
+                flush();
+}
+
+void Trinity::TermsWriter::commit()
+{
+        flush();
+
+        const auto dataClosed = close(dataFd) != -1;
+        const auto indexClosed = close(indexFd) != -1;
+
+        dataFd = indexFd = -1;
+        if (!dataClosed || !indexClosed)
+                throw Switch::system_error("Failed to persist terms");
+}
+
 Trinity::SegmentTerms::SegmentTerms(const char *segmentBasePath)
 {
         int fd;
@@ -184,9 +376,8 @@ Trinity::SegmentTerms::SegmentTerms(const char *segmentBasePath)
 		if (unlikely(fileData == MAP_FAILED))
 			throw Switch::data_error("Failed to access terms.idx: ", strerror(errno));
 
-                madvise(fileData, fileSize, MADV_SEQUENTIAL);
-
-                unpack_terms_skiplist({static_cast<const uint8_t *>(fileData), uint32_t(fileSize)}, &skiplist, allocator);
+                // see materialize_skiplist()
+                termsIndex.Set(static_cast<const uint8_t *>(fileData), uint32_t(fileSize));
         }
         else
                 close(fd);
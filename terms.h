@@ -4,6 +4,8 @@
 #include <switch.h>
 #include <switch_mallocators.h>
 #include <switch_vector.h>
+#include <atomic>
+#include <mutex>
 
 // Prefic compressed terms dictionary
 // Maps from str8_t=>term_index_ctx
@@ -28,12 +30,171 @@ namespace Trinity
 #endif
         };
 
+        // A cache-friendly representation of the terms skiplist, built from the terms index when a segment is loaded.
+        //
+        // Entries are stored in Eytzinger(BFS) order, so that a search walks the array from the top down, and the next levels
+        // of the implicit tree are adjacent in memory and can be prefetched, whereas a binary search over a sorted vector will likely
+        // miss the cache for every probe. Each entry also holds the first 8 bytes of its term packed big-endian into an u64, so
+        // that most comparisons are a single integer comparison and we only need to dereference the term itself when prefixes match.
+        class terms_skiplist final
+        {
+              public:
+                struct entry final
+                {
+                        uint64_t prefix;      // first 8 bytes of the term; see key_prefix()
+                        uint32_t termOffset;  // offset in termsStorage: (u8 length, characters)
+                        uint32_t blockOffset; // offset in the terms datafile
+#ifdef TRINITY_TERMS_FAT_INDEX
+                        term_index_ctx tctx; // payload
+#endif
+                };
+
+              private:
+                entry *entries{nullptr}; // entries[0] is not used; the root is entries[1]
+                uint32_t cnt{0};
+                std::vector<char_t> termsStorage;
+
+              public:
+                // terms_cmp() compares terms lexicographically, so comparing the big-endian representations of their
+                // zero-padded prefixes gives us the same order as long as the prefixes differ
+                // This only holds if terms_cmp() orders terms by their bytes; search() only uses prefixes if TermsCmpBytewise is set
+                static inline uint64_t key_prefix(const char_t *const p, const uint8_t len) noexcept
+                {
+                        static_assert(sizeof(char_t) == sizeof(uint8_t));
+                        uint64_t v{0};
+
+                        memcpy(&v, p, len < sizeof(v) ? len : sizeof(v));
+                        return __builtin_bswap64(v);
+                }
+
+                inline str8_t term(const entry &e) const noexcept
+                {
+                        const auto p = termsStorage.data() + e.termOffset;
+
+                        return {p + 1, uint8_t(*p)};
+                }
+
+                inline auto size() const noexcept
+                {
+                        return cnt;
+                }
+
+                // The memory the skiplist occupies; e.g for mlock()
+                void memory_regions(std::vector<range_base<const uint8_t *, size_t>> *const out) const
+                {
+                        if (cnt)
+                        {
+                                out->push_back({reinterpret_cast<const uint8_t *>(entries), (cnt + 1) * sizeof(entry)});
+                                out->push_back({reinterpret_cast<const uint8_t *>(termsStorage.data()), termsStorage.size() * sizeof(char_t)});
+                        }
+                }
+
+                // Returns the entry for the last term that is lower or equal to `q` in the skiplist, or nullptr
+                const entry *search(const str8_t q) const noexcept;
+
+                // Builds the skiplist from the contents of a terms index(see pack_terms())
+                void build(const range_base<const uint8_t *, uint32_t> termsIndex);
+
+                terms_skiplist() = default;
+
+                terms_skiplist(const terms_skiplist &) = delete;
+
+                ~terms_skiplist()
+                {
+                        std::free(entries);
+                }
+        };
+
         term_index_ctx lookup_term(range_base<const uint8_t *, uint32_t> termsData, const str8_t term, const std::vector<terms_skiplist_entry> &skipList);
 
+        term_index_ctx lookup_term(range_base<const uint8_t *, uint32_t> termsData, const str8_t term, const terms_skiplist &skipList);
+
         void unpack_terms_skiplist(const range_base<const uint8_t *, const uint32_t> termsIndex, std::vector<terms_skiplist_entry> *skipList, simple_allocator &allocator);
 
         void pack_terms(std::vector<std::pair<str8_t, term_index_ctx>> &terms, IOBuffer *const data, IOBuffer *const index);
 
+        // The bigram term of (first, second) is both terms separated by a space, which tokens never include, so that it can't be confused with
+        // a regular term; see SegmentIndexSession::set_common_grams()
+        // `out` must hold Limits::MaxTermLength characters. Returns an empty term if it would be longer than that.
+        inline str8_t bigram_term(const str8_t first, const str8_t second, char_t *const out) noexcept
+        {
+                const auto len = first.size() + second.size() + 1;
+
+                if (len > Limits::MaxTermLength)
+                        return {};
+
+                memcpy(out, first.data(), first.size() * sizeof(char_t));
+                out[first.size()] = ' ';
+                memcpy(out + first.size() + 1, second.data(), second.size() * sizeof(char_t));
+                return {out, uint8_t(len)};
+        }
+
+        // The terms of a field other than the default field(0) are keyed by (field, term). That's encoded as the field ID, which is lower
+        // than any character tokens include, followed by the term, so that the terms of a field are stored together in the terms dictionary, and
+        // a query restricted to a field only accesses the field's postings; see SegmentIndexSession::document_proxy::insert() and query::parse()
+        // `out` must hold Limits::MaxTermLength characters; it's not used for the default field. Returns an empty term if it would be longer than that.
+        inline str8_t field_term(const field_id_t field, const str8_t term, char_t *const out) noexcept
+        {
+                if (!field)
+                        return term;
+                else if (term.size() + 1 > Limits::MaxTermLength)
+                        return {};
+
+                out[0] = char_t(field);
+                memcpy(out + 1, term.data(), term.size() * sizeof(char_t));
+                return {out, uint8_t(term.size() + 1)};
+        }
+
+        // Returns the field of a term; see field_term()
+        inline field_id_t term_field(const str8_t term) noexcept
+        {
+                return term && uint8_t(term.front()) <= Limits::MaxFields ? field_id_t(term.front()) : 0;
+        }
+
+        // Returns the term without its field, e.g for MatchedIndexDocumentsFilter::consider() implementations; see field_term()
+        inline str8_t term_token(const str8_t term) noexcept
+        {
+                return term_field(term) ? str8_t(term.data() + 1, term.size() - 1) : term;
+        }
+
+        // Writes the terms files(terms.data, terms.idx) of a segment incrementally, as terms are provided, so that
+        // unlike pack_terms() you don't need to hold all terms in memory; e.g MergeCandidatesCollection::merge() outputs
+        // terms in order. The files are identical to those pack_terms() would have built.
+        //
+        // Terms must be provided in ascending order(see terms_cmp()), otherwise Switch::data_error is thrown.
+        class TermsWriter final
+        {
+              private:
+                Buffer dataPath, indexPath;
+                int dataFd, indexFd;
+                IOBuffer data, index;
+                uint32_t dataFlushed{0};
+                uint32_t nextSkipListEntry{1}; // see pack_terms()
+                uint32_t flushFreq{1 * 1024 * 1024};
+                char_t prevStorage[Limits::MaxTermLength];
+                uint8_t prevLen{0};
+
+              private:
+                void flush();
+
+              public:
+                // Creates(or truncates) the terms files in basePath
+                TermsWriter(const char *basePath);
+
+                ~TermsWriter();
+
+                // The terms data and index are written to their files whenever the data grow larger than `n` bytes
+                void set_flush_freq(const uint32_t n)
+                {
+                        flushFreq = n;
+                }
+
+                void append(const str8_t term, const term_index_ctx tctx);
+
+                // Flushes and closes the terms files
+                void commit();
+        };
+
 
 
         // An abstract index source terms access wrapper
@@ -174,11 +335,18 @@ namespace Trinity
         };
 
         //A handy wrapper for memory mapped terms data and a skiplist from the terms index
+        //
+        // The skiplist is not built when the segment terms are opened, but on the first lookup (or when you explicitly materialize_skiplist()).
+        // Until then, the terms index remains memory mapped. This keeps opening segments cheap, which matters a lot when
+        // opening hundreds of them on startup, most of which won't be queried for a while.
         class SegmentTerms final
         {
               private:
-                std::vector<terms_skiplist_entry> skiplist;
-                simple_allocator allocator;
+                terms_skiplist skiplist;
+                std::once_flag skiplistOnce;
+                // set once the skiplist is built, so that lookups don't need to go through std::call_once()
+                std::atomic<bool> skiplistReady{false};
+                range_base<const uint8_t *, uint32_t> termsIndex;
                 range_base<const uint8_t *, uint32_t> termsData;
 
               public:
@@ -186,15 +354,52 @@ namespace Trinity
 
                 ~SegmentTerms()
                 {
+                        if (auto ptr = (void *)(termsIndex.offset))
+                                munmap(ptr, termsIndex.size());
+
                         if (auto ptr = (void *)(termsData.offset))
                                 munmap(ptr, termsData.size());
                 }
 
+                // Builds the skiplist from the terms index if it hasn't been built already
+                // Safe to invoke from multiple threads
+                void materialize_skiplist()
+                {
+                        if (likely(skiplistReady.load(std::memory_order_acquire)))
+                                return;
+
+                        std::call_once(skiplistOnce, [this]() {
+                                if (auto ptr = (void *)(termsIndex.offset))
+                                {
+                                        madvise(ptr, termsIndex.size(), MADV_SEQUENTIAL);
+
+                                        // the skiplist holds copies of the terms, we don't need the terms index once it's built
+                                        skiplist.build(termsIndex);
+                                        munmap(ptr, termsIndex.size());
+                                        termsIndex.Set(nullptr, 0);
+                                }
+                                skiplistReady.store(true, std::memory_order_release);
+                        });
+                }
+
                 term_index_ctx lookup(const str8_t term)
                 {
+                        materialize_skiplist();
                         return lookup_term(termsData, term, skiplist);
                 }
 
+                // The memory the terms skiplist occupies (materializes it if needed)
+                void index_regions(std::vector<range_base<const uint8_t *, size_t>> *const out)
+                {
+                        materialize_skiplist();
+                        skiplist.memory_regions(out);
+                }
+
+                auto terms_data() const noexcept
+                {
+                        return termsData;
+                }
+
                 auto terms_data_access() const
                 {
                         return terms_data_view(termsData);
@@ -14,13 +14,20 @@ namespace Trinity
 		static constexpr size_t MaxPhraseSize{16};
 		static constexpr size_t MaxQueryTokens{8192};
 		static constexpr size_t MaxTermLength{64};
-		static constexpr size_t MaxPosition{1 << 14};
+		// Positions are encoded as deltas by the codecs, and each segment tracks the highest position it indexed(see SegmentIndexSource::max_indexed_position())
+		// so that segments of short documents still use a small DocWordsSpace
+		static constexpr size_t MaxPosition{1 << 30};
+		static constexpr size_t MaxProximityWindow{1 << 14};
+		// Field IDs are encoded as the first character of a field's terms, so they must be lower than any character of a token; see field_term()
+		static constexpr size_t MaxFields{31};
 
 
 		// Sanity check
 		static_assert(MaxTermLength < 250 && MaxTermLength > 8);
 		static_assert(MaxPhraseSize <= 128);
 		static_assert(MaxQueryTokens <= 8192);
-		static_assert(MaxPosition <= std::numeric_limits<tokenpos_t>::max());
+		static_assert(MaxPosition + MaxPhraseSize <= std::numeric_limits<tokenpos_t>::max());
+		static_assert(MaxProximityWindow <= std::numeric_limits<uint16_t>::max());
+		static_assert(MaxFields < ' ' && MaxFields <= std::numeric_limits<field_id_t>::max());
 	}
 }